@@ -1,8 +1,13 @@
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <gtk/gtk.h>
 #include <gst/gst.h>
 #include <gst/interfaces/xoverlay.h>
+#include <gst/app/gstappsink.h>
+#include <gst/base/gsttypefindhelper.h>
+#include <glib/gstdio.h>
 
 #include <gdk/gdkkeysyms.h>
 
@@ -15,17 +20,204 @@
 #include <gdk/gdkquartz.h>
 #endif
 
+/* Slider seeks are coalesced, one seek once the slider was still this long */
+#define SEEK_SETTLE_MS 150
+
+/* Thumbnail strip shown as preview while dragging the slider */
+#define THUMB_COUNT 100
+#define THUMB_WIDTH 96
+#define THUMB_HEIGHT 54
+
+/* Thumbnails of one file, filled in by a background thread. Each thumbnail is
+   the keyframe a KEY_UNIT seek lands on, its timestamp forms a keyframe index */
+typedef struct _ThumbStrip{
+   gchar *uri;
+   GMutex lock;
+   GdkPixbuf *thumbs[THUMB_COUNT];
+   gint64 keyframes[THUMB_COUNT];
+   gint64 duration;
+   volatile gint cancel;
+   volatile gint refs;
+} ThumbStrip;
+
+/* Keyframe index of AVI files, kept in a sidecar under the user cache dir */
+#define INDEX_MAGIC "KIDX"
+#define INDEX_HASH_BYTES (64 * 1024)
+#define AVIIF_KEYFRAME 0x10
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+/* Open reads this much of a file to find its format before playbin2 gets it */
+#define PROBE_BYTES (64 * 1024)
+
+/* playbin2 flag that leaves out its colorspace and scale converters */
+#define PLAY_FLAG_NATIVE_VIDEO (1 << 6)
+/* playbin2 flags for network streams: download to a file while playing, and a queue2 that posts BUFFERING */
+#define PLAY_FLAG_DOWNLOAD (1 << 7)
+#define PLAY_FLAG_BUFFERING (1 << 8)
+
+/* Network buffer in seconds of stream: at least STREAM_BUFFER_SECONDS, a link
+   slower than the stream buffers its deficit over the rest of it, capped */
+#define STREAM_BUFFER_SECONDS 2
+#define STREAM_BUFFER_MAX_SECONDS 60
+
+/* Trick play shows one keyframe every TRICK_INTERVAL_MS, speeds 2x..32x both ways */
+#define TRICK_INTERVAL_MS 100
+#define TRICK_MAX_SPEED 32
+
+/* Headless benchmark: random seeks per file after the full decode */
+#define BENCH_SEEKS 20
+
+/* Decoder and multiqueue buffering sized to hold QUEUE_SECONDS of the stream,
+   never below the QUEUE_MIN_BYTES default */
+#define QUEUE_SECONDS 2
+#define QUEUE_MIN_BYTES (2 * 1024 * 1024)
+
+/* With an index, seeks are accurate when the decode from the keyframe is this short */
+#define MAX_ACCURATE_DECODE (2 * GST_SECOND)
+
+/* Decoder output frames remembered to recognise them at the sink, more than
+   playsink queues in between */
+#define DECODED_FRAMES 16
+
+/* --threads: worker threads of every decoder that has them, -1 keeps the decoder default, 0 is one per core */
+static gint decoder_threads = -1;
+
+typedef struct _AviVideo{
+   gint stream;
+   guint32 scale;
+   guint32 rate;
+   goffset indx;
+   guint32 indx_size;
+} AviVideo;
+
+typedef struct _IndexJob{
+   gchar *uri;
+   GstElement *playbin2;
+} IndexJob;
+
+/* A frame as the video decoder put it out */
+typedef struct _DecodedFrame{
+   guint8 *data;
+   GstClockTime timestamp;
+} DecodedFrame;
+
+/* Colorspace or scale converter between decoder and video sink */
+typedef struct _RenderStage{
+   struct _CustomData *data;
+   guint8 *in;
+   gint64 in_time;
+} RenderStage;
+
+/* Busy and total jiffies of one core */
+typedef struct _CoreTimes{
+   guint64 busy;
+   guint64 total;
+} CoreTimes;
+
+/* Measurements of one file in benchmark mode */
+typedef struct _BenchResult{
+   gchar *file;
+   gboolean ok;
+   gint64 size;
+   gint64 duration;
+   gint64 start;
+   gint64 first_frame;
+   volatile gint frames;
+   gint decoded;           /* frames up to end of stream */
+   gdouble decode_time;    /* s */
+   GArray *seek_times;     /* ms */
+   glong peak_rss;         /* kB, of the process up to and including this file */
+} BenchResult;
+
 typedef struct _CustomData{
    GstElement *playbin2;
+   GstElement *video_sink;
    GtkWidget *slider;
+   GtkWidget *preview;
    gulong slider_update_signal_id;
 
    GstState state;
+   GstState target_state;
    gint64 duration;
-   gdouble rate;
+
+   /* Network streams: playback is held in PAUSED while queue2 refills */
+   gboolean buffering;
+   gint buffer_seconds;
+   gint avg_in;            /* bytes/s downloaded */
+   gint avg_out;           /* bytes/s played */
+   gint64 load_time;
+   gint64 startup;
+   gint rebuffers;
+   gint64 stall_start;
+   gint64 stalled;
+
+   /* The slider follows the pipeline clock from the last queried position,
+      ticking at frame rate only while PLAYING with the window shown */
+   guint position_timeout;
+   gboolean visible;
+   gint64 anchor_position;
+   GstClockTime anchor_running;
+
+   /* Trick play speed, 0 for normal playback, negative in reverse */
+   gint trick_speed;
+   guint trick_timeout;
+   gint64 trick_position;
+   gint64 trick_keyframe;
+   volatile gint trick_frames;
+   gint64 trick_wall;
+   gint64 trick_cpu;
+
+   /* Files picked together in Open are played back to back, the next one is
+      handed to playbin2 in about-to-finish so it is prerolled before the end.
+      playlist_lock also guards next_queued, seek_start and seek_flushed, which
+      frame_probe reads from the streaming thread */
+   GMutex playlist_lock;
+   gchar **playlist;
+   gint current;
+   gboolean next_queued;
+
+   /* Gapless transition timing, last frame of one item to the first of the next */
+   gint64 last_frame;
+   gboolean switching;
+
+   /* Slider drag, the pending seek and its statistics */
+   ThumbStrip *strip;
+   gboolean dragging;
+   guint seek_timeout;
+   gint64 seek_target;
+   gint drag_changes;
+   gint drag_seeks;
+   gint64 seek_start;
+   gboolean seek_flushed;
+
+   /* Keyframe times of the open file, NULL until the index is loaded */
+   GArray *keyframes;
+   gchar *index_uri;
+   gboolean seek_accurate;
+   GArray *seek_times;
+
+   /* Render path: frames at the sink, copies made by converters on the way
+      and frames that reach the sink in the memory the decoder output. The
+      last DECODED_FRAMES decoder outputs and convert_usec are written from
+      streaming threads under render_lock */
+   GMutex render_lock;
+   DecodedFrame decoded[DECODED_FRAMES];
+   guint decoded_next;
+   volatile gint render_frames;
+   volatile gint render_copies;
+   volatile gint render_uncopied;
+   gint64 convert_usec;
+
+   /* Late frames dropped by the decoder or the sink, core load while playing */
+   gint dropped;
+   GArray *cores;
 } CustomData;
 
-static void change_rate(CustomData *data);
+static void start_trick(CustomData *data, gint speed);
+static void stop_trick(CustomData *data);
+static void start_thumbnails(CustomData *data, const gchar *uri);
+static void start_index(CustomData *data, const gchar *uri);
 
 static void realize_cb (GtkWidget *widget, CustomData *data){
    GdkWindow *window = gtk_widget_get_window (widget);
@@ -42,41 +234,112 @@ static void realize_cb (GtkWidget *widget, CustomData *data){
    window_handle = GDK_WINDOW_XID(window);
 #endif
 
-   gst_x_overlay_set_window_handle (GST_X_OVERLAY (data->playbin2), window_handle);
+   /* Straight to the sink when it renders itself, through playbin2 for autovideosink */
+   if (GST_IS_X_OVERLAY(data->video_sink))
+      gst_x_overlay_set_window_handle (GST_X_OVERLAY (data->video_sink), window_handle);
+   else
+      gst_x_overlay_set_window_handle (GST_X_OVERLAY (data->playbin2), window_handle);
+}
+
+/* State the user asked for, PLAYING waits in PAUSED while buffering */
+static void set_target_state(CustomData *data, GstState state){
+   data->target_state = state;
+   if (state == GST_STATE_PLAYING && data->buffering)
+      return;
+   gst_element_set_state(data->playbin2, state);
+}
+
+/* A new uri is about to preroll, startup latency counts from here */
+static void start_load(CustomData *data){
+   data->buffering = FALSE;
+   data->buffer_seconds = STREAM_BUFFER_SECONDS;
+   data->avg_in = 0;
+   data->avg_out = 0;
+   data->load_time = g_get_monotonic_time();
+   data->startup = 0;
+   data->rebuffers = 0;
+   data->stalled = 0;
 }
 
 static void play_cb (GtkButton *button, CustomData *data){
-   if (data->rate != 1.0){   
-      data->rate = 1.0;
-      change_rate(data);
+   if (data->trick_speed){
+      /* Continue from the keyframe trick play last showed */
+      stop_trick(data);
+      gst_element_seek_simple(data->playbin2, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, data->trick_keyframe);
    }
-   gst_element_set_state (data->playbin2, GST_STATE_PLAYING);
+   set_target_state(data, GST_STATE_PLAYING);
 }
 
 static void pause_cb (GtkButton *button, CustomData *data){
-   gst_element_set_state (data->playbin2, GST_STATE_PAUSED);
+   stop_trick(data);
+   set_target_state(data, GST_STATE_PAUSED);
 }
 
 static void stop_cb (GtkButton *button, CustomData *data){
-   gst_element_set_state(data->playbin2, GST_STATE_READY);
+   stop_trick(data);
+   set_target_state(data, GST_STATE_READY);
 }
 
+/* Every press doubles the speed up to TRICK_MAX_SPEED, then starts over at 2x */
 static void forward_cb(GtkButton *button, CustomData *data){
-   data->rate = 2.0;
-   change_rate(data);
+   start_trick(data, data->trick_speed > 0 && data->trick_speed < TRICK_MAX_SPEED ? data->trick_speed * 2 : 2);
 }
 
 static void rewind_cb(GtkButton *button, CustomData *data){
-   data->rate = -2.0;
-   change_rate(data);
+   start_trick(data, data->trick_speed < 0 && -data->trick_speed < TRICK_MAX_SPEED ? data->trick_speed * 2 : -2);
+}
+
+/* Typefinds the head of the file without building a pipeline, it is playable
+   when some demuxer, parser or decoder accepts the caps found. Only the
+   container is identified, the codecs inside are not, so a missing decoder
+   still shows up as an error from playbin2. Streams that GIO cannot read are
+   left to playbin2 */
+static gboolean probe_uri(const gchar *uri, gchar **format){
+   GFile *file = g_file_new_for_uri(uri);
+   GFileInputStream *stream;
+   GstBuffer *buffer;
+   GstCaps *caps;
+   GList *factories, *usable;
+   gsize size = 0;
+   gboolean supported;
+
+   *format = NULL;
+   stream = g_file_read(file, NULL, NULL);
+   g_object_unref(file);
+   if (!stream){
+      *format = g_strdup("unreadable");
+      return !gst_uri_has_protocol(uri, "file");
+   }
+   buffer = gst_buffer_new_and_alloc(PROBE_BYTES);
+   g_input_stream_read_all(G_INPUT_STREAM(stream), GST_BUFFER_DATA(buffer), PROBE_BYTES, &size, NULL, NULL);
+   g_object_unref(stream);
+   GST_BUFFER_SIZE(buffer) = size;
+   caps = size ? gst_type_find_helper_for_buffer(NULL, buffer, NULL) : NULL;
+   gst_buffer_unref(buffer);
+   if (!caps){
+      *format = g_strdup("unknown");
+      return FALSE;
+   }
+
+   factories = gst_element_factory_list_get_elements(GST_ELEMENT_FACTORY_TYPE_DEMUXER |
+      GST_ELEMENT_FACTORY_TYPE_PARSER | GST_ELEMENT_FACTORY_TYPE_DECODER, GST_RANK_MARGINAL);
+   usable = gst_element_factory_list_filter(factories, caps, GST_PAD_SINK, FALSE);
+   supported = usable != NULL;
+   *format = g_strdup(gst_structure_get_name(gst_caps_get_structure(caps, 0)));
+   gst_plugin_feature_list_free(usable);
+   gst_plugin_feature_list_free(factories);
+   gst_caps_unref(caps);
+   return supported;
 }
 
 static void open_cb(GtkButton *button, CustomData *data){
-   GstFormat fmt = GST_FORMAT_TIME;
    GtkWidget *window = gtk_widget_get_toplevel (GTK_WIDGET(button)); 
    GtkWidget *dialog;
+   GSList *fileuris, *l;
+   GPtrArray *playlist;
    char *fileuri;
-   char *extension;
+   gchar *format;
+   gint64 start;
 
    dialog = gtk_file_chooser_dialog_new ("Open File",
       GTK_WINDOW(window),
@@ -84,37 +347,53 @@ static void open_cb(GtkButton *button, CustomData *data){
       GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
       GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT,
       NULL);
+   gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
 
 
    if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT){
-      fileuri = gtk_file_chooser_get_uri (GTK_FILE_CHOOSER (dialog));
-
+      fileuris = gtk_file_chooser_get_uris (GTK_FILE_CHOOSER (dialog));
+      playlist = g_ptr_array_new();
+
+      for (l = fileuris; l; l = l->next){
+         fileuri = l->data;
+         start = g_get_monotonic_time();
+         if (probe_uri(fileuri, &format)){
+            g_print("Format: %s (%.2f ms)\n", format, (g_get_monotonic_time() - start) / 1000.0);
+            g_ptr_array_add(playlist, fileuri);
+         }
+         else{
+            g_printerr("Sorry the format %s is not supported. \n", format);
+            g_free(fileuri);
+         }
+         g_free(format);
+      }
+      g_slist_free(fileuris);
+      g_ptr_array_add(playlist, NULL);
 
-      extension = strrchr(fileuri, '.');
-      if (strcasecmp(extension, ".AVI") == 0){
-         g_print("Extension: %s \n", extension);
+      if (playlist->len > 1){
          gst_element_set_state(data->playbin2, GST_STATE_READY);
-         g_object_set(data->playbin2, "uri", fileuri, NULL);
+         g_mutex_lock(&data->playlist_lock);
+         g_strfreev(data->playlist);
+         data->playlist = (gchar **)g_ptr_array_free(playlist, FALSE);
+         data->current = 0;
+         data->next_queued = FALSE;
+         g_mutex_unlock(&data->playlist_lock);
+         g_object_set(data->playbin2, "uri", data->playlist[0], NULL);
+         start_load(data);
+         start_thumbnails(data, data->playlist[0]);
+         start_index(data, data->playlist[0]);
       }
       else{
-         g_printerr("Sorry the format %s is not supported. \n", extension);
+         g_ptr_array_free(playlist, TRUE);
       }
    }
 
    gtk_range_set_value(GTK_RANGE(data->slider), (gdouble)0 * GST_SECOND);
    gtk_widget_destroy (dialog);
 
-   gst_element_set_state(data->playbin2, GST_STATE_PAUSED);
-
+   /* Duration is known once the new file has prerolled */
    data->duration = GST_CLOCK_TIME_NONE;
-   if (!GST_CLOCK_TIME_IS_VALID(data->duration)){
-      if (!gst_element_query_duration(data->playbin2, &fmt, &data->duration)){
-         g_printerr("Could not query current duration.\n");
-      }
-      else {
-         gtk_range_set_range(GTK_RANGE(data->slider), 0, (gdouble)data->duration / GST_SECOND);
-      }
-   }
+   set_target_state(data, GST_STATE_PAUSED);
 }
 
 static void fullscreen_cb(GtkButton *button, CustomData *data){
@@ -154,9 +433,573 @@ static gboolean expose_cb (GtkWidget *widget, GdkEventExpose *event, CustomData
    return FALSE;
 }
 
+static void thumb_strip_unref(ThumbStrip *strip){
+   gint i;
+
+   if (!g_atomic_int_dec_and_test(&strip->refs))
+      return;
+   for (i = 0; i < THUMB_COUNT; i++){
+      if (strip->thumbs[i])
+         g_object_unref(strip->thumbs[i]);
+   }
+   g_mutex_clear(&strip->lock);
+   g_free(strip->uri);
+   g_free(strip);
+}
+
+/* Decode one scaled down keyframe every duration / THUMB_COUNT in a pipeline of its own */
+static gpointer thumbnail_thread(ThumbStrip *strip){
+   GstElement *pipeline, *sink;
+   GstBuffer *buffer;
+   GdkPixbuf *pixbuf;
+   GstFormat fmt = GST_FORMAT_TIME;
+   gint64 start = g_get_monotonic_time();
+   gchar *desc;
+   gint i, row, count = 0;
+
+   /* Only video is decoded, audio streams are left alone */
+   desc = g_strdup_printf("uridecodebin uri=\"%s\" caps=\"video/x-raw-yuv;video/x-raw-rgb\" ! ffmpegcolorspace ! videoscale ! "
+      "video/x-raw-rgb,bpp=24,depth=24,width=%d,height=%d,pixel-aspect-ratio=1/1 ! "
+      "appsink name=sink sync=false max-buffers=1", strip->uri, THUMB_WIDTH, THUMB_HEIGHT);
+   pipeline = gst_parse_launch(desc, NULL);
+   g_free(desc);
+   if (!pipeline){
+      g_printerr("Could not create thumbnail pipeline.\n");
+      thumb_strip_unref(strip);
+      return NULL;
+   }
+   sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+
+   gst_element_set_state(pipeline, GST_STATE_PAUSED);
+   if (gst_element_get_state(pipeline, NULL, NULL, 5 * GST_SECOND) == GST_STATE_CHANGE_SUCCESS &&
+      gst_element_query_duration(pipeline, &fmt, &strip->duration) && strip->duration > 0){
+      for (i = 0; i < THUMB_COUNT && !g_atomic_int_get(&strip->cancel); i++){
+         gst_element_seek_simple(pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, strip->duration / THUMB_COUNT * i);
+         gst_element_get_state(pipeline, NULL, NULL, GST_SECOND);
+         buffer = gst_app_sink_pull_preroll(GST_APP_SINK(sink));
+         if (!buffer)
+            continue;
+
+         /* RGB rows are padded to 4 bytes by GStreamer */
+         pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, THUMB_WIDTH, THUMB_HEIGHT);
+         for (row = 0; row < THUMB_HEIGHT; row++){
+            memcpy(gdk_pixbuf_get_pixels(pixbuf) + row * gdk_pixbuf_get_rowstride(pixbuf),
+               GST_BUFFER_DATA(buffer) + row * GST_ROUND_UP_4(THUMB_WIDTH * 3), THUMB_WIDTH * 3);
+         }
+
+         g_mutex_lock(&strip->lock);
+         strip->thumbs[i] = pixbuf;
+         strip->keyframes[i] = GST_BUFFER_TIMESTAMP(buffer);
+         g_mutex_unlock(&strip->lock);
+         gst_buffer_unref(buffer);
+         count++;
+      }
+      g_print("Thumbnail strip: %d keyframes in %.0f ms\n", count, (g_get_monotonic_time() - start) / 1000.0);
+   }
+   else{
+      g_printerr("Could not preroll thumbnail pipeline.\n");
+   }
+
+   gst_element_set_state(pipeline, GST_STATE_NULL);
+   gst_object_unref(sink);
+   gst_object_unref(pipeline);
+   thumb_strip_unref(strip);
+   return NULL;
+}
+
+/* Replace the thumbnail strip, an extraction still running for the old file is cancelled */
+static void start_thumbnails(CustomData *data, const gchar *uri){
+   ThumbStrip *strip;
+
+   if (data->strip){
+      g_atomic_int_set(&data->strip->cancel, 1);
+      thumb_strip_unref(data->strip);
+      data->strip = NULL;
+   }
+   /* Only local files, a network stream would be downloaded twice */
+   if (!gst_uri_has_protocol(uri, "file"))
+      return;
+
+   strip = g_new0(ThumbStrip, 1);
+   strip->uri = g_strdup(uri);
+   strip->refs = 2;
+   g_mutex_init(&strip->lock);
+   data->strip = strip;
+   g_thread_unref(g_thread_new("thumbnails", (GThreadFunc)thumbnail_thread, strip));
+}
+
+/* Show the thumbnail closest to position while dragging, nothing is decoded */
+static void show_preview(CustomData *data, gint64 position){
+   ThumbStrip *strip = data->strip;
+   gint i;
+
+   if (!strip || !data->dragging || strip->duration <= 0)
+      return;
+
+   i = CLAMP(position * THUMB_COUNT / strip->duration, 0, THUMB_COUNT - 1);
+   g_mutex_lock(&strip->lock);
+   /* Fall back to the closest earlier thumbnail while extraction is still running */
+   while (i > 0 && !strip->thumbs[i])
+      i--;
+   if (strip->thumbs[i]){
+      gtk_image_set_from_pixbuf(GTK_IMAGE(data->preview), strip->thumbs[i]);
+      gtk_widget_show(data->preview);
+   }
+   g_mutex_unlock(&strip->lock);
+}
+
+static gboolean read_at(GInputStream *in, goffset offset, guint8 *buf, gsize len){
+   gsize got = 0;
+
+   if (!g_seekable_seek(G_SEEKABLE(in), offset, G_SEEK_SET, NULL, NULL))
+      return FALSE;
+   return g_input_stream_read_all(in, buf, len, &got, NULL, NULL) && got == len;
+}
+
+/* Frame number to stream time */
+static void index_add(GArray *index, guint64 frame, guint32 scale, guint32 rate){
+   gint64 time = gst_util_uint64_scale(frame * scale, GST_SECOND, rate);
+   g_array_append_val(index, time);
+}
+
+/* OpenDML super index: every entry points to an ix## chunk listing the chunks
+   of the video stream, bit 31 of the size marks frames that are not keyframes.
+   Counts come from the file, each must fit in its chunk and the chunk in the file */
+static gboolean index_from_indx(GInputStream *in, goffset indx, guint32 size, guint64 file_size,
+   guint32 scale, guint32 rate, GArray *index){
+   guint8 head[32], entry[16];
+   guint8 *chunks;
+   guint32 entries, count, i, j;
+   guint64 chunk, chunk_size;
+   gsize len;
+   guint64 frame = 0;
+
+   if (size < 24 || !read_at(in, indx, head, 24) || head[3] != AVI_INDEX_OF_INDEXES)
+      return FALSE;
+   entries = MIN(GST_READ_UINT32_LE(head + 4), (size - 24) / 16);
+
+   for (i = 0; i < entries; i++){
+      if (!read_at(in, indx + 24 + (goffset)i * 16, entry, 16))
+         return FALSE;
+      /* Chunk header and the standard index header before the entries */
+      chunk = GST_READ_UINT64_LE(entry);
+      if (chunk >= file_size || !read_at(in, chunk, head, 32) || head[8 + 3] != AVI_INDEX_OF_CHUNKS)
+         return FALSE;
+      chunk_size = GST_READ_UINT32_LE(head + 4);
+      count = GST_READ_UINT32_LE(head + 8 + 4);
+      if (chunk_size < 24 || chunk + 8 + chunk_size > file_size || (guint64)count * 8 > chunk_size - 24)
+         return FALSE;
+      len = (gsize)count * 8;
+      chunks = g_malloc(len);
+      if (!read_at(in, chunk + 32, chunks, len)){
+         g_free(chunks);
+         return FALSE;
+      }
+      for (j = 0; j < count; j++, frame++){
+         if (!(GST_READ_UINT32_LE(chunks + j * 8 + 4) & 0x80000000))
+            index_add(index, frame, scale, rate);
+      }
+      g_free(chunks);
+   }
+   return index->len > 0;
+}
+
+/* AVI 1.0 index: 16 byte entries for all streams after the movi list. Only
+   the part of it that is in the file is read */
+static gboolean index_from_idx1(GInputStream *in, goffset idx1, guint32 size, guint64 file_size,
+   gint stream, guint32 scale, guint32 rate, GArray *index){
+   guint8 *entries;
+   guint64 frame = 0;
+   gsize len, i;
+
+   if ((guint64)idx1 >= file_size)
+      return FALSE;
+   len = MIN((guint64)size, file_size - idx1) / 16 * 16;
+   if (len == 0)
+      return FALSE;
+   entries = g_malloc(len);
+   if (!read_at(in, idx1, entries, len)){
+      g_free(entries);
+      return FALSE;
+   }
+   for (i = 0; i < len; i += 16){
+      /* Video chunks are ##dc or ##db, ## being the stream number */
+      if (entries[i] - '0' == stream / 10 && entries[i + 1] - '0' == stream % 10 && entries[i + 2] == 'd'){
+         if (GST_READ_UINT32_LE(entries + i + 4) & AVIIF_KEYFRAME)
+            index_add(index, frame, scale, rate);
+         frame++;
+      }
+   }
+   g_free(entries);
+   return index->len > 0;
+}
+
+/* Stream headers in hdrl: time base of the first video stream and its OpenDML index */
+static void parse_hdrl(GInputStream *in, goffset off, goffset end, AviVideo *video){
+   guint8 head[12], strh[36];
+   goffset str, strend;
+   guint32 size, strsize;
+   gint stream = 0;
+
+   for (; off + 8 <= end; off += 8 + size + (size & 1)){
+      if (!read_at(in, off, head, 12))
+         return;
+      size = GST_READ_UINT32_LE(head + 4);
+      if (memcmp(head, "LIST", 4) != 0 || memcmp(head + 8, "strl", 4) != 0)
+         continue;
+
+      strend = off + 8 + size;
+      for (str = off + 12; str + 8 <= strend; str += 8 + strsize + (strsize & 1)){
+         if (!read_at(in, str, strh, 8))
+            break;
+         strsize = GST_READ_UINT32_LE(strh + 4);
+         if (memcmp(strh, "strh", 4) == 0 && video->stream < 0 && strsize >= 28 &&
+            read_at(in, str + 8, strh + 8, 28) && memcmp(strh + 8, "vids", 4) == 0){
+            video->stream = stream;
+            video->scale = GST_READ_UINT32_LE(strh + 8 + 20);
+            video->rate = GST_READ_UINT32_LE(strh + 8 + 24);
+         }
+         if (memcmp(strh, "indx", 4) == 0 && video->stream == stream){
+            video->indx = str + 8;
+            video->indx_size = strsize;
+         }
+      }
+      stream++;
+   }
+}
+
+/* Walk the RIFF chunks of an AVI file and collect the keyframe times of its
+   first video stream, from the OpenDML index when present else from idx1 */
+static GArray *build_index(GInputStream *in){
+   AviVideo video = { -1, 0, 0, 0, 0 };
+   guint8 head[12];
+   GArray *index;
+   goffset off, end, idx1 = 0;
+   guint32 size, idx1_size = 0;
+   guint64 file_size;
+
+   if (!g_seekable_seek(G_SEEKABLE(in), 0, G_SEEK_END, NULL, NULL))
+      return NULL;
+   file_size = g_seekable_tell(G_SEEKABLE(in));
+   if (!read_at(in, 0, head, 12) || memcmp(head, "RIFF", 4) != 0 || memcmp(head + 8, "AVI ", 4) != 0)
+      return NULL;
+   end = 8 + (goffset)GST_READ_UINT32_LE(head + 4);
+
+   for (off = 12; off + 8 <= end; off += 8 + size + (size & 1)){
+      if (!read_at(in, off, head, 12))
+         break;
+      size = GST_READ_UINT32_LE(head + 4);
+      if (memcmp(head, "idx1", 4) == 0){
+         idx1 = off + 8;
+         idx1_size = size;
+      }
+      else if (memcmp(head, "LIST", 4) == 0 && memcmp(head + 8, "hdrl", 4) == 0){
+         parse_hdrl(in, off + 12, off + 8 + size, &video);
+      }
+   }
+
+   if (video.stream < 0 || video.scale == 0 || video.rate == 0)
+      return NULL;
+
+   index = g_array_new(FALSE, FALSE, sizeof(gint64));
+   if (video.indx && !index_from_indx(in, video.indx, video.indx_size, file_size, video.scale, video.rate, index))
+      g_array_set_size(index, 0);
+   if (index->len == 0 && idx1)
+      index_from_idx1(in, idx1, idx1_size, file_size, video.stream, video.scale, video.rate, index);
+   if (index->len == 0){
+      g_array_free(index, TRUE);
+      return NULL;
+   }
+   return index;
+}
+
+/* Cache key of a file: size, modification time and its first and last
+   INDEX_HASH_BYTES, hashing all of a large file would take seconds */
+static gchar *index_key(GFile *file, GInputStream *in){
+   GFileInfo *info;
+   GChecksum *checksum;
+   guint8 *buf;
+   guint64 size;
+   guint64 mtime;
+   gsize len;
+   gchar *key;
+
+   info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+   if (!info)
+      return NULL;
+   size = g_file_info_get_size(info);
+   mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+   g_object_unref(info);
+
+   checksum = g_checksum_new(G_CHECKSUM_SHA1);
+   g_checksum_update(checksum, (const guchar *)&size, sizeof(size));
+   g_checksum_update(checksum, (const guchar *)&mtime, sizeof(mtime));
+   len = MIN(size, INDEX_HASH_BYTES);
+   buf = g_malloc(len);
+   if (read_at(in, 0, buf, len))
+      g_checksum_update(checksum, buf, len);
+   if (read_at(in, size - len, buf, len))
+      g_checksum_update(checksum, buf, len);
+   g_free(buf);
+
+   key = g_strdup(g_checksum_get_string(checksum));
+   g_checksum_free(checksum);
+   return key;
+}
+
+/* Load the keyframe index of a file from its sidecar, or build and save it */
+static gpointer index_thread(IndexJob *job){
+   GFile *file;
+   GFileInputStream *in;
+   GArray *index = NULL;
+   gchar *key, *dir, *path, *contents;
+   gsize length;
+   const gchar *source = "sidecar";
+   gint64 start = g_get_monotonic_time();
+
+   file = g_file_new_for_uri(job->uri);
+   in = g_file_read(file, NULL, NULL);
+   key = in ? index_key(file, G_INPUT_STREAM(in)) : NULL;
+
+   if (key){
+      dir = g_build_filename(g_get_user_cache_dir(), "mediaplayer", NULL);
+      path = g_strdup_printf("%s/%s.kidx", dir, key);
+      if (g_file_get_contents(path, &contents, &length, NULL)){
+         if (length >= 8 && memcmp(contents, INDEX_MAGIC, 4) == 0 &&
+            length == 8 + GST_READ_UINT32_LE(contents + 4) * sizeof(gint64)){
+            index = g_array_sized_new(FALSE, FALSE, sizeof(gint64), GST_READ_UINT32_LE(contents + 4));
+            g_array_append_vals(index, contents + 8, GST_READ_UINT32_LE(contents + 4));
+         }
+         g_free(contents);
+      }
+      if (!index){
+         source = "file";
+         index = build_index(G_INPUT_STREAM(in));
+         if (index){
+            contents = g_malloc(8 + index->len * sizeof(gint64));
+            memcpy(contents, INDEX_MAGIC, 4);
+            GST_WRITE_UINT32_LE(contents + 4, index->len);
+            memcpy(contents + 8, index->data, index->len * sizeof(gint64));
+            g_mkdir_with_parents(dir, 0755);
+            if (!g_file_set_contents(path, contents, 8 + index->len * sizeof(gint64), NULL))
+               g_printerr("Could not save keyframe index %s\n", path);
+            g_free(contents);
+         }
+      }
+      g_free(path);
+      g_free(dir);
+      g_free(key);
+   }
+
+   if (index){
+      g_print("Keyframe index: %u keyframes from %s in %.1f ms\n", index->len, source,
+         (g_get_monotonic_time() - start) / 1000.0);
+      gst_element_post_message(job->playbin2, gst_message_new_application(GST_OBJECT(job->playbin2),
+         gst_structure_new("index-ready", "uri", G_TYPE_STRING, job->uri, "index", G_TYPE_POINTER, index, NULL)));
+   }
+
+   if (in)
+      g_object_unref(in);
+   g_object_unref(file);
+   gst_object_unref(job->playbin2);
+   g_free(job->uri);
+   g_free(job);
+   return NULL;
+}
+
+/* Index AVI files in the background, seeks use it once it is ready */
+static void start_index(CustomData *data, const gchar *uri){
+   IndexJob *job;
+
+   if (data->keyframes){
+      g_array_free(data->keyframes, TRUE);
+      data->keyframes = NULL;
+   }
+   g_free(data->index_uri);
+   data->index_uri = g_strdup(uri);
+   if (!gst_uri_has_protocol(uri, "file"))
+      return;
+
+   job = g_new0(IndexJob, 1);
+   job->uri = g_strdup(uri);
+   job->playbin2 = gst_object_ref(data->playbin2);
+   g_thread_unref(g_thread_new("index", (GThreadFunc)index_thread, job));
+}
+
+/* Time of the last keyframe at or before position */
+static gint64 find_keyframe(GArray *index, gint64 position){
+   guint lo = 0, hi = index->len, mid;
+
+   while (hi - lo > 1){
+      mid = (lo + hi) / 2;
+      if (g_array_index(index, gint64, mid) <= position)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   return g_array_index(index, gint64, lo);
+}
+
+static void issue_seek(CustomData *data){
+   GstSeekFlags flags = GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT;
+
+   /* The index tells how far the decoder runs from the keyframe, seek exactly when that is short */
+   data->seek_accurate = data->keyframes && data->seek_target - find_keyframe(data->keyframes, data->seek_target) <= MAX_ACCURATE_DECODE;
+   if (data->seek_accurate)
+      flags = GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE;
+
+   g_mutex_lock(&data->playlist_lock);
+   data->seek_start = g_get_monotonic_time();
+   data->seek_flushed = FALSE;
+   g_mutex_unlock(&data->playlist_lock);
+   data->drag_seeks++;
+   gst_element_seek_simple(data->playbin2, GST_FORMAT_TIME, flags, data->seek_target);
+}
+
+static gboolean seek_settled_cb (CustomData *data){
+   data->seek_timeout = 0;
+   issue_seek(data);
+   return FALSE;
+}
+
+/* Seeks are coalesced, moving the slider only updates the target and the
+   preview, the seek is issued once it has been still for SEEK_SETTLE_MS */
 static void slider_cb (GtkRange *range, CustomData *data){
    gdouble value = gtk_range_get_value(GTK_RANGE(data->slider));
-   gst_element_seek_simple(data->playbin2, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, (gint64)(value * GST_SECOND));
+
+   data->seek_target = (gint64)(value * GST_SECOND);
+   data->drag_changes++;
+   show_preview(data, data->seek_target);
+
+   if (data->seek_timeout)
+      g_source_remove(data->seek_timeout);
+   data->seek_timeout = g_timeout_add(SEEK_SETTLE_MS, (GSourceFunc)seek_settled_cb, data);
+}
+
+static gboolean slider_press_cb (GtkWidget *widget, GdkEventButton *event, CustomData *data){
+   data->dragging = TRUE;
+   data->drag_changes = 0;
+   data->drag_seeks = 0;
+   return FALSE;
+}
+
+/* Releasing the slider seeks right away instead of waiting for the timeout */
+static gboolean slider_release_cb (GtkWidget *widget, GdkEventButton *event, CustomData *data){
+   if (data->seek_timeout){
+      g_source_remove(data->seek_timeout);
+      seek_settled_cb(data);
+   }
+   if (data->dragging){
+      g_print("Drag: %d slider moves, %d seeks issued\n", data->drag_changes, data->drag_seeks);
+   }
+   data->dragging = FALSE;
+   gtk_widget_hide(data->preview);
+   return FALSE;
+}
+
+/* Running time of the pipeline, none while it has no clock */
+static GstClockTime running_time(CustomData *data){
+   GstClock *clock = gst_element_get_clock(data->playbin2);
+   GstClockTime now;
+
+   if (!clock)
+      return GST_CLOCK_TIME_NONE;
+   now = gst_clock_get_time(clock) - gst_element_get_base_time(data->playbin2);
+   gst_object_unref(clock);
+   return now;
+}
+
+static void set_slider(CustomData *data, gint64 position){
+   /* The user has the slider */
+   if (data->dragging)
+      return;
+   g_signal_handler_block(data->slider, data->slider_update_signal_id);
+   gtk_range_set_value(GTK_RANGE(data->slider), (gdouble)position / GST_SECOND);
+   g_signal_handler_unblock(data->slider, data->slider_update_signal_id);
+}
+
+/* Asked once per preroll or DURATION message, not on every refresh */
+static void update_duration(CustomData *data){
+   GstFormat fmt = GST_FORMAT_TIME;
+
+   if (!gst_element_query_duration(data->playbin2, &fmt, &data->duration)){
+      g_printerr("Could not query current duration.\n");
+      data->duration = GST_CLOCK_TIME_NONE;
+   }
+   else {
+      gtk_range_set_range(GTK_RANGE(data->slider), 0, (gdouble)data->duration / GST_SECOND);
+   }
+}
+
+/* Queries the position once and anchors the clock based ticks to it, after
+   preroll, seeks and state changes */
+static void refresh_ui (CustomData *data){
+   GstFormat fmt = GST_FORMAT_TIME;
+   gint64 current = -1;
+
+   if (data->state < GST_STATE_PAUSED){
+      return;
+   }
+
+   if (gst_element_query_position(data->playbin2, &fmt, &current)){
+      data->anchor_position = current;
+      data->anchor_running = running_time(data);
+      set_slider(data, current);
+   }
+}
+
+static gboolean position_tick_cb (CustomData *data){
+   GstClockTime now = running_time(data);
+
+   if (GST_CLOCK_TIME_IS_VALID(now) && GST_CLOCK_TIME_IS_VALID(data->anchor_running) && now >= data->anchor_running)
+      set_slider(data, data->anchor_position + (gint64)(now - data->anchor_running));
+   return TRUE;
+}
+
+/* Frame interval of the video shown, 25 fps without video. No faster than the
+   slider can move a pixel */
+static guint tick_interval(CustomData *data){
+   GstPad *pad = gst_element_get_static_pad(data->video_sink, "sink");
+   GstCaps *caps = gst_pad_get_negotiated_caps(pad);
+   GtkAllocation allocation;
+   gint num = 0, den = 0;
+   guint interval;
+
+   if (caps){
+      gst_structure_get_fraction(gst_caps_get_structure(caps, 0), "framerate", &num, &den);
+      gst_caps_unref(caps);
+   }
+   gst_object_unref(pad);
+   if (num <= 0 || den <= 0){
+      num = 25;
+      den = 1;
+   }
+   interval = 1000 * den / num;
+
+   gtk_widget_get_allocation(data->slider, &allocation);
+   if (GST_CLOCK_TIME_IS_VALID(data->duration) && allocation.width > 0)
+      interval = MAX(interval, data->duration / GST_MSECOND / allocation.width);
+   return MAX(interval, 10);
+}
+
+static void update_ticker(CustomData *data){
+   gboolean tick = data->state == GST_STATE_PLAYING && data->visible;
+
+   if (tick && !data->position_timeout){
+      refresh_ui(data);
+      data->position_timeout = g_timeout_add(tick_interval(data), (GSourceFunc)position_tick_cb, data);
+   }
+   else if (!tick && data->position_timeout){
+      g_source_remove(data->position_timeout);
+      data->position_timeout = 0;
+      refresh_ui(data);
+   }
+}
+
+static gboolean window_state_cb (GtkWidget *widget, GdkEventWindowState *event, CustomData *data){
+   data->visible = !(event->new_window_state & (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN));
+   update_ticker(data);
+   return FALSE;
 }
 
 static void create_ui (CustomData *data){
@@ -169,6 +1012,7 @@ static void create_ui (CustomData *data){
 
    main_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
    g_signal_connect (G_OBJECT(main_window), "delete-event", G_CALLBACK(delete_event_cb), data);
+   g_signal_connect (G_OBJECT(main_window), "window-state-event", G_CALLBACK(window_state_cb), data);
    
    video_window = gtk_drawing_area_new();
    gtk_widget_set_double_buffered (video_window, FALSE);
@@ -200,9 +1044,17 @@ static void create_ui (CustomData *data){
 
    data->slider = gtk_hscale_new_with_range(0, 100, 1);
    gtk_scale_set_draw_value(GTK_SCALE(data->slider), 0);
+   /* Whole seconds would make the ticks jump */
+   gtk_scale_set_digits(GTK_SCALE(data->slider), 2);
    data->slider_update_signal_id = g_signal_connect(G_OBJECT(data->slider), "value-changed", G_CALLBACK(slider_cb), data);
+   g_signal_connect(G_OBJECT(data->slider), "button-press-event", G_CALLBACK(slider_press_cb), data);
+   g_signal_connect(G_OBJECT(data->slider), "button-release-event", G_CALLBACK(slider_release_cb), data);
+
+   data->preview = gtk_image_new();
+   gtk_widget_set_size_request(data->preview, THUMB_WIDTH, THUMB_HEIGHT);
 
    controls = gtk_hbox_new(FALSE, 0);
+   gtk_box_pack_start(GTK_BOX(controls), data->preview, FALSE, FALSE, 2);
    gtk_box_pack_start(GTK_BOX(controls), data->slider, TRUE, TRUE, 2);
    gtk_box_pack_start(GTK_BOX(controls), open_button, FALSE, FALSE, 2);
    gtk_box_pack_start(GTK_BOX(controls), play_button, FALSE, FALSE, 2);
@@ -221,43 +1073,49 @@ static void create_ui (CustomData *data){
    gtk_container_add(GTK_CONTAINER(main_window), main_box);
    gtk_window_set_default_size(GTK_WINDOW(main_window), 640, 480);
    gtk_widget_show_all(main_window);
+   gtk_widget_hide(data->preview);
 }
 
+static void tags_cb (GstElement *playbin2, gint stream, CustomData *data){
+   gst_element_post_message(playbin2, gst_message_new_application(GST_OBJECT(playbin2), gst_structure_new("tags-changed", NULL)));   
+}
 
-static gboolean refresh_ui (CustomData *data){
-   GstFormat fmt = GST_FORMAT_TIME;
-   gint64 current = -1;
-
-   if (data->state < GST_STATE_PAUSED){
-      return TRUE;
-   }
+/* The XVideo port does not list every format a decoder outputs. When caps
+   negotiation fails with native video, drop the flag so playbin2 plugs
+   converters and start the item again */
+static gboolean retry_without_native_video(CustomData *data, GError *err, const gchar *debug_info){
+   GstBus *bus;
+   guint flags;
 
-   if (!GST_CLOCK_TIME_IS_VALID(data->duration)){
-      if (!gst_element_query_duration(data->playbin2, &fmt, &data->duration)){
-         g_printerr("Could not query current duration.\n");
-      }
-      else {
-         gtk_range_set_range(GTK_RANGE(data->slider), 0, (gdouble)data->duration / GST_SECOND);
-      }
-   }
+   g_object_get(data->playbin2, "flags", &flags, NULL);
+   if (!(flags & PLAY_FLAG_NATIVE_VIDEO) || err->domain != GST_STREAM_ERROR)
+      return FALSE;
+   if (err->code != GST_STREAM_ERROR_FORMAT && !(debug_info && strstr(debug_info, "not-negotiated")))
+      return FALSE;
 
-   if (gst_element_query_position(data->playbin2, &fmt, &current)){
-      g_signal_handler_block(data->slider, data->slider_update_signal_id);
-      gtk_range_set_value(GTK_RANGE(data->slider), (gdouble)current / GST_SECOND);
-      g_signal_handler_unblock(data->slider, data->slider_update_signal_id);
-   }
+   g_print("Video sink does not take the decoder's format, retrying with converters\n");
+   g_object_set(data->playbin2, "flags", flags & ~PLAY_FLAG_NATIVE_VIDEO, NULL);
+   gst_element_set_state(data->playbin2, GST_STATE_READY);
+   /* Errors other elements posted for the same failure are stale now */
+   bus = gst_element_get_bus(data->playbin2);
+   gst_bus_set_flushing(bus, TRUE);
+   gst_bus_set_flushing(bus, FALSE);
+   gst_object_unref(bus);
+   start_load(data);
+   set_target_state(data, data->target_state == GST_STATE_PAUSED ? GST_STATE_PAUSED : GST_STATE_PLAYING);
    return TRUE;
 }
 
-static void tags_cb (GstElement *playbin2, gint stream, CustomData *data){
-   gst_element_post_message(playbin2, gst_message_new_application(GST_OBJECT(playbin2), gst_structure_new("tags-changed", NULL)));   
-}
-
 static void error_cb (GstBus *bus, GstMessage *msg, CustomData *data){
    GError *err;
    gchar *debug_info;
    
    gst_message_parse_error(msg, &err, &debug_info);
+   if (retry_without_native_video(data, err, debug_info)){
+      g_clear_error(&err);
+      g_free(debug_info);
+      return;
+   }
    g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
    g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
    g_clear_error(&err);
@@ -266,9 +1124,476 @@ static void error_cb (GstBus *bus, GstMessage *msg, CustomData *data){
    gst_element_set_state(data->playbin2, GST_STATE_READY);
 }
 
+/* Called from the streaming thread when the current item is almost played,
+   setting the next uri here lets playbin2 preroll it without a gap */
+static void about_to_finish_cb(GstElement *playbin2, CustomData *data){
+   g_mutex_lock(&data->playlist_lock);
+   if (data->playlist && data->playlist[data->current] && data->playlist[data->current + 1]){
+      data->current++;
+      g_object_set(playbin2, "uri", data->playlist[data->current], NULL);
+      data->next_queued = TRUE;
+      g_print("Queued next item %s\n", data->playlist[data->current]);
+   }
+   g_mutex_unlock(&data->playlist_lock);
+}
+
+/* Frames leaving the video decoder, the oldest is overwritten */
+static gboolean decoder_probe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+   g_mutex_lock(&data->render_lock);
+   data->decoded[data->decoded_next].data = GST_BUFFER_DATA(buffer);
+   data->decoded[data->decoded_next].timestamp = GST_BUFFER_TIMESTAMP(buffer);
+   data->decoded_next = (data->decoded_next + 1) % DECODED_FRAMES;
+   g_mutex_unlock(&data->render_lock);
+   return TRUE;
+}
+
+/* A buffer at the sink is uncopied when a recent decoder output had the same
+   memory and timestamp, converters keep the timestamp of what they copy */
+static gboolean is_decoded(CustomData *data, GstBuffer *buffer){
+   gboolean found = FALSE;
+   gint i;
+
+   g_mutex_lock(&data->render_lock);
+   for (i = 0; i < DECODED_FRAMES && !found; i++){
+      found = data->decoded[i].data == GST_BUFFER_DATA(buffer) &&
+         data->decoded[i].timestamp == GST_BUFFER_TIMESTAMP(buffer);
+   }
+   g_mutex_unlock(&data->render_lock);
+   return found;
+}
+
+static gboolean stage_in_probe(GstPad *pad, GstBuffer *buffer, RenderStage *stage){
+   stage->in = GST_BUFFER_DATA(buffer);
+   stage->in_time = g_get_monotonic_time();
+   return TRUE;
+}
+
+/* A converter that is not in passthrough hands on different memory, that is a copy */
+static gboolean stage_out_probe(GstPad *pad, GstBuffer *buffer, RenderStage *stage){
+   if (GST_BUFFER_DATA(buffer) != stage->in){
+      g_atomic_int_inc(&stage->data->render_copies);
+      g_mutex_lock(&stage->data->render_lock);
+      stage->data->convert_usec += g_get_monotonic_time() - stage->in_time;
+      g_mutex_unlock(&stage->data->render_lock);
+   }
+   return TRUE;
+}
+
+/* Probe the video decoder and every converter playbin2 plugged in front of the
+   sink, each element is probed once */
+static void probe_render_path(CustomData *data){
+   GstIterator *it = gst_bin_iterate_recurse(GST_BIN(data->playbin2));
+   GstElement *element;
+   GstElementFactory *factory;
+   RenderStage *stage;
+   const gchar *name;
+   gboolean done = FALSE;
+   GstPad *pad;
+
+   while (!done){
+      switch (gst_iterator_next(it, (gpointer *)&element)){
+         case GST_ITERATOR_OK:
+            factory = gst_element_get_factory(element);
+            if (factory && !g_object_get_data(G_OBJECT(element), "render-probed")){
+               name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+               if (strstr(gst_element_factory_get_klass(factory), "Decoder/Video")){
+                  pad = gst_element_get_static_pad(element, "src");
+                  gst_pad_add_buffer_probe(pad, G_CALLBACK(decoder_probe), data);
+                  gst_object_unref(pad);
+                  g_object_set_data(G_OBJECT(element), "render-probed", element);
+               }
+               else if (g_str_equal(name, "ffmpegcolorspace") || g_str_equal(name, "videoscale")){
+                  stage = g_new0(RenderStage, 1);
+                  stage->data = data;
+                  pad = gst_element_get_static_pad(element, "sink");
+                  gst_pad_add_buffer_probe(pad, G_CALLBACK(stage_in_probe), stage);
+                  gst_object_unref(pad);
+                  pad = gst_element_get_static_pad(element, "src");
+                  gst_pad_add_buffer_probe(pad, G_CALLBACK(stage_out_probe), stage);
+                  gst_object_unref(pad);
+                  g_object_set_data_full(G_OBJECT(element), "render-probed", stage, g_free);
+               }
+            }
+            gst_object_unref(element);
+            break;
+         case GST_ITERATOR_RESYNC:
+            gst_iterator_resync(it);
+            break;
+         default:
+            done = TRUE;
+            break;
+      }
+   }
+   gst_iterator_free(it);
+}
+
+static void print_render_stats(CustomData *data){
+   gint frames = g_atomic_int_get(&data->render_frames);
+   gint64 convert_usec;
+
+   if (frames == 0)
+      return;
+   g_mutex_lock(&data->render_lock);
+   convert_usec = data->convert_usec;
+   data->convert_usec = 0;
+   g_mutex_unlock(&data->render_lock);
+   g_print("Render: %s, %d frames, %.2f copies/frame, %d uncopied from the decoder, convert %.3f ms/frame\n",
+      GST_OBJECT_NAME(gst_element_get_factory(data->video_sink)), frames,
+      (gdouble)g_atomic_int_get(&data->render_copies) / frames,
+      g_atomic_int_get(&data->render_uncopied),
+      convert_usec / 1000.0 / frames);
+   g_atomic_int_set(&data->render_frames, 0);
+   g_atomic_int_set(&data->render_copies, 0);
+   g_atomic_int_set(&data->render_uncopied, 0);
+}
+
+/* Frames and events reaching the video sink, the next item starts with a new
+   segment once the queued uri is playing */
+static gboolean frame_probe(GstPad *pad, GstMiniObject *obj, CustomData *data){
+   gint64 now = g_get_monotonic_time();
+   gint64 seek_start = 0;
+
+   if (GST_IS_EVENT(obj)){
+      g_mutex_lock(&data->playlist_lock);
+      if (GST_EVENT_TYPE(obj) == GST_EVENT_NEWSEGMENT && data->next_queued){
+         data->next_queued = FALSE;
+         data->switching = TRUE;
+      }
+      /* Frames after the flush belong to the pending seek */
+      if (GST_EVENT_TYPE(obj) == GST_EVENT_FLUSH_STOP && data->seek_start){
+         data->seek_flushed = TRUE;
+      }
+      g_mutex_unlock(&data->playlist_lock);
+      return TRUE;
+   }
+
+   g_mutex_lock(&data->playlist_lock);
+   if (data->seek_flushed){
+      data->seek_flushed = FALSE;
+      seek_start = data->seek_start;
+      data->seek_start = 0;
+   }
+   g_mutex_unlock(&data->playlist_lock);
+   if (seek_start){
+      gst_element_post_message(data->playbin2, gst_message_new_application(GST_OBJECT(data->playbin2),
+         gst_structure_new("seek-done", "time", G_TYPE_DOUBLE, (now - seek_start) / 1000.0, NULL)));
+   }
+
+   if (data->switching){
+      data->switching = FALSE;
+      gst_element_post_message(data->playbin2, gst_message_new_application(GST_OBJECT(data->playbin2),
+         gst_structure_new("item-changed", "gap", G_TYPE_DOUBLE, (now - data->last_frame) / 1000.0, NULL)));
+   }
+   data->last_frame = now;
+   g_atomic_int_inc(&data->render_frames);
+   if (is_decoded(data, GST_BUFFER(obj)))
+      g_atomic_int_inc(&data->render_uncopied);
+   if (data->trick_speed)
+      g_atomic_int_inc(&data->trick_frames);
+   return TRUE;
+}
+
+static void application_cb (GstBus *bus, GstMessage *msg, CustomData *data){
+   const GstStructure *structure = gst_message_get_structure(msg);
+   GArray *index;
+   gdouble ms;
+
+   if (gst_structure_has_name(structure, "item-changed")){
+      gst_structure_get_double(structure, "gap", &ms);
+      g_print("Next item: first frame %.2f ms after the last frame of the previous one\n", ms);
+      /* New item, the slider range is refreshed and its decoder probed */
+      update_duration(data);
+      refresh_ui(data);
+      probe_render_path(data);
+      g_mutex_lock(&data->playlist_lock);
+      start_thumbnails(data, data->playlist[data->current]);
+      start_index(data, data->playlist[data->current]);
+      g_mutex_unlock(&data->playlist_lock);
+   }
+   else if (gst_structure_has_name(structure, "seek-done")){
+      gst_structure_get_double(structure, "time", &ms);
+      g_array_append_val(data->seek_times, ms);
+      g_print("Seek (%s): first frame after %.2f ms\n", data->seek_accurate ? "accurate" : "keyframe", ms);
+   }
+   else if (gst_structure_has_name(structure, "index-ready")){
+      index = g_value_get_pointer(gst_structure_get_value(structure, "index"));
+      /* An index finishing after another file was opened is dropped */
+      if (!data->keyframes && g_strcmp0(gst_structure_get_string(structure, "uri"), data->index_uri) == 0)
+         data->keyframes = index;
+      else
+         g_array_free(index, TRUE);
+   }
+}
+
+static gint compare_double(gconstpointer a, gconstpointer b){
+   gdouble da = *(const gdouble *)a, db = *(const gdouble *)b;
+   return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* times must be sorted and not empty */
+static gdouble percentile(GArray *times, guint p){
+   return g_array_index(times, gdouble, MIN(times->len * p / 100, times->len - 1));
+}
+
+/* Distribution of the time from seek to first frame over this session */
+static void print_seek_stats(CustomData *data){
+   GArray *times = data->seek_times;
+
+   if (times->len == 0)
+      return;
+   g_array_sort(times, compare_double);
+   g_print("Seeks: %u, min %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", times->len,
+      g_array_index(times, gdouble, 0), percentile(times, 50), percentile(times, 90),
+      percentile(times, 99), g_array_index(times, gdouble, times->len - 1));
+}
+
+/* Follows the bins playbin2 creates down to the decoders, which get their
+   thread count before they open */
+static void element_added_cb(GstBin *bin, GstElement *element, gpointer user_data){
+   if (GST_IS_BIN(element))
+      g_signal_connect(element, "element-added", G_CALLBACK(element_added_cb), NULL);
+   else if (decoder_threads >= 0 && g_object_class_find_property(G_OBJECT_GET_CLASS(element), "max-threads")){
+      g_object_set(element, "max-threads", decoder_threads, NULL);
+      g_print("%s: %d decoder threads\n", GST_OBJECT_NAME(element), decoder_threads);
+   }
+}
+
+/* Limits of every queue of the given factory inside playbin2 */
+static void set_queue_limits(GstElement *playbin2, const gchar *name, guint bytes, guint64 time){
+   GstIterator *it = gst_bin_iterate_recurse(GST_BIN(playbin2));
+   GstElement *element;
+   GstElementFactory *factory;
+   gboolean done = FALSE;
+
+   while (!done){
+      switch (gst_iterator_next(it, (gpointer *)&element)){
+         case GST_ITERATOR_OK:
+            factory = gst_element_get_factory(element);
+            if (factory && g_str_equal(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), name))
+               g_object_set(element, "max-size-bytes", bytes, "max-size-buffers", 0, "max-size-time", time, NULL);
+            gst_object_unref(element);
+            break;
+         case GST_ITERATOR_RESYNC:
+            gst_iterator_resync(it);
+            break;
+         default:
+            done = TRUE;
+            break;
+      }
+   }
+   gst_iterator_free(it);
+}
+
+/* Stream bitrate from file size and duration, the multiqueues of decodebin2 and
+   the network queue2 of playbin2 then hold QUEUE_SECONDS of it */
+static void size_queues(GstElement *playbin2){
+   GstFormat fmt = GST_FORMAT_TIME;
+   gint64 duration;
+   GStatBuf st;
+   gchar *uri = NULL, *filename = NULL;
+   guint64 bitrate;
+   guint bytes;
+
+   g_object_get(playbin2, "current-uri", &uri, NULL);
+   if (uri && gst_uri_has_protocol(uri, "file"))
+      filename = g_filename_from_uri(uri, NULL, NULL);
+   g_free(uri);
+   if (!filename || g_stat(filename, &st) != 0 || !gst_element_query_duration(playbin2, &fmt, &duration) || duration <= 0){
+      g_free(filename);
+      return;
+   }
+   g_free(filename);
+
+   bitrate = gst_util_uint64_scale(st.st_size * 8, GST_SECOND, duration);
+   bytes = MAX(bitrate / 8 * QUEUE_SECONDS, QUEUE_MIN_BYTES);
+   g_object_set(playbin2, "buffer-size", bytes, "buffer-duration", (gint64)QUEUE_SECONDS * GST_SECOND, NULL);
+   set_queue_limits(playbin2, "multiqueue", bytes, QUEUE_SECONDS * GST_SECOND);
+   g_print("Queues sized for %.1f Mbit/s: %.1f MB\n", bitrate / 1e6, bytes / 1e6);
+}
+
+/* Per core load from /proc/stat, empty where it is not available */
+static GArray *read_cores(void){
+   GArray *cores = g_array_new(FALSE, FALSE, sizeof(CoreTimes));
+   guint64 user, nice, system, idle, iowait, irq, softirq, steal;
+   gchar *contents, **lines, **line;
+   CoreTimes core;
+
+   if (!g_file_get_contents("/proc/stat", &contents, NULL, NULL))
+      return cores;
+   lines = g_strsplit(contents, "\n", -1);
+   for (line = lines; *line; line++){
+      if (!g_str_has_prefix(*line, "cpu") || !g_ascii_isdigit((*line)[3]))
+         continue;
+      steal = 0;
+      if (sscanf(*line, "%*s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+            " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+            &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) < 7)
+         continue;
+      core.busy = user + nice + system + irq + softirq + steal;
+      core.total = core.busy + idle + iowait;
+      g_array_append_val(cores, core);
+   }
+   g_strfreev(lines);
+   g_free(contents);
+   return cores;
+}
+
+/* QoS of the video decoder and sink. Their dropped count is a running total
+   per element, only what was added since its last message is counted */
+static void qos_cb(GstBus *bus, GstMessage *msg, CustomData *data){
+   GstElementFactory *factory;
+   GstFormat format;
+   guint64 processed, dropped, last;
+
+   if (!GST_IS_ELEMENT(GST_MESSAGE_SRC(msg)))
+      return;
+   factory = gst_element_get_factory(GST_ELEMENT(GST_MESSAGE_SRC(msg)));
+   if (!factory || !strstr(gst_element_factory_get_klass(factory), "Video"))
+      return;
+   gst_message_parse_qos_stats(msg, &format, &processed, &dropped);
+   if (format != GST_FORMAT_BUFFERS || dropped == (guint64)-1)
+      return;
+
+   last = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(GST_MESSAGE_SRC(msg)), "qos-dropped"));
+   if (dropped > last)
+      data->dropped += dropped - last;
+   g_object_set_data(G_OBJECT(GST_MESSAGE_SRC(msg)), "qos-dropped", GUINT_TO_POINTER((guint)dropped));
+}
+
+static void print_decode_stats(CustomData *data){
+   GArray *now;
+   GString *load;
+   CoreTimes *a, *b;
+   guint i;
+
+   if (!data->cores)
+      return;
+   now = read_cores();
+   load = g_string_new(NULL);
+   for (i = 0; i < MIN(now->len, data->cores->len); i++){
+      a = &g_array_index(data->cores, CoreTimes, i);
+      b = &g_array_index(now, CoreTimes, i);
+      g_string_append_printf(load, " cpu%u %.0f%%", i,
+         b->total > a->total ? 100.0 * (b->busy - a->busy) / (b->total - a->total) : 0.0);
+   }
+   g_print("Decode: %d late frames dropped, load%s\n", data->dropped, load->str);
+   g_string_free(load, TRUE);
+   g_array_free(now, TRUE);
+   g_array_free(data->cores, TRUE);
+   data->cores = NULL;
+   data->dropped = 0;
+}
+
+static void print_streams(CustomData *data){
+   gint n_video, n_audio, n_text;
+
+   g_object_get(data->playbin2, "n-video", &n_video, "n-audio", &n_audio, "n-text", &n_text, NULL);
+   g_print("Streams: %d video, %d audio, %d text\n", n_video, n_audio, n_text);
+}
+
+/* A DURATION message carries the new value, or none when it has to be asked for */
+static void duration_cb(GstBus *bus, GstMessage *msg, CustomData *data){
+   GstFormat fmt;
+   gint64 duration;
+
+   gst_message_parse_duration(msg, &fmt, &duration);
+   if (fmt == GST_FORMAT_TIME && duration > 0){
+      data->duration = duration;
+      gtk_range_set_range(GTK_RANGE(data->slider), 0, (gdouble)duration / GST_SECOND);
+   }
+   else if (data->state >= GST_STATE_PAUSED){
+      update_duration(data);
+   }
+}
+
+/* Seeks and trick play steps are done, the position moved */
+static void async_done_cb(GstBus *bus, GstMessage *msg, CustomData *data){
+   refresh_ui(data);
+}
+
+/* Network buffer holds buffer_seconds of the rate the stream plays at. When
+   the link is slower than the stream, (1 - in/out) of what is left to play
+   has to be in the buffer before playing on, or it runs dry before the end.
+   Streams without a duration get the cap */
+static void size_stream_buffer(CustomData *data){
+   GstFormat fmt = GST_FORMAT_TIME;
+   gint64 position = 0;
+   gdouble remaining = STREAM_BUFFER_MAX_SECONDS;
+   gdouble deficit;
+   guint bytes;
+   guint64 time;
+
+   if (GST_CLOCK_TIME_IS_VALID(data->duration)){
+      gst_element_query_position(data->playbin2, &fmt, &position);
+      remaining = MAX((gint64)data->duration - position, 0) / (gdouble)GST_SECOND;
+   }
+   data->buffer_seconds = STREAM_BUFFER_SECONDS;
+   if (data->avg_in > 0 && data->avg_in < data->avg_out){
+      deficit = (1.0 - (gdouble)data->avg_in / data->avg_out) * remaining;
+      data->buffer_seconds = CLAMP((gint)deficit + 1, STREAM_BUFFER_SECONDS, STREAM_BUFFER_MAX_SECONDS);
+   }
+
+   bytes = MAX((guint)data->avg_out * data->buffer_seconds, QUEUE_MIN_BYTES);
+   time = (guint64)data->buffer_seconds * GST_SECOND;
+
+   g_object_set(data->playbin2, "buffer-size", bytes, "buffer-duration", (gint64)time, NULL);
+   set_queue_limits(data->playbin2, "queue2", bytes, time);
+   g_print("Network buffer: %d s, %.1f MB, bandwidth %.2f Mbit/s, stream %.2f Mbit/s\n", data->buffer_seconds,
+      bytes / 1e6, data->avg_in * 8 / 1e6, data->avg_out * 8 / 1e6);
+}
+
+static void buffering_cb(GstBus *bus, GstMessage *msg, CustomData *data){
+   GstBufferingMode mode;
+   gint percent, avg_in, avg_out;
+   gint64 left;
+   gboolean first;
+
+   gst_message_parse_buffering(msg, &percent);
+   gst_message_parse_buffering_stats(msg, &mode, &avg_in, &avg_out, &left);
+   first = data->avg_in <= 0 && avg_in > 0;
+   if (avg_in > 0)
+      data->avg_in = avg_in;
+   if (avg_out > 0)
+      data->avg_out = avg_out;
+   if (first)
+      size_stream_buffer(data);
+
+   if (percent < 100 && !data->buffering){
+      data->buffering = TRUE;
+      /* Ran dry after playback had started */
+      if (data->startup){
+         data->rebuffers++;
+         data->stall_start = g_get_monotonic_time();
+         g_print("Rebuffering\n");
+      }
+      if (data->target_state == GST_STATE_PLAYING)
+         gst_element_set_state(data->playbin2, GST_STATE_PAUSED);
+   }
+   else if (percent == 100 && data->buffering){
+      data->buffering = FALSE;
+      if (data->stall_start){
+         data->stalled += g_get_monotonic_time() - data->stall_start;
+         data->stall_start = 0;
+         size_stream_buffer(data);
+      }
+      if (data->target_state == GST_STATE_PLAYING)
+         gst_element_set_state(data->playbin2, GST_STATE_PLAYING);
+   }
+}
+
+static void print_stream_stats(CustomData *data){
+   if (!data->startup || data->avg_in <= 0)
+      return;
+   g_print("Streaming: startup %.0f ms, %d rebuffers, %.0f ms stalled, bandwidth %.2f Mbit/s\n",
+      data->startup / 1000.0, data->rebuffers, data->stalled / 1000.0, data->avg_in * 8 / 1e6);
+}
+
 static void eos_cb(GstBus *bus, GstMessage *msg, CustomData *data){
    g_print("End-of-stream reached.\n");
-   gst_element_set_state(data->playbin2, GST_STATE_READY);
+   print_render_stats(data);
+   print_decode_stats(data);
+   print_stream_stats(data);
+   set_target_state(data, GST_STATE_READY);
 }
 
 static void state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *data){
@@ -278,55 +1603,483 @@ static void state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *data){
       data->state = new_state;
       g_print("State set to %s\n", gst_element_state_get_name(new_state));
       if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED){
+         probe_render_path(data);
+         size_queues(data->playbin2);
+         update_duration(data);
          refresh_ui(data);
+         print_streams(data);
+      }
+      update_ticker(data);
+      if (new_state == GST_STATE_PLAYING && !data->cores){
+         data->cores = read_cores();
+      }
+      if (new_state == GST_STATE_PLAYING && !data->startup){
+         data->startup = g_get_monotonic_time() - data->load_time;
+         g_print("Playback started %.0f ms after load\n", data->startup / 1000.0);
+      }
+      if (old_state == GST_STATE_PLAYING && new_state == GST_STATE_PAUSED){
+         print_render_stats(data);
+         print_decode_stats(data);
       }
    }
 }
 
-/* http://docs.gstreamer.com/display/GstSDK/Basic+tutorial+13%3A+Playback+speed */
+static gint64 cpu_time(void){
+   struct rusage ru;
+
+   getrusage(RUSAGE_SELF, &ru);
+   return (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* One trick play step: move speed * TRICK_INTERVAL_MS and show the keyframe
+   there with a KEY_UNIT seek while PAUSED, so only keyframes are decoded */
+static gboolean trick_step_cb (CustomData *data){
+   gint64 target = data->trick_position + (gint64)data->trick_speed * TRICK_INTERVAL_MS * GST_MSECOND;
+   gint64 keyframe;
+
+   if (target < 0 || (GST_CLOCK_TIME_IS_VALID(data->duration) && target > data->duration)){
+      data->trick_timeout = 0;
+      stop_trick(data);
+      return FALSE;
+   }
+   data->trick_position = target;
+
+   /* Still decoding the previous keyframe, skip a step rather than queue seeks */
+   if (gst_element_get_state(data->playbin2, NULL, NULL, 0) == GST_STATE_CHANGE_ASYNC)
+      return TRUE;
+
+   keyframe = data->keyframes ? find_keyframe(data->keyframes, target) : target;
+   if (data->keyframes && keyframe == data->trick_keyframe)
+      return TRUE;
+   data->trick_keyframe = keyframe;
+   gst_element_seek_simple(data->playbin2, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, keyframe);
+   return TRUE;
+}
+
+static void print_trick_stats(CustomData *data){
+   gint64 wall = g_get_monotonic_time() - data->trick_wall;
+
+   if (wall > 0){
+      g_print("Trick play %dx: %.1f fps delivered, CPU %.1f%%\n", data->trick_speed,
+         g_atomic_int_get(&data->trick_frames) * (gdouble)G_USEC_PER_SEC / wall,
+         100.0 * (cpu_time() - data->trick_cpu) / wall);
+   }
+}
 
-static void change_rate(CustomData *data){
+static void start_trick(CustomData *data, gint speed){
    GstFormat fmt = GST_FORMAT_TIME;
-   gint64 current;
-   GstEvent *seek_event;
 
-   if (!gst_element_query_position(data->playbin2, &fmt, &current)){
-      g_printerr("Couldn't query current position.\n");
+   if (!data->trick_speed){
+      if (!gst_element_query_position(data->playbin2, &fmt, &data->trick_position)){
+         g_printerr("Couldn't query current position.\n");
+         return;
+      }
+      data->trick_keyframe = data->trick_position;
+      set_target_state(data, GST_STATE_PAUSED);
+      data->trick_timeout = g_timeout_add(TRICK_INTERVAL_MS, (GSourceFunc)trick_step_cb, data);
+   }
+   else{
+      print_trick_stats(data);
+   }
+
+   data->trick_speed = speed;
+   data->trick_frames = 0;
+   data->trick_wall = g_get_monotonic_time();
+   data->trick_cpu = cpu_time();
+   g_print("Trick play %dx\n", speed);
+}
+
+static void stop_trick(CustomData *data){
+   if (!data->trick_speed)
       return;
+   print_trick_stats(data);
+   if (data->trick_timeout){
+      g_source_remove(data->trick_timeout);
+      data->trick_timeout = 0;
    }
+   data->trick_speed = 0;
+}
 
-   if (data->rate > 0){
-      seek_event = gst_event_new_seek(data->rate, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
-        GST_SEEK_TYPE_SET, current, GST_SEEK_TYPE_NONE, 0);
+/* Video sink that renders YUV itself: XVideo, else shared memory XImage which
+   also works under Xvfb, autovideosink only when neither can open the display */
+static GstElement *make_video_sink(void){
+   const gchar *sinks[] = { "xvimagesink", "ximagesink" };
+   GstElement *sink;
+   guint i;
+
+   for (i = 0; i < G_N_ELEMENTS(sinks); i++){
+      sink = gst_element_factory_make(sinks[i], "video_sink");
+      if (!sink)
+         continue;
+      if (gst_element_set_state(sink, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE){
+         gst_element_set_state(sink, GST_STATE_NULL);
+         g_print("Video sink: %s\n", sinks[i]);
+         return sink;
+      }
+      gst_element_set_state(sink, GST_STATE_NULL);
+      gst_object_unref(sink);
    }
-   else{
-      seek_event = gst_event_new_seek(data->rate, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
-        GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_SET, current);   
+   return gst_element_factory_make("autovideosink", "video_sink");
+}
+
+static gboolean bench_probe(GstPad *pad, GstBuffer *buffer, BenchResult *result){
+   if (!result->first_frame)
+      result->first_frame = g_get_monotonic_time();
+   g_atomic_int_inc(&result->frames);
+   return TRUE;
+}
+
+/* High-water mark of the process, it never goes down between files */
+static glong peak_rss(void){
+   struct rusage ru;
+
+   getrusage(RUSAGE_SELF, &ru);
+   return ru.ru_maxrss;
+}
+
+static void bench_error(GstMessage *msg){
+   GError *err;
+
+   gst_message_parse_error(msg, &err, NULL);
+   g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
+   g_clear_error(&err);
+   gst_message_unref(msg);
+}
+
+/* Blocks until the pipeline is done with its state change or seek, prints the error if it failed */
+static gboolean bench_wait(GstElement *pipeline, GstBus *bus){
+   GstMessage *msg;
+
+   if (gst_element_get_state(pipeline, NULL, NULL, GST_CLOCK_TIME_NONE) != GST_STATE_CHANGE_FAILURE)
+      return TRUE;
+   msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+   if (msg)
+      bench_error(msg);
+   return FALSE;
+}
+
+/* Preroll, decode to the end as fast as the sinks take it, then seek around */
+static void bench_file(GstElement *playbin2, BenchResult *result){
+   GstBus *bus = gst_element_get_bus(playbin2);
+   GstFormat fmt = GST_FORMAT_TIME;
+   GstMessage *msg;
+   GRand *rand;
+   gchar *uri;
+   gint64 start;
+   gdouble ms;
+   gint i;
+
+   uri = gst_filename_to_uri(result->file, NULL);
+   g_object_set(playbin2, "uri", uri, NULL);
+   g_free(uri);
+
+   result->start = g_get_monotonic_time();
+   gst_element_set_state(playbin2, GST_STATE_PAUSED);
+   if (!bench_wait(playbin2, bus))
+      goto out;
+   if (!gst_element_query_duration(playbin2, &fmt, &result->duration))
+      result->duration = -1;
+   size_queues(playbin2);
+
+   start = g_get_monotonic_time();
+   gst_element_set_state(playbin2, GST_STATE_PLAYING);
+   msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+   result->decode_time = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+   result->decoded = g_atomic_int_get(&result->frames);
+   if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR){
+      bench_error(msg);
+      goto out;
+   }
+   gst_message_unref(msg);
+
+   /* Same positions for every run so results compare */
+   gst_element_set_state(playbin2, GST_STATE_PAUSED);
+   if (!bench_wait(playbin2, bus))
+      goto out;
+   rand = g_rand_new_with_seed(BENCH_SEEKS);
+   for (i = 0; i < BENCH_SEEKS && result->duration > 0; i++){
+      start = g_get_monotonic_time();
+      gst_element_seek_simple(playbin2, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+         (gint64)(g_rand_double(rand) * result->duration));
+      if (!bench_wait(playbin2, bus))
+         break;
+      ms = (g_get_monotonic_time() - start) / 1000.0;
+      g_array_append_val(result->seek_times, ms);
+   }
+   g_rand_free(rand);
+   result->ok = TRUE;
+
+out:
+   gst_element_set_state(playbin2, GST_STATE_NULL);
+   gst_object_unref(bus);
+   result->peak_rss = peak_rss();
+}
+
+static void json_string(GString *json, const gchar *s){
+   g_string_append_c(json, '"');
+   for (; *s; s++){
+      if (*s == '"' || *s == '\\')
+         g_string_append_printf(json, "\\%c", *s);
+      else if ((guchar)*s < 0x20)
+         g_string_append_printf(json, "\\u%04x", *s);
+      else
+         g_string_append_c(json, *s);
+   }
+   g_string_append_c(json, '"');
+}
+
+/* Numbers always with a decimal point whatever the locale */
+static void json_double(GString *json, const gchar *key, gdouble value){
+   gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+   g_string_append_printf(json, "\"%s\": %s", key, g_ascii_formatd(buf, sizeof(buf), "%.3f", value));
+}
+
+static void bench_json(GString *json, BenchResult *result){
+   GArray *times = result->seek_times;
+   gint frames = result->decoded;
+
+   g_string_append(json, "    {\"file\": ");
+   json_string(json, result->file);
+   g_string_append_printf(json, ", \"ok\": %s, \"size_bytes\": %" G_GINT64_FORMAT ", \"frames\": %d, ",
+      result->ok ? "true" : "false", result->size, frames);
+   json_double(json, "duration_s", result->duration > 0 ? (gdouble)result->duration / GST_SECOND : 0);
+   g_string_append(json, ", ");
+   json_double(json, "decode_s", result->decode_time);
+   g_string_append(json, ", ");
+   json_double(json, "fps", result->decode_time > 0 ? frames / result->decode_time : 0);
+   g_string_append(json, ", ");
+   json_double(json, "mb_per_s", result->decode_time > 0 ? result->size / 1e6 / result->decode_time : 0);
+   g_string_append(json, ", ");
+   json_double(json, "first_frame_ms", result->first_frame ? (result->first_frame - result->start) / 1000.0 : -1);
+   g_string_append_printf(json, ", \"seeks\": %u", times->len);
+   if (times->len){
+      g_array_sort(times, compare_double);
+      g_string_append(json, ", ");
+      json_double(json, "seek_p50_ms", percentile(times, 50));
+      g_string_append(json, ", ");
+      json_double(json, "seek_p90_ms", percentile(times, 90));
+      g_string_append(json, ", ");
+      json_double(json, "seek_p99_ms", percentile(times, 99));
+      g_string_append(json, ", ");
+      json_double(json, "seek_max_ms", g_array_index(times, gdouble, times->len - 1));
+   }
+   g_string_append_printf(json, ", \"cumulative_peak_rss_kb\": %ld}", result->peak_rss);
+}
+
+static gint compare_path(const gchar **a, const gchar **b){
+   return g_strcmp0(*a, *b);
+}
+
+/* The file itself, or the files of a directory in name order */
+static GPtrArray *list_files(const gchar *path){
+   GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+   GError *err = NULL;
+   const gchar *name;
+   GDir *dir;
+
+   if (!g_file_test(path, G_FILE_TEST_IS_DIR)){
+      g_ptr_array_add(files, g_strdup(path));
+      return files;
+   }
+   dir = g_dir_open(path, 0, &err);
+   if (!dir){
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      g_ptr_array_free(files, TRUE);
+      return NULL;
    }
+   while ((name = g_dir_read_name(dir)))
+      if (name[0] != '.')
+         g_ptr_array_add(files, g_build_filename(path, name, NULL));
+   g_dir_close(dir);
+   g_ptr_array_sort(files, (GCompareFunc)compare_path);
+   return files;
+}
+
+/* mediaplayer --bench <file or directory> [output.json]: the player's playbin2 with
+   fakesinks that do not sync, so decoding runs without a display as fast as it can */
+static gint run_bench(const gchar *path, const gchar *output){
+   GstElement *playbin2, *video_sink, *audio_sink;
+   GPtrArray *files = list_files(path);
+   BenchResult *results;
+   GString *json;
+   GStatBuf st;
+   GError *err = NULL;
+   GstPad *pad;
+   gulong probe;
+   gint failed = 0;
+   guint i;
+
+   if (!files)
+      return -1;
 
-   gst_element_send_event(data->playbin2, seek_event);
+   playbin2 = gst_element_factory_make("playbin2", "playbin2");
+   video_sink = gst_element_factory_make("fakesink", "video_sink");
+   audio_sink = gst_element_factory_make("fakesink", "audio_sink");
+   if (!playbin2 || !video_sink || !audio_sink){
+      g_printerr("Not all elements could be created.\n");
+      return -1;
+   }
+   g_object_set(video_sink, "sync", FALSE, NULL);
+   g_object_set(audio_sink, "sync", FALSE, NULL);
+   g_object_set(playbin2, "video-sink", video_sink, "audio-sink", audio_sink, NULL);
+   g_signal_connect(playbin2, "element-added", G_CALLBACK(element_added_cb), NULL);
+
+   results = g_new0(BenchResult, files->len);
+   pad = gst_element_get_static_pad(video_sink, "sink");
+   json = g_string_new("{\n  \"files\": [\n");
+   for (i = 0; i < files->len; i++){
+      results[i].file = g_ptr_array_index(files, i);
+      results[i].seek_times = g_array_new(FALSE, FALSE, sizeof(gdouble));
+      if (g_stat(results[i].file, &st) == 0 && S_ISREG(st.st_mode)){
+         results[i].size = st.st_size;
+         probe = gst_pad_add_buffer_probe(pad, G_CALLBACK(bench_probe), &results[i]);
+         bench_file(playbin2, &results[i]);
+         gst_pad_remove_buffer_probe(pad, probe);
+      }
+      if (!results[i].ok)
+         failed++;
+      g_print("%s: %d frames in %.2f s, %.1f fps, %.2f MB/s\n", results[i].file,
+         results[i].decoded, results[i].decode_time,
+         results[i].decode_time > 0 ? results[i].decoded / results[i].decode_time : 0,
+         results[i].decode_time > 0 ? results[i].size / 1e6 / results[i].decode_time : 0);
+      bench_json(json, &results[i]);
+      g_string_append(json, i + 1 < files->len ? ",\n" : "\n");
+      g_array_free(results[i].seek_times, TRUE);
+   }
+   g_string_append_printf(json, "  ],\n  \"peak_rss_kb\": %ld\n}\n", peak_rss());
+   gst_object_unref(pad);
+   gst_object_unref(playbin2);
+
+   if (!output)
+      g_print("%s", json->str);
+   else if (!g_file_set_contents(output, json->str, json->len, &err)){
+      g_printerr("Could not write %s: %s\n", output, err->message);
+      g_clear_error(&err);
+      failed++;
+   }
+   g_string_free(json, TRUE);
+   g_free(results);
+   g_ptr_array_free(files, TRUE);
+   return failed ? 1 : 0;
+}
+
+/* mediaplayer --probe <file or directory>: the format check of Open on every file */
+static gint run_probe(const gchar *path){
+   GPtrArray *files = list_files(path);
+   GArray *times;
+   gchar *uri, *format;
+   gboolean supported;
+   gint64 start;
+   gdouble ms;
+   gint accepted = 0;
+   guint i;
+
+   if (!files)
+      return -1;
+   times = g_array_new(FALSE, FALSE, sizeof(gdouble));
+   for (i = 0; i < files->len; i++){
+      uri = gst_filename_to_uri(g_ptr_array_index(files, i), NULL);
+      start = g_get_monotonic_time();
+      supported = probe_uri(uri, &format);
+      ms = (g_get_monotonic_time() - start) / 1000.0;
+      g_array_append_val(times, ms);
+      if (supported)
+         accepted++;
+      g_print("%s: %s, %s, %.3f ms\n", (gchar *)g_ptr_array_index(files, i), format,
+         supported ? "supported" : "rejected", ms);
+      g_free(format);
+      g_free(uri);
+   }
+   if (times->len){
+      g_array_sort(times, compare_double);
+      g_print("Probed %u files, %d supported: p50 %.3f ms, p90 %.3f ms, max %.3f ms\n", times->len, accepted,
+         percentile(times, 50), percentile(times, 90), g_array_index(times, gdouble, times->len - 1));
+   }
+   g_array_free(times, TRUE);
+   g_ptr_array_free(files, TRUE);
+   return 0;
 }
 
 int main(int argc, char *argv[]){
    CustomData data;
    GstStateChangeReturn ret;
    GstBus *bus;
+   GstPad *pad;
+   gint flags;
+   gchar *bench = NULL;
+   gchar *probe = NULL;
+   gchar *uri;
+   gboolean download = FALSE;
+   GError *err = NULL;
+   GOptionContext *context;
+   GOptionEntry entries[] = {
+      { "bench", 0, 0, G_OPTION_ARG_FILENAME, &bench, "Decode a file or directory without display, [results.json]", "PATH" },
+      { "probe", 0, 0, G_OPTION_ARG_FILENAME, &probe, "Time the format probe of Open on a file or directory", "PATH" },
+      { "threads", 0, 0, G_OPTION_ARG_INT, &decoder_threads, "Decoder worker threads, 0 for one per core", "N" },
+      { "download", 0, 0, G_OPTION_ARG_NONE, &download, "Download network streams to disk while playing", NULL },
+      { NULL }
+   };
+
+   context = g_option_context_new("[URI or file] - GStreamer media player");
+   g_option_context_add_main_entries(context, entries, NULL);
+   g_option_context_add_group(context, gst_init_get_option_group());
+   g_option_context_set_ignore_unknown_options(context, TRUE);
+   if (!g_option_context_parse(context, &argc, &argv, &err)){
+      g_printerr("%s\n", err->message);
+      return -1;
+   }
+   g_option_context_free(context);
+
+   /* No display needed, leave GTK out */
+   if (bench)
+      return run_bench(bench, argc > 1 ? argv[1] : NULL);
+   if (probe)
+      return run_probe(probe);
 
    gtk_init(&argc, &argv);
-   gst_init(&argc, &argv);
 
    memset (&data, 0, sizeof(data));
    data.duration = GST_CLOCK_TIME_NONE;
-   data.rate = 1.0;
+   data.anchor_running = GST_CLOCK_TIME_NONE;
+   data.visible = TRUE;
 
    data.playbin2 = gst_element_factory_make("playbin2", "playbin2");
+   data.video_sink = make_video_sink();
 
-   if (!data.playbin2){
+   if (!data.playbin2 || !data.video_sink){
       g_printerr("Not all elements could be created.\n");
       return -1;
    }
 
-   g_object_set(data.playbin2, "uri", "http://docs.gstreamer.com/media/sintel_trailer-480p.webm", NULL);
+   g_mutex_init(&data.playlist_lock);
+   g_mutex_init(&data.render_lock);
+   data.seek_times = g_array_new(FALSE, FALSE, sizeof(gdouble));
+   g_object_set(data.playbin2, "video-sink", data.video_sink, NULL);
+   /* XVideo takes the decoder's YUV and scales on its own, no converters needed.
+      Formats the port does not list fail negotiation, error_cb then retries
+      with converters */
+   if (g_str_equal(GST_OBJECT_NAME(gst_element_get_factory(data.video_sink)), "xvimagesink")){
+      g_object_get(data.playbin2, "flags", &flags, NULL);
+      g_object_set(data.playbin2, "flags", flags | PLAY_FLAG_NATIVE_VIDEO, NULL);
+   }
+   pad = gst_element_get_static_pad(data.video_sink, "sink");
+   gst_pad_add_data_probe(pad, G_CALLBACK(frame_probe), &data);
+   gst_object_unref(pad);
+   g_signal_connect(G_OBJECT(data.playbin2), "about-to-finish", G_CALLBACK(about_to_finish_cb), &data);
+   g_signal_connect(G_OBJECT(data.playbin2), "element-added", G_CALLBACK(element_added_cb), NULL);
+   /* Network sources get a queue2 that reports BUFFERING, optionally backed by a file */
+   g_object_get(data.playbin2, "flags", &flags, NULL);
+   flags |= PLAY_FLAG_BUFFERING | (download ? PLAY_FLAG_DOWNLOAD : 0);
+   g_object_set(data.playbin2, "flags", flags, NULL);
+
+   if (argc > 1)
+      uri = gst_uri_is_valid(argv[1]) ? g_strdup(argv[1]) : gst_filename_to_uri(argv[1], NULL);
+   else
+      uri = g_strdup("http://docs.gstreamer.com/media/sintel_trailer-480p.webm");
+   g_object_set(data.playbin2, "uri", uri, NULL);
+   g_free(uri);
 
    g_signal_connect(G_OBJECT(data.playbin2), "video-tags-changed", (GCallback)tags_cb, &data);
    g_signal_connect(G_OBJECT(data.playbin2), "audio-tags-changed", (GCallback)tags_cb, &data);
@@ -339,8 +2092,15 @@ int main(int argc, char *argv[]){
    g_signal_connect(G_OBJECT(bus), "message::error", (GCallback)error_cb, &data);
    g_signal_connect(G_OBJECT(bus), "message::eos", (GCallback)eos_cb, &data);
    g_signal_connect(G_OBJECT(bus), "message::state-changed", (GCallback)state_changed_cb, &data);
+   g_signal_connect(G_OBJECT(bus), "message::application", (GCallback)application_cb, &data);
+   g_signal_connect(G_OBJECT(bus), "message::qos", (GCallback)qos_cb, &data);
+   g_signal_connect(G_OBJECT(bus), "message::duration", (GCallback)duration_cb, &data);
+   g_signal_connect(G_OBJECT(bus), "message::async-done", (GCallback)async_done_cb, &data);
+   g_signal_connect(G_OBJECT(bus), "message::buffering", (GCallback)buffering_cb, &data);
    gst_object_unref(bus);
 
+   start_load(&data);
+   data.target_state = GST_STATE_PLAYING;
    ret = gst_element_set_state(data.playbin2, GST_STATE_PLAYING);
    if (ret == GST_STATE_CHANGE_FAILURE){
       g_printerr("Unable to set the pipeline to the playing state.\n");
@@ -348,10 +2108,22 @@ int main(int argc, char *argv[]){
       return -1;
    }
 
-   g_timeout_add_seconds(1, (GSourceFunc)refresh_ui, &data);
    gtk_main();
 
    gst_element_set_state(data.playbin2, GST_STATE_NULL);
    gst_object_unref(data.playbin2);
+   if (data.strip){
+      g_atomic_int_set(&data.strip->cancel, 1);
+      thumb_strip_unref(data.strip);
+   }
+   print_seek_stats(&data);
+   print_stream_stats(&data);
+   if (data.keyframes)
+      g_array_free(data.keyframes, TRUE);
+   g_array_free(data.seek_times, TRUE);
+   g_free(data.index_uri);
+   g_strfreev(data.playlist);
+   g_mutex_clear(&data.playlist_lock);
+   g_mutex_clear(&data.render_lock);
    return 0;
 }
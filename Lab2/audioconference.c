@@ -1,53 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/base/gstadapter.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include "../common/mediaengine.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define MIME "application/x-rtp"
-#define MEDIA "audio"
-#define CLOCK_RATE 48000
-#define ENCODING "X-GST-OPUS-DRAFT-SPITTKA-00"
+/* Receivers created and kept in READY at startup, a join only sets the port */
+#define RECEIVER_POOL_SIZE 4
 
+/* Bridge mode mixes in 20 ms frames */
+#define FRAME_USEC 20000
+#define FRAME_SAMPLES (MIX_RATE / (G_USEC_PER_SEC / FRAME_USEC) * MIX_CHANNELS)
+#define FRAME_BYTES (FRAME_SAMPLES * sizeof(gint16))
+
+/* Active speaker detection, the level of each stream is estimated from the RTP
+   audio level header extension (RFC 6464) when present, otherwise from the Opus
+   payload size which grows with activity in VBR mode */
+#define AUDIO_LEVEL_EXT_ID 1
+#define LEVEL_FULL_SCALE_BYTES 120
+#define LEVEL_SMOOTHING 0.2
+#define RANK_INTERVAL_MS 200
+
+/* End-to-end latency run: 'L' measures with each count of test senders in turn,
+   for LATENCY_RUN_MS each, samples of the first LATENCY_WARMUP_MS are dropped */
+#define LATENCY_RUN_MS 5000
+#define LATENCY_WARMUP_MS 1000
+static const gint latency_senders[] = {2, 8, 32};
+
+/* Load run: 'L' in bridge or relay mode drives each count of local test
+   senders through it in turn, timed like the latency run. What goes back to
+   sender i is sent to PORT+LOAD_RETURN_OFFSET+i and up where nobody listens */
+static const gint load_senders[] = {8, 32, 64};
+#define LOAD_RETURN_OFFSET 1000
+
+/* Decoded audio kept per bridge participant before old frames are dropped */
+#define MAX_QUEUED_FRAMES 5
+
+/* One listened port, a branch of the shared receiver pipeline */
 typedef struct _Receiver {
-   GstElement *rpipeline;
+   MediaReceiver *media;
+   GstPad *mixpad;
+
+   /* Active speaker state, level 0..1 is updated from the streaming thread */
+   gdouble level;
+   gint64 last_packet;
+   gint rank;
+   volatile gint active;
+
+   /* Time of 'P', cleared when the first decoded sample reaches the mixer */
+   gint64 join_time;
+
+   /* Probe of a latency run on the jitterbuffer output, 0 when none */
+   gulong stamp_probe;
+} Receiver;
+
+/* A test packet out of a jitterbuffer: its timestamp in the mixer pipeline and
+   when the test sender sent it */
+typedef struct _StampArrival {
+   GstClockTime pts;
+   gint64 sent;
+} StampArrival;
+
+/* Relay mode participant: RTP received on port is forwarded untouched to every
+   other participant at IP:PORT+slot, so clients listen with 'P PORT COUNT'.
+   Bridge mode participant: RTP received on port is decoded and the participant
+   gets back one stream at IP:PORT, the mix of everyone except themselves. */
+typedef struct _Participant {
+   gint port;
+   gint slot;
+   gchar *host;
+   gint base;
    GstElement *rsource;
-   GstElement *rjitterbuffer;
-   GstElement *rdepay;
-   GstElement *rdecoder;
    GstElement *rsink;
-   GstCaps *caps;
-} Receiver;
+
+   /* Bridge mode */
+   Receiver *rec;
+   GstElement *appsink;
+   GMutex lock;
+   GstAdapter *adapter;
+   GstElement *sbin;
+   GstElement *appsrc;
+   gboolean active;
+   gint16 frame[FRAME_SAMPLES];
+} Participant;
+
+/* Listen-only client of the relay or bridge, added with 'C' */
+typedef struct _RelayClient {
+   gchar *host;
+   gint base;
+} RelayClient;
+
+typedef enum {
+   MODE_CONFERENCE,
+   MODE_RELAY,
+   MODE_BRIDGE
+} Mode;
 
 typedef struct _CustomData {
    GMainLoop *loop;
    GstElement *bin;
-   /* Sender side elements */
-   GstElement *spipeline;
-   GstElement *source;
-   GstElement *convert;
-   GstElement *resample;
-   GstElement *encoder;
-   GstElement *pay;
-   GstElement *sink;
+   Mode mode;
+   /* Microphone sender, voice activity detection is toggled with 'V' */
+   MediaSender *sender;
+
+   /* Receiver side, all listened ports are mixed in one pipeline */
+   GstElement *rpipeline;
+   GstElement *mixer;
+   GstElement *mconvert;
+   GstElement *msink;
+   GHashTable *receivers;
+   GList *receiver_pool;
+
+   /* Opus settings of every encoder this process creates */
+   const EncoderProfile *profile;
+
+   gint last_dropped;
+
+   /* Relay mode, participants and listen-only clients */
+   GList *participants;
+   GList *relay_clients;
+
+   /* Packets forwarded by the relay */
+   volatile gint packets;
+   gint last_packets;
+
+   /* Bridge mode, mixing thread and the encoder shared by listen-only clients */
+   GThread *bridge_thread;
+   GMutex bridge_lock;
+   volatile gint bridge_running;
+   guint64 bridge_frames;
+   gint64 mix_usec;
+   guint64 mix_frames;
+   GstElement *listen_src;
+   GstElement *listen_sink;
+   gint listen_clients;
+
+   /* Print jitterbuffer statistics every JB_INTERVAL_MS, toggled with 'J' */
+   gboolean jitter_dump;
 
+   /* Only the K loudest ports are decoded, 0 decodes all */
+   gint top_k;
+
+   /* Synthetic RTP senders started with 'T' */
+   GList *test_senders;
+
+   /* Latency run started with 'L'. Send times of the test packets by SSRC and
+      RTP timestamp, the same packets in timestamp order once out of the
+      jitterbuffers, and the latencies measured at the mixer output in ms */
+   GMutex stamp_lock;
+   GHashTable *stamps;
+   GQueue arrivals;
+   GArray *latencies;
+   gint64 latency_since;
+   gint latency_step;
+   gint latency_port;
+   GList *latency_senders;
+   gulong mix_probe;
+
+   /* Load run started with 'L' in bridge or relay mode, on the step, port and
+      senders of the latency run. CPU time, wall clock and relayed packets when
+      measuring began */
+   gboolean load_run;
+   gint64 load_wall;
+   gint64 load_cpu;
+   gint load_packets;
+
+   /* CPU usage since the last 'I' */
+   gint64 last_wall;
+   gint64 last_cpu;
 } CustomData;
 
-static gboolean makeReceiverBin(gchar *port, CustomData *data);
-static gboolean breakReceiverBin(gchar *port, CustomData *data);
+static gboolean makeReceiverBin(gint port, CustomData *data);
+static gboolean breakReceiverBin(gint port, CustomData *data);
+static gboolean makeRelayPort(gchar *args, CustomData *data);
+static gboolean breakRelayPort(gint port, CustomData *data);
+static void addRelayClient(gchar *host, gint base, CustomData *data);
+static void removeRelayClient(gchar *host, gint base, CustomData *data);
+static gboolean makeBridgePort(gchar *args, CustomData *data);
+static gboolean breakBridgePort(gint port, CustomData *data);
+static gboolean makeTestSenders(gchar *args, CustomData *data);
+static gboolean startLatencyRun(gint port, CustomData *data);
+static gboolean startLoadRun(gint port, CustomData *data);
+static void printStats(CustomData *data);
+static void printSpeakers(CustomData *data);
+static gboolean benchProfiles(const gchar *dir);
 
-static void print_menu(gchar *msg){
+static void print_menu(gchar *msg, CustomData *data){
+   if(data->mode == MODE_BRIDGE){
+      g_print(
+         "Bridge menu: %s \n"
+         " 'P <PORT> <IP:PORT>' to add a participant sending to PORT, its mix-minus is sent to IP:PORT \n"
+         " 'D <PORT>' to remove a participant \n"
+         " 'C <IP:PORT>' to add a listen-only client \n"
+         " 'R <IP:PORT>' to remove a listen-only client \n"
+         " 'T <N> <IP:PORT>' to start N synthetic senders from PORT and up \n"
+         " 'I' to print bridge statistics \n"
+         " 'L <PORT>' to measure CPU and mix time with 8, 32 and 64 test senders to PORT and up \n"
+         " 'Q' to quit \n", msg
+      );
+      return;
+   }
+   if(data->mode == MODE_RELAY){
+      g_print(
+         "Relay menu: %s \n"
+         " 'P <PORT> <IP:PORT>' to add a participant sending to PORT and listening from IP:PORT \n"
+         " 'D <PORT>' to remove a participant \n"
+         " 'C <IP:PORT>' to add a listen-only client \n"
+         " 'R <IP:PORT>' to remove a listen-only client \n"
+         " 'T <N> <IP:PORT>' to start N synthetic senders from PORT and up \n"
+         " 'I' to print relay statistics \n"
+         " 'L <PORT>' to measure packet rate and CPU with 8, 32 and 64 test senders to PORT and up \n"
+         " 'Q' to quit \n", msg
+      );
+      return;
+   }
    g_print(
       "Menu: %s \n"
       " 'C <IP:PORT>' to connect to a client \n"
       " 'R <IP:PORT>' to disconnect a client \n"
-      " 'P <PORT>' to add a port to listen to \n"
-      " 'D <PORT>' to stop listening on port \n"
+      " 'P <PORT> [COUNT]' to add a port (or COUNT ports) to listen to \n"
+      " 'D <PORT> [COUNT]' to stop listening on port (or COUNT ports) \n"
+      " 'T <N> <IP:PORT>' to start N synthetic senders from PORT and up \n"
+      " 'V' to toggle voice activity detection \n"
+      " 'O <PROFILE>' to select encoder profile: lowlatency-voice, hifi or lowcpu \n"
+      " 'K <N>' to decode only the N loudest ports, 0 for all \n"
+      " 'S' to print speaker levels and ranking \n"
+      " 'J' to toggle periodic jitterbuffer statistics \n"
+      " 'I' to print mixer statistics \n"
+      " 'L <PORT>' to measure end-to-end latency with 2, 8 and 32 test senders to PORT and up \n"
       " 'Q' to quit \n", msg
    );
 }
 
+/* Listen-only clients of the bridge, counted from the sink's client list so an
+   add of a client already there or a remove of an unknown one changes nothing */
+static void updateListenClients(CustomData *data){
+   gchar *clients = NULL;
+   gchar **list;
+   gint n = 0;
+
+   g_object_get(data->listen_sink, "clients", &clients, NULL);
+   if(clients && *clients){
+      list = g_strsplit(clients, ",", -1);
+      n = g_strv_length(list);
+      g_strfreev(list);
+   }
+   g_free(clients);
+   g_atomic_int_set(&data->listen_clients, n);
+}
+
 static gboolean handle_keyboard(GIOChannel *source, GIOCondition cond, CustomData *data){
    gchar *str = NULL;
    gchar *clients;
    gchar **ipport;
+   gint port, count, i;
+   const EncoderProfile *profile;
 
    if(g_io_channel_read_line(source, &str, NULL, NULL, NULL) != G_IO_STATUS_NORMAL){
       return TRUE;
@@ -59,126 +277,1510 @@ static gboolean handle_keyboard(GIOChannel *source, GIOCondition cond, CustomDat
          break;
 
       case 'c':
+         if(data->mode == MODE_BRIDGE){
+            /* Listen-only clients all get the full mix from one encoder */
+            ipport = g_strsplit((str+2), ":", 2);
+            if(ipport[1]){
+               g_signal_emit_by_name(data->listen_sink, "add", ipport[0], atoi(ipport[1]), NULL);
+               updateListenClients(data);
+            }
+            g_strfreev(ipport);
+            break;
+         }
+         if(data->mode == MODE_RELAY){
+            ipport = g_strsplit((str+2), ":", 2);
+            if(ipport[1])
+               addRelayClient(ipport[0], atoi(ipport[1]), data);
+            g_strfreev(ipport);
+            break;
+         }
          /* Client added */
          ipport = g_strsplit((str+2), ":", 2);
-         g_signal_emit_by_name(data->sink, "add", ipport[0], atoi(ipport[1]), NULL);
+         media_sender_add(data->sender, ipport[0], atoi(ipport[1]));
          g_strfreev(ipport);
-         g_object_get(data->sink, "clients", &clients, NULL);
+         g_object_get(data->sender->sink, "clients", &clients, NULL);
          g_print("Client list: %s \n", clients);
          g_free(clients);
          break;
 
       case 'r':
+         if(data->mode == MODE_BRIDGE){
+            ipport = g_strsplit((str+2), ":", 2);
+            if(ipport[1]){
+               g_signal_emit_by_name(data->listen_sink, "remove", ipport[0], atoi(ipport[1]), NULL);
+               updateListenClients(data);
+            }
+            g_strfreev(ipport);
+            break;
+         }
+         if(data->mode == MODE_RELAY){
+            ipport = g_strsplit((str+2), ":", 2);
+            if(ipport[1])
+               removeRelayClient(ipport[0], atoi(ipport[1]), data);
+            g_strfreev(ipport);
+            break;
+         }
          ipport = g_strsplit((str+2), ":", 2);
-         g_signal_emit_by_name(data->sink, "remove", ipport[0], atoi(ipport[1]), NULL);
+         media_sender_remove(data->sender, ipport[0], atoi(ipport[1]));
          g_strfreev(ipport);
          break;
 
       case 'p':
-         makeReceiverBin(str+2, data);
+         if(data->mode == MODE_BRIDGE){
+            makeBridgePort(str+2, data);
+            break;
+         }
+         if(data->mode == MODE_RELAY){
+            makeRelayPort(str+2, data);
+            break;
+         }
+         count = 1;
+         if(sscanf(str+2, "%d %d", &port, &count) >= 1){
+            for(i = 0; i < count; i++){
+               makeReceiverBin(port+i, data);
+            }
+         }
          break;
 
       case 'd':
-         breakReceiverBin(str+2, data);
+         if(data->mode == MODE_BRIDGE){
+            breakBridgePort(atoi(str+2), data);
+            break;
+         }
+         if(data->mode == MODE_RELAY){
+            breakRelayPort(atoi(str+2), data);
+            break;
+         }
+         count = 1;
+         if(sscanf(str+2, "%d %d", &port, &count) >= 1){
+            for(i = 0; i < count; i++){
+               breakReceiverBin(port+i, data);
+            }
+         }
+         break;
+
+      case 't':
+         makeTestSenders(str+2, data);
+         break;
+
+      case 'v':
+         if(data->mode == MODE_CONFERENCE){
+            media_sender_set_vad(data->sender, !data->sender->vad);
+            print_menu(data->sender->vad ? "Voice activity detection on" : "Voice activity detection off", data);
+         }
+         break;
+
+      case 'o':
+         profile = media_find_profile(g_strstrip(str+2));
+         if(!profile){
+            print_menu("Unknown encoder profile", data);
+         }
+         else if(data->mode == MODE_CONFERENCE){
+            data->profile = profile;
+            media_sender_set_profile(data->sender, profile);
+            g_print("Encoder profile %s\n", profile->name);
+         }
+         break;
+
+      case 'k':
+         data->top_k = MAX(atoi(str+2), 0);
+         break;
+
+      case 's':
+         printSpeakers(data);
+         break;
+
+      case 'j':
+         data->jitter_dump = !data->jitter_dump;
+         break;
+
+      case 'i':
+         printStats(data);
+         break;
+
+      case 'l':
+         if(data->mode == MODE_CONFERENCE)
+            startLatencyRun(atoi(str+2), data);
+         else
+            startLoadRun(atoi(str+2), data);
          break;
 
       default:
-         print_menu("Select option then press enter!\n");
+         print_menu("Select option then press enter!\n", data);
          break;
    }
    g_free(str);
    return TRUE;
 }
 
-static gboolean makeReceiverBin(gchar *port, CustomData *data){
-   Receiver rec;
-   gchar *bin_name;
+/* Estimate the level of a stream from its RTP packets, without decoding */
+static gboolean levelProbe(GstPad *pad, GstBuffer *buffer, Receiver *rec){
+   guint8 *ext;
+   guint ext_size;
+   gdouble level;
+
+   if(!gst_rtp_buffer_validate(buffer))
+      return TRUE;
+
+   if(gst_rtp_buffer_get_extension_onebyte_header(buffer, AUDIO_LEVEL_EXT_ID, 0, (gpointer *)&ext, &ext_size) && ext_size >= 1){
+      /* -dBov in the low 7 bits, 127 is silence */
+      level = (127 - (ext[0] & 0x7f)) / 127.0;
+   }
+   else{
+      /* The senders encode in VBR, so a bigger packet means a busier signal */
+      level = MIN(gst_rtp_buffer_get_payload_len(buffer), LEVEL_FULL_SCALE_BYTES) / (gdouble)LEVEL_FULL_SCALE_BYTES;
+   }
+   rec->level += LEVEL_SMOOTHING * (level - rec->level);
+   rec->last_packet = g_get_monotonic_time();
+   return TRUE;
+}
+
+/* Counts the encoded stream, not the OpusHead and OpusTags headers */
+static gboolean countBytes(GstPad *pad, GstBuffer *buffer, guint64 *bytes){
+   if(!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_IN_CAPS))
+      *bytes += GST_BUFFER_SIZE(buffer);
+   return TRUE;
+}
+
+/* What one encode of a file reports back from its child process */
+typedef struct _BenchResult {
+   gboolean ok;
+   gint64 duration;
+   guint64 bytes;
+} BenchResult;
+
+/* Encode a WAV file as fast as possible with a profile, runs in the child */
+static void benchEncode(const gchar *wav, const EncoderProfile *profile, BenchResult *res){
+   GstElement *pipeline, *encoder, *sink;
+   GstMessage *msg;
+   GstBus *bus;
+   GstPad *pad;
+   GstFormat fmt = GST_FORMAT_TIME;
+   gchar *desc;
+
+   desc = g_strdup_printf("filesrc location=\"%s\" ! wavparse ! audioconvert ! audioresample ! "
+      "opusenc name=enc ! fakesink name=sink sync=false", wav);
+   pipeline = gst_parse_launch(desc, NULL);
+   g_free(desc);
+   if(!pipeline)
+      return;
+   encoder = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+   sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+   media_apply_profile(encoder, profile);
+
+   pad = gst_element_get_static_pad(sink, "sink");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(countBytes), &res->bytes);
+   gst_object_unref(pad);
+
+   gst_element_set_state(pipeline, GST_STATE_PLAYING);
+   bus = gst_element_get_bus(pipeline);
+   msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+   res->ok = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS && gst_element_query_duration(pipeline, &fmt, &res->duration)
+      && res->duration > 0;
+
+   gst_message_unref(msg);
+   gst_object_unref(bus);
+   gst_element_set_state(pipeline, GST_STATE_NULL);
+   gst_object_unref(encoder);
+   gst_object_unref(sink);
+   gst_object_unref(pipeline);
+}
+
+/* Every encode runs in a child of its own, its CPU time is then what wait4
+   reports for it and nothing else in the process */
+static gboolean benchChild(const gchar *wav, const EncoderProfile *profile, BenchResult *res, gint64 *cpu){
+   struct rusage ru;
+   int fds[2], status;
+   pid_t pid;
+   gssize n;
+
+   memset(res, 0, sizeof(*res));
+   if(pipe(fds) < 0)
+      return FALSE;
+   pid = fork();
+   if(pid < 0){
+      close(fds[0]);
+      close(fds[1]);
+      return FALSE;
+   }
+   if(pid == 0){
+      close(fds[0]);
+      benchEncode(wav, profile, res);
+      n = write(fds[1], res, sizeof(*res));
+      _exit(n == sizeof(*res) ? 0 : 1);
+   }
+
+   close(fds[1]);
+   n = read(fds[0], res, sizeof(*res));
+   close(fds[0]);
+   if(wait4(pid, &status, 0, &ru) < 0)
+      return FALSE;
+   *cpu = (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+   return n == sizeof(*res) && WIFEXITED(status) && WEXITSTATUS(status) == 0 && res->ok;
+}
+
+/* Headless: encode every WAV file of a directory in every profile and report
+   CPU time per second of audio, bitrate and algorithmic latency per file and
+   over the whole corpus. Runs before any pipeline exists, so forking is safe */
+static gboolean benchProfiles(const gchar *dir){
+   GDir *gdir;
+   GList *files = NULL, *l;
+   const gchar *name;
+   BenchResult res;
+   gint64 cpu, *cpu_total, *duration_total;
+   guint64 *bytes_total;
+   gdouble secs;
+   guint i;
+
+   gdir = g_dir_open(dir, 0, NULL);
+   if(!gdir){
+      g_printerr("Could not open directory %s\n", dir);
+      return FALSE;
+   }
+   while((name = g_dir_read_name(gdir))){
+      if(g_str_has_suffix(name, ".wav") || g_str_has_suffix(name, ".WAV"))
+         files = g_list_insert_sorted(files, g_build_filename(dir, name, NULL), (GCompareFunc)strcmp);
+   }
+   g_dir_close(gdir);
+   if(!files){
+      g_printerr("No WAV files in %s\n", dir);
+      return FALSE;
+   }
+
+   cpu_total = g_new0(gint64, media_n_profiles);
+   duration_total = g_new0(gint64, media_n_profiles);
+   bytes_total = g_new0(guint64, media_n_profiles);
+   for(l = files; l; l = l->next){
+      for(i = 0; i < media_n_profiles; i++){
+         if(!benchChild(l->data, &media_profiles[i], &res, &cpu)){
+            g_printerr("%s: %s: benchmark failed\n", (gchar *)l->data, media_profiles[i].name);
+            continue;
+         }
+         secs = (gdouble)res.duration / GST_SECOND;
+         g_print("%s: %-18s CPU %.2f ms per s of audio, %.1f kbit/s\n", (gchar *)l->data,
+            media_profiles[i].name, cpu / 1000.0 / secs, res.bytes * 8.0 / 1000.0 / secs);
+         cpu_total[i] += cpu;
+         duration_total[i] += res.duration;
+         bytes_total[i] += res.bytes;
+      }
+   }
+
+   g_print("%d files:\n", g_list_length(files));
+   for(i = 0; i < media_n_profiles; i++){
+      if(duration_total[i] == 0)
+         continue;
+      secs = (gdouble)duration_total[i] / GST_SECOND;
+      g_print("%-18s CPU %.2f ms per s of audio, %.1f kbit/s, algorithmic latency %.1f ms\n",
+         media_profiles[i].name, cpu_total[i] / 1000.0 / secs, bytes_total[i] * 8.0 / 1000.0 / secs,
+         media_profiles[i].frame_size + OPUS_LOOKAHEAD_MS);
+   }
+
+   g_free(cpu_total);
+   g_free(duration_total);
+   g_free(bytes_total);
+   g_list_free_full(files, g_free);
+   return TRUE;
+}
+
+/* Periodic jitterbuffer tuning for every listened port */
+static gboolean jitterTimer(CustomData *data){
+   GHashTableIter iter;
+   gpointer value;
+   GList *l;
+
+   g_hash_table_iter_init(&iter, data->receivers);
+   while(g_hash_table_iter_next(&iter, NULL, &value)){
+      media_receiver_adapt(((Receiver *)value)->media, data->jitter_dump);
+   }
+   if(data->mode == MODE_BRIDGE){
+      g_mutex_lock(&data->bridge_lock);
+      for(l = data->participants; l; l = l->next){
+         media_receiver_adapt(((Participant *)l->data)->rec->media, data->jitter_dump);
+      }
+      g_mutex_unlock(&data->bridge_lock);
+   }
+   return TRUE;
+}
+
+/* Report the time from 'P' until the first decoded sample reaches the mixer */
+static gboolean firstSampleProbe(GstPad *pad, GstBuffer *buffer, Receiver *rec){
+   if(rec->join_time){
+      g_print("Port %d: first decoded sample %.2f ms after join\n", rec->media->port,
+         (g_get_monotonic_time() - rec->join_time) / 1000.0);
+      rec->join_time = 0;
+   }
+   return TRUE;
+}
+
+/* Parked streams are dropped after the jitterbuffer and never reach the decoder */
+static gboolean parkProbe(GstPad *pad, GstBuffer *buffer, Receiver *rec){
+   return g_atomic_int_get(&rec->active);
+}
+
+static gint compareLevel(gconstpointer a, gconstpointer b){
+   gdouble la = ((const Receiver *)a)->level;
+   gdouble lb = ((const Receiver *)b)->level;
+   return la < lb ? 1 : (la > lb ? -1 : 0);
+}
+
+/* Rank the listened ports by level and decode only the top K */
+static gboolean rankSpeakers(CustomData *data){
+   GList *list, *l;
+   Receiver *rec;
+   gint64 now = g_get_monotonic_time();
+   gint rank = 0;
+
+   list = g_hash_table_get_values(data->receivers);
+   for(l = list; l; l = l->next){
+      rec = l->data;
+      /* Streams that went quiet (DTX) send nothing, let their level decay */
+      if(now - rec->last_packet > RANK_INTERVAL_MS * 1000)
+         rec->level *= 0.5;
+   }
+   list = g_list_sort(list, compareLevel);
+   for(l = list; l; l = l->next){
+      rec = l->data;
+      rec->rank = ++rank;
+      g_atomic_int_set(&rec->active, data->top_k == 0 || rank <= data->top_k);
+   }
+   g_list_free(list);
+   return TRUE;
+}
+
+static void printSpeakers(CustomData *data){
+   GList *list, *l;
+   Receiver *rec;
+
+   list = g_list_sort(g_hash_table_get_values(data->receivers), compareLevel);
+   for(l = list; l; l = l->next){
+      rec = l->data;
+      g_print("Port %d: level %.2f, rank %d, %s\n", rec->media->port, rec->level, rec->rank,
+         g_atomic_int_get(&rec->active) ? "decoding" : "parked");
+   }
+   g_list_free(list);
+}
+
+/* Receiver bin of the media engine with speaker ranking and join timing on top */
+static Receiver *newReceiver(gint port){
+   Receiver *rec;
+   GstPad *pad;
+
+   rec = g_new0(Receiver, 1);
+   rec->media = media_receiver_new(port);
+   if(!rec->media){
+      g_free(rec);
+      return NULL;
+   }
+   rec->active = 1;
+
+   pad = gst_element_get_static_pad(rec->media->source, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(levelProbe), rec);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(rec->media->jitterbuffer, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(parkProbe), rec);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(rec->media->filter, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(firstSampleProbe), rec);
+   gst_object_unref(pad);
+
+   return rec;
+}
+
+static void freeReceiver(Receiver *rec){
+   media_receiver_free(rec->media);
+   g_free(rec);
+}
+
+/* Fill the pool with receivers that are built, linked and in READY */
+static void fillReceiverPool(CustomData *data){
+   Receiver *rec;
+   gint i;
+
+   for(i = g_list_length(data->receiver_pool); i < RECEIVER_POOL_SIZE; i++){
+      rec = newReceiver(0);
+      if(!rec)
+         return;
+      gst_element_set_state(rec->media->bin, GST_STATE_READY);
+      data->receiver_pool = g_list_prepend(data->receiver_pool, rec);
+   }
+}
+
+/* Take a warm receiver from the pool and point it at port, builds one if the pool is empty */
+static Receiver *acquireReceiver(gint port, CustomData *data){
+   Receiver *rec;
+
+   if(!data->receiver_pool){
+      return newReceiver(port);
+   }
+
+   rec = data->receiver_pool->data;
+   data->receiver_pool = g_list_delete_link(data->receiver_pool, data->receiver_pool);
+
+   media_receiver_set_port(rec->media, port);
+   rec->level = 0;
+   rec->rank = 0;
+   rec->active = 1;
+   return rec;
+}
+
+/* Put a receiver that left back into the pool, still built and in READY */
+static void releaseReceiver(Receiver *rec, CustomData *data){
+   if(g_list_length(data->receiver_pool) >= RECEIVER_POOL_SIZE){
+      freeReceiver(rec);
+      return;
+   }
+   gst_element_set_state(rec->media->bin, GST_STATE_READY);
+   data->receiver_pool = g_list_prepend(data->receiver_pool, rec);
+}
+
+/* Add a port as a new branch of the receiver pipeline and link it into the mixer */
+static gboolean makeReceiverBin(gint port, CustomData *data){
+   Receiver *rec;
+   GstPad *pad;
+   gint64 join_time = g_get_monotonic_time();
+
+   if(g_hash_table_lookup(data->receivers, GINT_TO_POINTER(port))){
+      g_printerr("Already listening on port %d.\n", port);
+      return FALSE;
+   }
+
+   rec = acquireReceiver(port, data);
+   if(!rec){
+      return FALSE;
+   }
+   rec->join_time = join_time;
+
+   /* Attach to the running mixer, no new pipeline or sink is created */
+   gst_bin_add(GST_BIN(data->rpipeline), rec->media->bin);
+   rec->mixpad = gst_element_get_request_pad(data->mixer, "sink%d");
+   pad = gst_element_get_static_pad(rec->media->bin, "src");
+   if(gst_pad_link(pad, rec->mixpad) != GST_PAD_LINK_OK){
+      g_printerr("Could not link port %d to the mixer.\n", port);
+   }
+   gst_object_unref(pad);
+
+   gst_element_sync_state_with_parent(rec->media->bin);
+
+   g_hash_table_insert(data->receivers, GINT_TO_POINTER(port), rec);
+   g_print("Joined port %d in %.2f ms\n", port, (g_get_monotonic_time() - join_time) / 1000.0);
+   return TRUE;
+}
+
+/* Stop a branch and give its pad back to the mixer, the pipeline keeps running */
+static gboolean breakReceiverBin(gint port, CustomData *data){
+   Receiver *rec;
+   GstPad *pad;
+
+   rec = g_hash_table_lookup(data->receivers, GINT_TO_POINTER(port));
+   if(!rec){
+      g_printerr("Not listening on port %d.\n", port);
+      return FALSE;
+   }
+
+   gst_element_set_state(rec->media->bin, GST_STATE_READY);
+
+   pad = gst_element_get_static_pad(rec->media->bin, "src");
+   gst_pad_unlink(pad, rec->mixpad);
+   gst_object_unref(pad);
+   gst_element_release_request_pad(data->mixer, rec->mixpad);
+   gst_object_unref(rec->mixpad);
+   rec->mixpad = NULL;
+
+   gst_bin_remove(GST_BIN(data->rpipeline), rec->media->bin);
+
+   g_hash_table_remove(data->receivers, GINT_TO_POINTER(port));
+   releaseReceiver(rec, data);
+   return TRUE;
+}
+
+/* Count forwarded packets, the relay never looks into the payload */
+static gboolean relayProbe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+   g_atomic_int_add(&data->packets, 1);
+   return TRUE;
+}
+
+static gint compareSlot(gconstpointer a, gconstpointer b){
+   return ((const Participant *)a)->slot - ((const Participant *)b)->slot;
+}
+
+/* Relay mode: receive RTP on a port and forward the packets as they are to all
+   other participants and clients, without depayloading or decoding */
+static gboolean makeRelayPort(gchar *args, CustomData *data){
+   Participant *part, *other;
+   gchar host[64];
+   gchar *name;
+   GstPad *pad;
+   GList *l;
+   gint port, base;
+
+   if(sscanf(args, "%d %63[^:]:%d", &port, host, &base) != 3){
+      g_printerr("Usage: P <PORT> <IP:PORT>\n");
+      return FALSE;
+   }
+   for(l = data->participants; l; l = l->next){
+      if(((Participant *)l->data)->port == port){
+         g_printerr("Already relaying port %d.\n", port);
+         return FALSE;
+      }
+   }
+
+   part = g_new0(Participant, 1);
+   part->port = port;
+   part->host = g_strdup(host);
+   part->base = base;
+
+   /* Lowest free slot, the list is kept sorted on slot */
+   for(l = data->participants; l && ((Participant *)l->data)->slot == part->slot; l = l->next){
+      part->slot++;
+   }
+
+   name = g_strdup_printf("RelaySrc%d", port);
+   part->rsource = gst_element_factory_make("udpsrc", name);
+   g_free(name);
+   name = g_strdup_printf("RelaySink%d", port);
+   part->rsink = gst_element_factory_make("multiudpsink", name);
+   g_free(name);
+
+   if(!part->rsource || !part->rsink){
+      g_printerr("Could not create all relay elements.\n");
+      g_free(part->host);
+      g_free(part);
+      return FALSE;
+   }
+
+   g_object_set(part->rsource, "port", port, NULL);
+   g_object_set(part->rsink, "sync", FALSE, "async", FALSE, NULL);
+
+   gst_bin_add_many(GST_BIN(data->rpipeline), part->rsource, part->rsink, NULL);
+   gst_element_link(part->rsource, part->rsink);
+
+   pad = gst_element_get_static_pad(part->rsink, "sink");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(relayProbe), data);
+   gst_object_unref(pad);
+
+   /* Cross connect with everyone already in the conference */
+   for(l = data->participants; l; l = l->next){
+      other = l->data;
+      g_signal_emit_by_name(part->rsink, "add", other->host, other->base + part->slot, NULL);
+      g_signal_emit_by_name(other->rsink, "add", part->host, part->base + other->slot, NULL);
+   }
+   for(l = data->relay_clients; l; l = l->next){
+      RelayClient *client = l->data;
+      g_signal_emit_by_name(part->rsink, "add", client->host, client->base + part->slot, NULL);
+   }
+
+   data->participants = g_list_insert_sorted(data->participants, part, compareSlot);
+
+   gst_element_sync_state_with_parent(part->rsink);
+   gst_element_sync_state_with_parent(part->rsource);
+
+   g_print("Relaying port %d in slot %d, clients receive it on their port + %d\n", port, part->slot, part->slot);
+   return TRUE;
+}
+
+static gboolean breakRelayPort(gint port, CustomData *data){
+   Participant *part = NULL, *other;
+   GList *l;
+
+   for(l = data->participants; l; l = l->next){
+      if(((Participant *)l->data)->port == port){
+         part = l->data;
+         break;
+      }
+   }
+   if(!part){
+      g_printerr("Not relaying port %d.\n", port);
+      return FALSE;
+   }
+
+   data->participants = g_list_remove(data->participants, part);
+   for(l = data->participants; l; l = l->next){
+      other = l->data;
+      g_signal_emit_by_name(other->rsink, "remove", part->host, part->base + other->slot, NULL);
+   }
+
+   gst_element_set_state(part->rsource, GST_STATE_NULL);
+   gst_element_set_state(part->rsink, GST_STATE_NULL);
+   gst_bin_remove_many(GST_BIN(data->rpipeline), part->rsource, part->rsink, NULL);
+
+   g_free(part->host);
+   g_free(part);
+   return TRUE;
+}
+
+static void addRelayClient(gchar *host, gint base, CustomData *data){
+   RelayClient *client = g_new0(RelayClient, 1);
+   Participant *part;
+   GList *l;
+
+   client->host = g_strdup(host);
+   client->base = base;
+   data->relay_clients = g_list_prepend(data->relay_clients, client);
+
+   for(l = data->participants; l; l = l->next){
+      part = l->data;
+      g_signal_emit_by_name(part->rsink, "add", client->host, client->base + part->slot, NULL);
+   }
+}
+
+static void removeRelayClient(gchar *host, gint base, CustomData *data){
+   RelayClient *client;
+   Participant *part;
+   GList *l, *p;
+
+   for(l = data->relay_clients; l; l = l->next){
+      client = l->data;
+      if(client->base == base && g_strcmp0(client->host, host) == 0){
+         for(p = data->participants; p; p = p->next){
+            part = p->data;
+            g_signal_emit_by_name(part->rsink, "remove", client->host, client->base + part->slot, NULL);
+         }
+         data->relay_clients = g_list_delete_link(data->relay_clients, l);
+         g_free(client->host);
+         g_free(client);
+         return;
+      }
+   }
+}
+
+/* Mixing kernels, 16 bit samples summed in 32 bit and saturated back to 16 bit */
+
+/* total += in */
+static void mixAccumulate(gint32 *total, const gint16 *in, gint n){
+   gint i = 0;
+#if defined(__AVX2__)
+   for(; i + 16 <= n; i += 16){
+      __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+      __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+      __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+      _mm256_storeu_si256((__m256i *)(total + i), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(total + i)), lo));
+      _mm256_storeu_si256((__m256i *)(total + i + 8), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(total + i + 8)), hi));
+   }
+#elif defined(__SSE2__)
+   for(; i + 8 <= n; i += 8){
+      __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+      /* Sign extend by unpacking into the high half and shifting down */
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+      _mm_storeu_si128((__m128i *)(total + i), _mm_add_epi32(_mm_loadu_si128((__m128i *)(total + i)), lo));
+      _mm_storeu_si128((__m128i *)(total + i + 4), _mm_add_epi32(_mm_loadu_si128((__m128i *)(total + i + 4)), hi));
+   }
+#endif
+   for(; i < n; i++){
+      total[i] += in[i];
+   }
+}
+
+/* out = saturate(total - in), in may be NULL for the full mix */
+static void mixMinus(gint16 *out, const gint32 *total, const gint16 *in, gint n){
+   gint i = 0;
+   gint32 v;
+#if defined(__AVX2__)
+   for(; i + 16 <= n; i += 16){
+      __m256i lo = _mm256_loadu_si256((const __m256i *)(total + i));
+      __m256i hi = _mm256_loadu_si256((const __m256i *)(total + i + 8));
+      if(in){
+         __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+         lo = _mm256_sub_epi32(lo, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x)));
+         hi = _mm256_sub_epi32(hi, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1)));
+      }
+      /* packs works per 128 bit lane, put the quadwords back in order */
+      _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+   }
+#elif defined(__SSE2__)
+   for(; i + 8 <= n; i += 8){
+      __m128i lo = _mm_loadu_si128((const __m128i *)(total + i));
+      __m128i hi = _mm_loadu_si128((const __m128i *)(total + i + 4));
+      if(in){
+         __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+         lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+         hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+      }
+      _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+   }
+#endif
+   for(; i < n; i++){
+      v = total[i] - (in ? in[i] : 0);
+      out[i] = (gint16)CLAMP(v, G_MININT16, G_MAXINT16);
+   }
+}
+
+/* Decoded audio from a participant, queued until the mixing thread takes it */
+static void bridgeNewBuffer(GstAppSink *appsink, Participant *part){
+   GstBuffer *buffer = gst_app_sink_pull_buffer(appsink);
+
+   if(!buffer)
+      return;
+
+   g_mutex_lock(&part->lock);
+   gst_adapter_push(part->adapter, buffer);
+   /* Never let a participant run ahead of the mix, drop the oldest audio */
+   if(gst_adapter_available(part->adapter) > MAX_QUEUED_FRAMES * FRAME_BYTES){
+      gst_adapter_flush(part->adapter, gst_adapter_available(part->adapter) - MAX_QUEUED_FRAMES * FRAME_BYTES);
+   }
+   g_mutex_unlock(&part->lock);
+}
+
+/* Push one mixed frame into an encoder branch */
+static void bridgePush(GstElement *appsrc, const gint32 *total, const gint16 *in, guint64 frame){
+   GstBuffer *buffer = gst_buffer_new_and_alloc(FRAME_BYTES);
+
+   mixMinus((gint16 *)GST_BUFFER_DATA(buffer), total, in, FRAME_SAMPLES);
+   GST_BUFFER_TIMESTAMP(buffer) = frame * FRAME_USEC * GST_USECOND;
+   GST_BUFFER_DURATION(buffer) = FRAME_USEC * GST_USECOND;
+   gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+}
+
+/* Mixing thread, every 20 ms the inputs are summed once and each participant
+   gets the sum minus their own input, listen-only clients get the full sum */
+static gpointer bridgeLoop(CustomData *data){
+   gint32 total[FRAME_SAMPLES];
+   gint64 next = g_get_monotonic_time();
+   gint64 now, start;
+   Participant *part;
+   GList *l;
+
+   while(g_atomic_int_get(&data->bridge_running)){
+      next += FRAME_USEC;
+      now = g_get_monotonic_time();
+      if(next > now)
+         g_usleep(next - now);
+
+      g_mutex_lock(&data->bridge_lock);
+      start = g_get_monotonic_time();
+      memset(total, 0, sizeof(total));
+
+      for(l = data->participants; l; l = l->next){
+         part = l->data;
+         g_mutex_lock(&part->lock);
+         part->active = gst_adapter_available(part->adapter) >= FRAME_BYTES;
+         if(part->active){
+            gst_adapter_copy(part->adapter, (guint8 *)part->frame, 0, FRAME_BYTES);
+            gst_adapter_flush(part->adapter, FRAME_BYTES);
+         }
+         g_mutex_unlock(&part->lock);
+         if(part->active){
+            mixAccumulate(total, part->frame, FRAME_SAMPLES);
+         }
+      }
+
+      for(l = data->participants; l; l = l->next){
+         part = l->data;
+         bridgePush(part->appsrc, total, part->active ? part->frame : NULL, data->bridge_frames);
+      }
+      /* One encode shared by all listen-only clients, their mix is identical */
+      if(g_atomic_int_get(&data->listen_clients) > 0){
+         bridgePush(data->listen_src, total, NULL, data->bridge_frames);
+      }
+
+      data->bridge_frames++;
+      data->mix_usec += g_get_monotonic_time() - start;
+      data->mix_frames++;
+      g_mutex_unlock(&data->bridge_lock);
+   }
+   return NULL;
+}
+
+/* appsrc ! opusenc ! rtpopuspay ! sink, the encoder branch for one mix */
+static GstElement *newEncoderBin(const gchar *name, GstElement **appsrc, GstElement *sink, const EncoderProfile *profile){
+   GstElement *bin, *encoder, *pay;
+   GstCaps *caps;
+
+   bin = gst_bin_new(name);
+   *appsrc = gst_element_factory_make("appsrc", NULL);
+   encoder = gst_element_factory_make("opusenc", NULL);
+   pay = gst_element_factory_make("rtpopuspay", NULL);
+
+   /* The sink stays the caller's when this fails */
+   if(!*appsrc || !encoder || !pay || !sink){
+      g_printerr("Could not create all encoder elements.\n");
+      if(*appsrc)
+         gst_object_unref(*appsrc);
+      if(encoder)
+         gst_object_unref(encoder);
+      if(pay)
+         gst_object_unref(pay);
+      *appsrc = NULL;
+      gst_object_unref(bin);
+      return NULL;
+   }
+
+   media_apply_profile(encoder, profile);
+   caps = media_raw_caps();
+   g_object_set(*appsrc, "caps", caps, "format", GST_FORMAT_TIME, "is-live", TRUE, NULL);
+   gst_caps_unref(caps);
+   g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+
+   gst_bin_add_many(GST_BIN(bin), *appsrc, encoder, pay, sink, NULL);
+   gst_element_link_many(*appsrc, encoder, pay, sink, NULL);
+   return bin;
+}
+
+static void freeParticipant(Participant *part){
+   g_mutex_clear(&part->lock);
+   g_object_unref(part->adapter);
+   g_free(part->host);
+   g_free(part);
+}
+
+/* Bridge mode: decode a participant once and send back its mix-minus */
+static gboolean makeBridgePort(gchar *args, CustomData *data){
+   Participant *part;
+   gchar host[64];
+   gchar *name;
+   GstElement *sink;
+   GstPad *pad, *sinkpad;
+   GstCaps *caps;
+   GList *l;
+   gint port, base;
+   gboolean linked;
+
+   if(sscanf(args, "%d %63[^:]:%d", &port, host, &base) != 3){
+      g_printerr("Usage: P <PORT> <IP:PORT>\n");
+      return FALSE;
+   }
+   for(l = data->participants; l; l = l->next){
+      if(((Participant *)l->data)->port == port){
+         g_printerr("Already bridging port %d.\n", port);
+         return FALSE;
+      }
+   }
+
+   part = g_new0(Participant, 1);
+   part->port = port;
+   part->host = g_strdup(host);
+   part->base = base;
+   part->adapter = gst_adapter_new();
+   g_mutex_init(&part->lock);
+
+   part->rec = newReceiver(port);
+   part->appsink = gst_element_factory_make("appsink", NULL);
+   sink = gst_element_factory_make("udpsink", NULL);
+   name = g_strdup_printf("MixBin%d", port);
+   part->sbin = newEncoderBin(name, &part->appsrc, sink, data->profile);
+   g_free(name);
+
+   if(!part->rec || !part->appsink || !part->sbin){
+      g_printerr("Could not create bridge participant.\n");
+      if(part->rec)
+         freeReceiver(part->rec);
+      if(part->appsink)
+         gst_object_unref(part->appsink);
+      if(part->sbin)
+         gst_object_unref(part->sbin);
+      else if(sink)
+         gst_object_unref(sink);
+      freeParticipant(part);
+      return FALSE;
+   }
+   g_object_set(sink, "host", host, "port", base, NULL);
+
+   caps = media_raw_caps();
+   g_object_set(part->appsink, "caps", caps, "sync", FALSE, "emit-signals", TRUE, NULL);
+   gst_caps_unref(caps);
+   g_signal_connect(part->appsink, "new-buffer", G_CALLBACK(bridgeNewBuffer), part);
+
+   gst_bin_add_many(GST_BIN(data->rpipeline), part->rec->media->bin, part->appsink, part->sbin, NULL);
+   pad = gst_element_get_static_pad(part->rec->media->bin, "src");
+   sinkpad = gst_element_get_static_pad(part->appsink, "sink");
+   linked = gst_pad_link(pad, sinkpad) == GST_PAD_LINK_OK;
+   gst_object_unref(sinkpad);
+   gst_object_unref(pad);
+
+   /* The receiver binds its port when it starts, someone else may hold it */
+   if(!linked || !gst_element_sync_state_with_parent(part->sbin) ||
+         !gst_element_sync_state_with_parent(part->appsink) ||
+         !gst_element_sync_state_with_parent(part->rec->media->bin)){
+      g_printerr("Could not start bridge participant on port %d.\n", port);
+      gst_element_set_state(part->rec->media->bin, GST_STATE_NULL);
+      gst_element_set_state(part->appsink, GST_STATE_NULL);
+      gst_element_set_state(part->sbin, GST_STATE_NULL);
+      gst_bin_remove_many(GST_BIN(data->rpipeline), part->rec->media->bin, part->appsink, part->sbin, NULL);
+      freeReceiver(part->rec);
+      freeParticipant(part);
+      return FALSE;
+   }
+
+   g_mutex_lock(&data->bridge_lock);
+   data->participants = g_list_append(data->participants, part);
+   g_mutex_unlock(&data->bridge_lock);
+   return TRUE;
+}
+
+static gboolean breakBridgePort(gint port, CustomData *data){
+   Participant *part = NULL;
+   GList *l;
+
+   g_mutex_lock(&data->bridge_lock);
+   for(l = data->participants; l; l = l->next){
+      if(((Participant *)l->data)->port == port){
+         part = l->data;
+         data->participants = g_list_delete_link(data->participants, l);
+         break;
+      }
+   }
+   g_mutex_unlock(&data->bridge_lock);
+
+   if(!part){
+      g_printerr("Not bridging port %d.\n", port);
+      return FALSE;
+   }
+
+   gst_element_set_state(part->rec->media->bin, GST_STATE_NULL);
+   gst_element_set_state(part->appsink, GST_STATE_NULL);
+   gst_element_set_state(part->sbin, GST_STATE_NULL);
+   gst_bin_remove_many(GST_BIN(data->rpipeline), part->rec->media->bin, part->appsink, part->sbin, NULL);
+
+   freeReceiver(part->rec);
+   freeParticipant(part);
+   return TRUE;
+}
+
+/* Live test tone i, encoded and sent as RTP to host:port. Same sender chain
+   as the microphone, fed by a tone instead */
+static MediaSender *newTestSender(gint i, const gchar *host, gint port, CustomData *data){
+   GstElement *tone;
+   MediaSender *sender;
+   gchar *name;
 
-   /* Name the pipeline: RecBin<PORT> */
-   bin_name = g_strconcat("RecBin", port, NULL);
+   tone = gst_element_factory_make("audiotestsrc", NULL);
+   if(tone)
+      g_object_set(tone, "is-live", TRUE, "freq", (gdouble)(200 + 20*i), NULL);
+   name = g_strdup_printf("TestSender%d", port);
+   sender = media_sender_new(name, tone, data->profile);
+   g_free(name);
+   if(sender)
+      media_sender_add(sender, host, port);
+   return sender;
+}
 
-   rec.rsource = gst_element_factory_make("udpsrc","rsource");
-   rec.rjitterbuffer = gst_element_factory_make("gstrtpjitterbuffer","rjitterbuffer");
-   rec.rdepay = gst_element_factory_make("rtpopusdepay","rdepay");
-   rec.rdecoder = gst_element_factory_make("opusdec","rdecoder");
-   rec.rsink = gst_element_factory_make("alsasink","rsink");
-  
-   rec.rpipeline = gst_pipeline_new(bin_name);
+/* Start N live test tones encoded and sent as RTP to IP:PORT, IP:PORT+1, ... */
+static gboolean makeTestSenders(gchar *args, CustomData *data){
+   gchar host[64];
+   gint n, port, i;
+   MediaSender *sender;
 
-   if(!rec.rsource || !rec.rjitterbuffer || !rec.rdepay || !rec.rdecoder || !rec.rsink){
-      g_printerr("Could not create all receiver elements.\n");
+   if(sscanf(args, "%d %63[^:]:%d", &n, host, &port) != 3){
+      g_printerr("Usage: T <N> <IP:PORT>\n");
       return FALSE;
    }
 
-   gst_bin_add_many(GST_BIN(rec.rpipeline), rec.rsource, rec.rjitterbuffer, rec.rdepay, rec.rdecoder, rec.rsink, NULL);
+   for(i = 0; i < n; i++){
+      sender = newTestSender(i, host, port+i, data);
+      if(!sender){
+         return FALSE;
+      }
+      gst_element_set_state(sender->pipeline, GST_STATE_PLAYING);
+      data->test_senders = g_list_prepend(data->test_senders, sender);
+   }
+   g_print("Started %d test senders to %s:%d-%d\n", n, host, port, port+n-1);
+   return TRUE;
+}
 
-   gst_element_link_many(rec.rsource, rec.rjitterbuffer, rec.rdepay, rec.rdecoder, rec.rsink,NULL);
+static guint64 stampKey(GstBuffer *buffer){
+   return ((guint64)gst_rtp_buffer_get_ssrc(buffer) << 32) | gst_rtp_buffer_get_timestamp(buffer);
+}
+
+/* Send time of every packet of a latency run's test senders */
+static gboolean sendStampProbe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+   guint64 *key;
+   gint64 *sent;
 
-   rec.caps = gst_caps_new_simple(MIME,
-      "media", G_TYPE_STRING, MEDIA,
-      "clock-rate", G_TYPE_INT, CLOCK_RATE,
-      "encoding-name", G_TYPE_STRING, ENCODING,
-   NULL);  
-   g_object_set(rec.rsource, "caps", rec.caps, "port", atoi(port), NULL);
+   if(!gst_rtp_buffer_validate(buffer))
+      return TRUE;
+   key = g_new(guint64, 1);
+   *key = stampKey(buffer);
+   sent = g_new(gint64, 1);
+   *sent = g_get_monotonic_time();
+   g_mutex_lock(&data->stamp_lock);
+   g_hash_table_replace(data->stamps, key, sent);
+   g_mutex_unlock(&data->stamp_lock);
+   return TRUE;
+}
 
-   gst_element_set_state(rec.rpipeline, GST_STATE_PLAYING);
+static gint compareArrival(gconstpointer a, gconstpointer b, gpointer unused){
+   GstClockTime pa = ((const StampArrival *)a)->pts;
+   GstClockTime pb = ((const StampArrival *)b)->pts;
+   return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
 
-   gst_bin_add(GST_BIN(data->bin), rec.rpipeline);
+/* A test packet leaves the jitterbuffer: its send time now goes with the
+   timestamp it is mixed at */
+static gboolean arrivalStampProbe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+   StampArrival *arrival;
+   gint64 *sent;
+   guint64 key;
 
+   if(!gst_rtp_buffer_validate(buffer) || !GST_BUFFER_TIMESTAMP_IS_VALID(buffer))
+      return TRUE;
+   key = stampKey(buffer);
+   g_mutex_lock(&data->stamp_lock);
+   sent = g_hash_table_lookup(data->stamps, &key);
+   if(sent){
+      arrival = g_new(StampArrival, 1);
+      arrival->pts = GST_BUFFER_TIMESTAMP(buffer);
+      arrival->sent = *sent;
+      g_queue_insert_sorted(&data->arrivals, arrival, compareArrival, NULL);
+      g_hash_table_remove(data->stamps, &key);
+   }
+   g_mutex_unlock(&data->stamp_lock);
    return TRUE;
 }
 
-static gboolean breakReceiverBin(gchar *port, CustomData *data){
-   gchar *bin_name;
-   GstElement *deletebin;
-   bin_name = g_strconcat("RecBin", port, NULL);
-   deletebin = gst_bin_get_by_name(GST_BIN(data->bin), bin_name);
-   gst_bin_remove(GST_BIN(data->bin), deletebin);
-   gst_element_set_state(deletebin, GST_STATE_NULL);
-   gst_object_unref(deletebin);
+/* Mixer output: every test packet mixed into this buffer was sent that long ago */
+static gboolean mixStampProbe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+   GstClockTime end;
+   StampArrival *arrival;
+   gint64 now = g_get_monotonic_time();
+   gdouble ms;
+
+   if(!GST_BUFFER_TIMESTAMP_IS_VALID(buffer))
+      return TRUE;
+   end = GST_BUFFER_TIMESTAMP(buffer);
+   if(GST_BUFFER_DURATION_IS_VALID(buffer))
+      end += GST_BUFFER_DURATION(buffer);
+
+   g_mutex_lock(&data->stamp_lock);
+   while((arrival = g_queue_peek_head(&data->arrivals)) && arrival->pts < end){
+      g_queue_pop_head(&data->arrivals);
+      if(now >= data->latency_since){
+         ms = (now - arrival->sent) / 1000.0;
+         g_array_append_val(data->latencies, ms);
+      }
+      g_free(arrival);
+   }
+   g_mutex_unlock(&data->stamp_lock);
+   return TRUE;
+}
+
+static gint compareDouble(gconstpointer a, gconstpointer b){
+   gdouble da = *(const gdouble *)a;
+   gdouble db = *(const gdouble *)b;
+   return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* Stop the senders and receivers of the current step and print what was measured */
+static void finishLatencyStep(CustomData *data){
+   gint n = latency_senders[data->latency_step];
+   GArray *lat = data->latencies;
+   Receiver *rec;
+   GstPad *pad;
+   GList *l;
+   gint i;
+
+   for(l = data->latency_senders; l; l = l->next){
+      media_sender_free(l->data);
+   }
+   g_list_free(data->latency_senders);
+   data->latency_senders = NULL;
+   for(i = 0; i < n; i++){
+      rec = g_hash_table_lookup(data->receivers, GINT_TO_POINTER(data->latency_port + i));
+      if(!rec || !rec->stamp_probe)
+         continue;
+      pad = gst_element_get_static_pad(rec->media->jitterbuffer, "src");
+      gst_pad_remove_buffer_probe(pad, rec->stamp_probe);
+      gst_object_unref(pad);
+      rec->stamp_probe = 0;
+      breakReceiverBin(data->latency_port + i, data);
+   }
+
+   g_mutex_lock(&data->stamp_lock);
+   g_array_sort(lat, compareDouble);
+   if(lat->len > 0){
+      g_print("%2d senders: %u packets, end-to-end latency at the mixer min %.1f, median %.1f, "
+         "95%% %.1f, max %.1f ms\n", n, lat->len, g_array_index(lat, gdouble, 0),
+         g_array_index(lat, gdouble, lat->len / 2), g_array_index(lat, gdouble, lat->len * 95 / 100),
+         g_array_index(lat, gdouble, lat->len - 1));
+   }
+   else{
+      g_printerr("%2d senders: no test packet reached the mixer\n", n);
+   }
+   g_array_set_size(lat, 0);
+   g_hash_table_remove_all(data->stamps);
+   g_queue_foreach(&data->arrivals, (GFunc)g_free, NULL);
+   g_queue_clear(&data->arrivals);
+   g_mutex_unlock(&data->stamp_lock);
+}
+
+/* Start latency_senders[step] test senders to local ports from latency_port up
+   and listen to each of them, then come back after LATENCY_RUN_MS */
+static gboolean latencyStep(CustomData *data){
+   MediaSender *sender;
+   Receiver *rec;
+   GstPad *pad;
+   gint n, i;
+
+   if(data->latency_step >= 0)
+      finishLatencyStep(data);
+   data->latency_step++;
+   if(data->latency_step >= (gint)G_N_ELEMENTS(latency_senders)){
+      pad = gst_element_get_static_pad(data->mixer, "src");
+      gst_pad_remove_buffer_probe(pad, data->mix_probe);
+      gst_object_unref(pad);
+      data->mix_probe = 0;
+      data->latency_step = -1;
+      return FALSE;
+   }
+
+   n = latency_senders[data->latency_step];
+   for(i = 0; i < n; i++){
+      if(!makeReceiverBin(data->latency_port + i, data))
+         continue;
+      rec = g_hash_table_lookup(data->receivers, GINT_TO_POINTER(data->latency_port + i));
+      pad = gst_element_get_static_pad(rec->media->jitterbuffer, "src");
+      rec->stamp_probe = gst_pad_add_buffer_probe(pad, G_CALLBACK(arrivalStampProbe), data);
+      gst_object_unref(pad);
+
+      sender = newTestSender(i, "127.0.0.1", data->latency_port + i, data);
+      if(!sender)
+         continue;
+      pad = gst_element_get_static_pad(sender->pay, "src");
+      gst_pad_add_buffer_probe(pad, G_CALLBACK(sendStampProbe), data);
+      gst_object_unref(pad);
+      gst_element_set_state(sender->pipeline, GST_STATE_PLAYING);
+      data->latency_senders = g_list_prepend(data->latency_senders, sender);
+   }
+   data->latency_since = g_get_monotonic_time() + LATENCY_WARMUP_MS * 1000;
+   g_timeout_add(LATENCY_RUN_MS, (GSourceFunc)latencyStep, data);
+   return FALSE;
+}
+
+/* Measure the latency from test sender to mixer output with each count of
+   latency_senders in turn. Packets are stamped with their send time by SSRC
+   and RTP timestamp, and matched at the mixer by the timestamp the
+   jitterbuffer gave them */
+static gboolean startLatencyRun(gint port, CustomData *data){
+   GstPad *pad;
+
+   if(port <= 0){
+      g_printerr("Usage: L <PORT>\n");
+      return FALSE;
+   }
+   if(data->mix_probe){
+      g_printerr("Latency run already in progress.\n");
+      return FALSE;
+   }
+
+   data->latency_port = port;
+   data->latency_step = -1;
+   pad = gst_element_get_static_pad(data->mixer, "src");
+   data->mix_probe = gst_pad_add_buffer_probe(pad, G_CALLBACK(mixStampProbe), data);
+   gst_object_unref(pad);
+   latencyStep(data);
+   return TRUE;
+}
+
+/* Number of threads of this process, read from /proc */
+static gint threadCount(void){
+   gchar *status = NULL;
+   gchar *line;
+   gint threads = -1;
+
+   if(g_file_get_contents("/proc/self/status", &status, NULL, NULL)){
+      line = strstr(status, "Threads:");
+      if(line)
+         threads = atoi(line + strlen("Threads:"));
+      g_free(status);
+   }
+   return threads;
+}
+
+/* Process CPU time in microseconds */
+static gint64 cpuTime(void){
+   struct rusage ru;
+
+   getrusage(RUSAGE_SELF, &ru);
+   return (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Measuring starts once the senders of a load step have settled */
+static gboolean loadWarm(CustomData *data){
+   if(data->mode == MODE_BRIDGE){
+      g_mutex_lock(&data->bridge_lock);
+      data->mix_usec = 0;
+      data->mix_frames = 0;
+      g_mutex_unlock(&data->bridge_lock);
+   }
+   data->load_packets = g_atomic_int_get(&data->packets);
+   data->load_wall = g_get_monotonic_time();
+   data->load_cpu = cpuTime();
+   return FALSE;
+}
+
+/* Print what the current load step cost, then stop its senders and participants */
+static void finishLoadStep(CustomData *data){
+   gint n = load_senders[data->latency_step];
+   gint64 wall = g_get_monotonic_time();
+   gint64 cpu = cpuTime();
+   gint packets = g_atomic_int_get(&data->packets);
+   gdouble secs = (wall - data->load_wall) / (gdouble)G_USEC_PER_SEC;
+   gdouble cpu_pct = wall > data->load_wall ? 100.0 * (cpu - data->load_cpu) / (wall - data->load_wall) : 0.0;
+   gdouble pps;
+   GList *l;
+   gint relayed, i;
+
+   if(data->mode == MODE_BRIDGE){
+      g_mutex_lock(&data->bridge_lock);
+      g_print("%2d senders: bridging %d, mix %.1f us/frame, CPU %.1f%%, threads %d\n", n,
+         g_list_length(data->participants),
+         data->mix_frames ? (gdouble)data->mix_usec / data->mix_frames : 0.0,
+         cpu_pct, threadCount());
+      g_mutex_unlock(&data->bridge_lock);
+   }
+   else{
+      /* Every packet in goes out to each other participant */
+      relayed = g_list_length(data->participants);
+      pps = secs > 0 ? (guint)(packets - data->load_packets) / secs : 0.0;
+      g_print("%2d senders: relaying %d, %.0f packets/s in, %.0f packets/s out, CPU %.1f%%, threads %d\n",
+         n, relayed, pps, pps * MAX(relayed - 1, 0), cpu_pct, threadCount());
+   }
+
+   for(l = data->latency_senders; l; l = l->next){
+      media_sender_free(l->data);
+   }
+   g_list_free(data->latency_senders);
+   data->latency_senders = NULL;
+   for(i = 0; i < n; i++){
+      if(data->mode == MODE_BRIDGE)
+         breakBridgePort(data->latency_port + i, data);
+      else
+         breakRelayPort(data->latency_port + i, data);
+   }
+}
+
+/* Bridge or relay load_senders[step] test senders from latency_port up, then come back
+   after LATENCY_RUN_MS */
+static gboolean loadStep(CustomData *data){
+   MediaSender *sender;
+   gchar *args;
+   gboolean ok;
+   gint n, i;
+
+   if(data->latency_step >= 0)
+      finishLoadStep(data);
+   data->latency_step++;
+   if(data->latency_step >= (gint)G_N_ELEMENTS(load_senders)){
+      data->latency_step = -1;
+      data->load_run = FALSE;
+      return FALSE;
+   }
+
+   n = load_senders[data->latency_step];
+   for(i = 0; i < n; i++){
+      args = g_strdup_printf("%d 127.0.0.1:%d", data->latency_port + i, data->latency_port + LOAD_RETURN_OFFSET + i);
+      ok = data->mode == MODE_BRIDGE ? makeBridgePort(args, data) : makeRelayPort(args, data);
+      g_free(args);
+      if(!ok)
+         continue;
+
+      sender = newTestSender(i, "127.0.0.1", data->latency_port + i, data);
+      if(!sender)
+         continue;
+      gst_element_set_state(sender->pipeline, GST_STATE_PLAYING);
+      data->latency_senders = g_list_prepend(data->latency_senders, sender);
+   }
+   g_timeout_add(LATENCY_WARMUP_MS, (GSourceFunc)loadWarm, data);
+   g_timeout_add(LATENCY_RUN_MS, (GSourceFunc)loadStep, data);
+   return FALSE;
+}
+
+/* Measure CPU usage and mixing time of the bridge, or packet rate and CPU
+   usage of the relay, with each count of load_senders in turn */
+static gboolean startLoadRun(gint port, CustomData *data){
+   if(port <= 0){
+      g_printerr("Usage: L <PORT>\n");
+      return FALSE;
+   }
+   if(data->load_run){
+      g_printerr("Load run already in progress.\n");
+      return FALSE;
+   }
+
+   data->load_run = TRUE;
+   data->latency_port = port;
+   data->latency_step = -1;
+   loadStep(data);
+   return TRUE;
+}
+
+/* Print branch count, CPU usage since the last call, threads and the latency the
+   mixer is configured for, 'L' measures it */
+static void printStats(CustomData *data){
+   gint64 wall, cpu;
+   gdouble cpu_pct = 0;
+   GstQuery *query;
+   gboolean live;
+   GstClockTime min_lat = 0, max_lat = 0;
+   gint packets, dropped;
+   gdouble pps = 0, dps = 0;
+
+   cpu = cpuTime();
+   wall = g_get_monotonic_time();
+   if(data->sender){
+      packets = g_atomic_int_get(&data->sender->packets);
+      dropped = g_atomic_int_get(&data->sender->dropped);
+   }
+   else{
+      packets = g_atomic_int_get(&data->packets);
+      dropped = 0;
+   }
+   if(data->last_wall && wall > data->last_wall){
+      cpu_pct = 100.0 * (cpu - data->last_cpu) / (wall - data->last_wall);
+      pps = (guint)(packets - data->last_packets) * (gdouble)G_USEC_PER_SEC / (wall - data->last_wall);
+      dps = (guint)(dropped - data->last_dropped) * (gdouble)G_USEC_PER_SEC / (wall - data->last_wall);
+   }
+   data->last_wall = wall;
+   data->last_cpu = cpu;
+   data->last_packets = packets;
+   data->last_dropped = dropped;
+
+   if(data->mode == MODE_BRIDGE){
+      g_mutex_lock(&data->bridge_lock);
+      g_print("Bridging %d participants, mix %.1f us/frame, CPU %.1f%%, threads %d\n",
+         g_list_length(data->participants),
+         data->mix_frames ? (gdouble)data->mix_usec / data->mix_frames : 0.0,
+         cpu_pct, threadCount());
+      data->mix_usec = 0;
+      data->mix_frames = 0;
+      g_mutex_unlock(&data->bridge_lock);
+      return;
+   }
+
+   if(data->mode == MODE_RELAY){
+      g_print("Relaying %d participants to %d clients, %.0f packets/s in, CPU %.1f%%, threads %d\n",
+         g_list_length(data->participants), g_list_length(data->relay_clients),
+         pps, cpu_pct, threadCount());
+      return;
+   }
+
+   query = gst_query_new_latency();
+   if(gst_element_query(data->rpipeline, query))
+      gst_query_parse_latency(query, &live, &min_lat, &max_lat);
+   gst_query_unref(query);
+
+   g_print("Listening on %d ports, test senders %d, CPU %.1f%%, threads %d, configured latency %" GST_TIME_FORMAT "\n",
+      g_hash_table_size(data->receivers), g_list_length(data->test_senders),
+      cpu_pct, threadCount(), GST_TIME_ARGS(min_lat));
+   g_print("Sending %.0f packets/s, %.0f packets/s suppressed, VAD %s\n",
+      pps, dps, data->sender->vad ? "on" : "off");
+}
+
+/* Conference mode: microphone sender and a mixer that all listened ports are added to */
+static gboolean makeConference(CustomData *data){
+   data->sender = media_sender_new("SenderPipeline", NULL, data->profile);
+   if(!data->sender){
+      return FALSE;
+   }
+   gst_bin_add(GST_BIN(data->bin), data->sender->pipeline);
+
+   /* Receiver pipeline, port branches are added to the mixer at runtime */
+   data->rpipeline = gst_pipeline_new("ReceiverPipeline");
+   data->mixer = gst_element_factory_make("liveadder","mixer");
+   data->mconvert = gst_element_factory_make("audioconvert","mconvert");
+   data->msink = gst_element_factory_make("alsasink","msink");
+
+   if(!data->rpipeline || !data->mixer || !data->mconvert || !data->msink){
+      g_printerr("Could not create all mixer elements.\n");
+      return FALSE;
+   }
+
+   gst_bin_add_many(GST_BIN(data->rpipeline), data->mixer, data->mconvert, data->msink, NULL);
+
+   if(!gst_element_link_many(data->mixer, data->mconvert, data->msink, NULL)){
+      g_printerr("Could not link mixer elements.\n");
+   }
+
+   gst_bin_add(GST_BIN(data->bin), data->rpipeline);
+   gst_element_set_state(data->sender->pipeline, GST_STATE_PLAYING);
+
+   fillReceiverPool(data);
+
+   g_timeout_add(RANK_INTERVAL_MS, (GSourceFunc)rankSpeakers, data);
+   return TRUE;
+}
+
+/* Relay mode: headless, no microphone, decoder or sound card involved */
+static gboolean makeRelay(CustomData *data){
+   data->rpipeline = gst_pipeline_new("RelayPipeline");
+   if(!data->rpipeline){
+      g_printerr("Could not create relay pipeline.\n");
+      return FALSE;
+   }
+   gst_bin_add(GST_BIN(data->bin), data->rpipeline);
+   return TRUE;
+}
+
+/* Bridge mode: headless, every participant is decoded once and mixed in bridgeLoop */
+static gboolean makeBridge(CustomData *data){
+   GstElement *sink;
+
+   data->rpipeline = gst_pipeline_new("BridgePipeline");
+   sink = gst_element_factory_make("multiudpsink", "listensink");
+   data->listen_sink = sink;
+   if(!data->rpipeline || !(sink = newEncoderBin("ListenBin", &data->listen_src, sink, data->profile))){
+      g_printerr("Could not create bridge pipeline.\n");
+      return FALSE;
+   }
+   gst_bin_add(GST_BIN(data->rpipeline), sink);
+   gst_bin_add(GST_BIN(data->bin), data->rpipeline);
+
+   g_mutex_init(&data->bridge_lock);
+   data->bridge_running = 1;
+   data->bridge_thread = g_thread_new("bridge", (GThreadFunc)bridgeLoop, data);
    return TRUE;
 }
 
 int main (int argc, char *argv[]){
    CustomData data;
    GIOChannel *io_stdin;
+   GstBus *bus;
+   GList *l;
    gst_init(&argc, &argv);
    memset(&data, 0, sizeof(data));
 
-   data.bin = gst_bin_new("BigDaddyBin");
-
-   data.source = gst_element_factory_make("autoaudiosrc","source");
-   data.convert = gst_element_factory_make("audioconvert","convert");
-   data.resample = gst_element_factory_make("audioresample","resample");
-   data.encoder = gst_element_factory_make("opusenc","encoder");
-   data.pay = gst_element_factory_make("rtpopuspay","pay");
-   data.sink = gst_element_factory_make("multiudpsink","sink");
- 
-   /* Init pipeline and check that everything was made correctly */
-   data.spipeline = gst_pipeline_new("SenderPipeline");
-
-   if(!data.spipeline || !data.source || !data.convert || !data.resample || !data.encoder || !data.pay || !data.sink){
-      g_printerr("Could not create all elements.\n");
-      return -1;
+   if(argc > 2 && g_ascii_strcasecmp(argv[1], "bench") == 0){
+      return benchProfiles(argv[2]) ? 0 : -1;
    }
 
-   /* Put elements into sender pipeline */
-   gst_bin_add_many(GST_BIN(data.spipeline), data.source, data.convert, data.resample, data.encoder, data.pay, data.sink, NULL);
+   data.bin = gst_bin_new("BigDaddyBin");
+   data.receivers = g_hash_table_new(g_direct_hash, g_direct_equal);
+   data.profile = &media_profiles[0];
+   g_mutex_init(&data.stamp_lock);
+   data.stamps = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+   data.latencies = g_array_new(FALSE, FALSE, sizeof(gdouble));
 
-   /* Link sender side elements */
+   if(argc > 1 && g_ascii_strcasecmp(argv[1], "relay") == 0){
+      data.mode = MODE_RELAY;
+   }
+   else if(argc > 1 && g_ascii_strcasecmp(argv[1], "bridge") == 0){
+      data.mode = MODE_BRIDGE;
+   }
 
-   if(!gst_element_link_many(data.source, data.convert, data.resample, data.encoder, data.pay, data.sink, NULL)){
-      g_printerr("Could not link elements on sender side.\n");
+   if(data.mode == MODE_RELAY && !makeRelay(&data)){
+      return -1;
+   }
+   if(data.mode == MODE_BRIDGE && !makeBridge(&data)){
+      return -1;
+   }
+   if(data.mode == MODE_CONFERENCE && !makeConference(&data)){
+      return -1;
+   }
+   if(data.mode != MODE_RELAY){
+      g_timeout_add(JB_INTERVAL_MS, (GSourceFunc)jitterTimer, &data);
    }
 
-   gst_bin_add(GST_BIN(data.bin), data.spipeline);
+   /* A plain top bin has no bus, without one the receiver pipeline's
+      LATENCY messages would be dropped */
+   bus = gst_bus_new();
+   gst_element_set_bus(data.bin, bus);
+   gst_bus_add_watch(bus, (GstBusFunc)media_latency_cb, data.rpipeline);
+   gst_object_unref(bus);
 
-   print_menu("");
+   print_menu("", &data);
 
    io_stdin = g_io_channel_unix_new(fileno(stdin));   
    g_io_add_watch(io_stdin, G_IO_IN, (GIOFunc)handle_keyboard, &data);
 
-   gst_element_set_state(data.spipeline, GST_STATE_PLAYING);
    gst_element_set_state(data.bin, GST_STATE_PLAYING);
    data.loop = g_main_loop_new(NULL, FALSE);
    g_main_loop_run(data.loop);
@@ -186,8 +1788,32 @@ int main (int argc, char *argv[]){
    /* Free allocated stuff */
    g_main_loop_unref(data.loop);
 
+   if(data.bridge_thread){
+      g_atomic_int_set(&data.bridge_running, 0);
+      g_thread_join(data.bridge_thread);
+   }
+
+   for(l = data.test_senders; l; l = l->next){
+      media_sender_free(l->data);
+   }
+   g_list_free(data.test_senders);
+   for(l = data.latency_senders; l; l = l->next){
+      media_sender_free(l->data);
+   }
+   g_list_free(data.latency_senders);
+
    gst_element_set_state(data.bin, GST_STATE_NULL);
+   for(l = data.receiver_pool; l; l = l->next){
+      freeReceiver(l->data);
+   }
+   g_list_free(data.receiver_pool);
+   g_hash_table_destroy(data.receivers);
+   g_hash_table_destroy(data.stamps);
+   g_queue_foreach(&data.arrivals, (GFunc)g_free, NULL);
+   g_queue_clear(&data.arrivals);
+   g_array_free(data.latencies, TRUE);
    gst_object_unref(data.bin);
+   if(data.sender)
+      media_sender_free(data.sender);
    return 0;
 }
-
@@ -3,15 +3,33 @@
 #include <pjsua-lib/pjsua.h>
 #include <pjmedia.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <gst/gst.h>
-
-#define MIME "application/x-rtp"
-#define MEDIA "audio"
-#define CLOCK_RATE 48000
-#define ENCODING "X-GST-OPUS-DRAFT-SPITTKA-00"
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include "../common/mediaengine.h"
+#include "opussdp.h"
 
 #define SIP_PORT 5060
-#define RTP_PORT (SIP_PORT-50)
+#define RTP_PORT (sip_port-50)
+
+/* Concurrent calls, each gets an even RTP port from RTP_PORT upwards */
+#define MAX_CALLS 64
+
+/* Opus is offered as a dynamic payload type, next to the draft name older
+	GStreamer phones use. Frames longer than MAX_PTIME ms are never asked for */
+#define OPUS_PT 96
+#define OPUS_LEGACY_PT 97
+#define MAX_PTIME 60
+
+/* The ringtone is decoded once and looped from memory in chunks of RING_CHUNK_MS,
+	decoding gives up after RING_DECODE_TIMEOUT */
+#define RINGTONE_FILE "ringtone.ogg"
+#define RING_CHUNK_MS 20
+#define RING_DECODE_TIMEOUT (10 * GST_SECOND)
+
+/* Measurement window of a concurrent call load run */
+#define LOAD_MEASURE_MS 5000
 
 #define USER "lab3"
 
@@ -23,19 +41,101 @@
 
 static pjsip_endpoint *g_endpt;
 static pj_caching_pool cp;
-static pjsip_inv_session *g_inv;
 
-/* Lock so answering can only be done when it's ringing */
-static gboolean is_ringing = FALSE;
+static pjsip_transport *g_tp;
+
+/* SIP port can be overridden on the command line so two phones can run on one host */
+static gint sip_port = SIP_PORT;
+
+/* Answer incoming calls directly without waiting for 'A' */
+static gboolean auto_answer = FALSE;
+
+/* Back-to-back call latency run started with 'L' */
+typedef struct _LatencyRun {
+	gchar *uri;
+	gboolean active;
+	gint call_id;
+	gint remaining;
+	gint done;
+	gdouble min, max, total;
+} LatencyRun;
+
+static LatencyRun lrun;
+
+/* Concurrent call load run started with 'M': setup rate until all calls are
+	confirmed, then CPU per call while they run */
+typedef struct _LoadRun {
+	gboolean active;
+	gint total;
+	gint confirmed;
+	gint failed;
+	gint64 start;
+	gint64 wall;
+	gint64 cpu;
+} LoadRun;
+
+static LoadRun load;
+
+/* One call: its INVITE session, the receiver branch on its own RTP port in the
+	mixer and its destination on the microphone sender */
+typedef struct _Call {
+	gint id;
+	pjsip_inv_session *inv;
+	gboolean ringing;
+	gboolean held;
+	gboolean load;
+
+	/* Setup timing, from INVITE sent until CONFIRMED */
+	gint64 invite_time;
+
+	/* When an incoming INVITE arrived, for the time until the ringtone plays */
+	gint64 ring_time;
+
+	/* Local RTP port, the peer's address and port come from its SDP */
+	gint port;
+	gchar *target;
+	gint t_port;
+
+	/* Agreed in the SDP offer/answer: the payload type each side receives
+		with, and the encoder settings the peer asked for. The microphone is
+		encoded once for all calls, within the limits of every call sent to */
+	gboolean negotiated;
+	OpusParams opus;
+
+	MediaReceiver *media;
+	GstPad *mixpad;
+
+	/* Media runs from the first SDP answer on, early media on 18x included.
+		Sending and, for incoming calls, mixing wait for the 200 OK */
+	gboolean running;
+	gboolean connected;
+
+	/* When the 200 OK was sent or received, cleared at the first sample mixed in */
+	gint64 answer_time;
+} Call;
+
+/* A call whose sender gate opened, until the next packet leaves the sender */
+typedef struct _PacketWait {
+	gint id;
+	gint64 answer_time;
+} PacketWait;
+
+/* Session table, newest call first. pjsip finds a call through inv->mod_data */
+static GList *calls;
+static gint next_call_id = 1;
 
 static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e);
 static void call_on_forked(pjsip_inv_session *inv, pjsip_event *e);
 static void call_on_media_update(pjsip_inv_session *inv, pj_status_t status);
-static pj_status_t create_sdp(pj_pool_t *pool, pjmedia_sdp_session **p_sdp);
+static pj_status_t create_sdp(pj_pool_t *pool, gint port, pjmedia_sdp_session **p_sdp);
 static pj_bool_t on_rx_request(pjsip_rx_data *rdata);
-static pj_bool_t make_call(char *ipaddr);
-static pj_bool_t answer_call(void);
-static pj_bool_t hangup_call(void);
+static Call *make_call(char *ipaddr);
+static pj_bool_t answer_call(Call *call);
+static pj_bool_t hangup_call(Call *call);
+static gboolean latency_next(gpointer unused);
+static gboolean hangup_later(gpointer call_id);
+static gboolean load_confirmed(gpointer unused);
+static gboolean load_finish(gpointer unused);
 
 static pjsip_module user_agent = {
 	NULL, NULL,
@@ -91,72 +191,242 @@ static pjsip_module msg_logger = {
 #endif
 
 /* Gstreamer Structs for recieving and sending RTP as well as mainloop */
-typedef struct _Receiver {
+typedef struct _Mixer {
    GstElement *rpipeline;
-   GstElement *rsource;
-   GstElement *rjitterbuffer;
-   GstElement *rdepay;
-   GstElement *rdecoder;
+   GstElement *adder;
+   GstElement *convert;
    GstElement *rsink;
-   GstCaps *caps;
-} Receiver;
+
+   /* Calls with RTP running and the ringtone, in READY when there are none */
+   gint running;
+
+   /* Print jitterbuffer statistics every JB_INTERVAL_MS, toggled with 'J' */
+   gboolean jitter_dump;
+} Mixer;
 
 typedef struct _CustomData {
    GMainLoop *loop;
    GstElement *bin;
 
-   /* Sender side elements */
-   GstElement *spipeline;
-   GstElement *source;
-   GstElement *convert;
-   GstElement *resample;
-   GstElement *encoder;
-   GstElement *pay;
-   GstElement *sink;
+   /* Microphone sender, voice activity detection is toggled with 'V'. The
+      profile selected with 'O' is offered in SDP, the encoder runs with it
+      clamped to what every call sent to accepts */
+   MediaSender *sender;
+   const EncoderProfile *profile;
+   gboolean vad;
+   EncoderProfile sent_profile;
+   gboolean sent_dtx;
+
+   /* PacketWait entries, filled from the main loop and emptied by the sender thread */
+   GMutex packet_lock;
+   GSList *packet_waits;
+
+   /* Counters at the last 'I' */
+   gint64 last_wall;
+   gint64 last_cpu;
+   gint last_packets;
+   gint last_dropped;
 } CustomData;
 
-/* Gstreamer struct for playing a ringtone */
+/* Ringtone decoded to PCM at startup. appsrc ! audioconvert is a branch of the
+	mixer, so the ring plays on the sound card the calls already hold open. It
+	idles in READY between calls and loops the PCM without seeking */
 typedef struct _Ringtone{
-	GstElement *pipeline;
-	GstElement *filesrc;
-	GstElement *demux;
-	GstElement *decode;
-	GstElement *convert;
-	GstElement *resample;
-	GstElement *sink;
-
-	guint bus_watch_id;
+	GstElement *bin;
+	GstElement *appsrc;
+	GstPad *mixpad;
+	GstBuffer *pcm;
+	gboolean playing;
+
+	/* Read position in pcm and samples pushed since the last stop, from the
+		running time of the mixer at the start */
+	guint offset;
+	guint64 samples;
+	GstClockTime base;
+
+	/* INVITE arrival of the call the ring started for, until it is mixed */
+	gint call_id;
+	gint64 invite_time;
 } Ringtone;
 
 static Ringtone rt;
 static CustomData data;
-static gchar *target;
-static gint t_port;
+
+/* Receiver pipeline, built at startup, the branches of the calls are mixed into one sink */
+static Mixer mix;
+
+/* GSource that dispatches pjsip as soon as the SIP socket is readable
+	or the next pjsip timer is due */
+typedef struct _SipSource {
+	GSource source;
+	GPollFD pfd;
+} SipSource;
+
+static gboolean sip_source_prepare(GSource *source, gint *timeout);
+static gboolean sip_source_check(GSource *source);
+static gboolean sip_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+static GSourceFuncs sip_source_funcs = {
+	sip_source_prepare,
+	sip_source_check,
+	sip_source_dispatch,
+	NULL,
+};
+
+/* Upper bound of events handled per wakeup so the GLib loop is never starved */
+#define MAX_EVENTS_PER_DISPATCH 32
 
 /* Gstreamer stuff */
 static gboolean handle_events(void);
-static gboolean start_rtp(void);
-static gboolean stop_rtp(void);
-static gboolean start_ringtone(void);
+static gboolean make_mixer(void);
+static gboolean start_rtp(Call *call);
+static gboolean stop_rtp(Call *call);
+static void connect_call(Call *call);
+static gboolean packet_probe(GstPad *pad, GstBuffer *buffer, CustomData *data);
+static gboolean make_ringtone(void);
+static void free_ringtone(void);
+static gboolean start_ringtone(Call *call);
 static gboolean stop_ringtone(void);
-static void on_pad_added(GstElement *element, GstPad *pad, gpointer data);
-static gboolean repeat_sound(GstBus *bus, GstMessage *msg, gpointer data);
+static void print_stats(CustomData *data);
+static gboolean jitter_timer(Mixer *m);
+static gint64 cpu_time(void);
 
 static void print_menu(gchar *msg){
    g_print(
       "Menu: %s \n"
       " 'C <sip:USERNAME@IP:PORT>' to make call \n"
-      " 'A' to answer a call \n"
-      " 'H' hangup current call \n"
+      " 'A [ID]' to answer a call, the one ringing longest without ID \n"
+      " 'H [ID]' hangup a call, the newest without ID \n"
+      " 'K <ID>' toggle hold of a call \n"
+      " 'S' list calls \n"
+      " 'U' toggle auto answer \n"
+      " 'V' toggle voice activity detection \n"
+      " 'I' print sender statistics \n"
+      " 'J' toggle periodic jitterbuffer statistics \n"
+      " 'O <lowlatency-voice|hifi|lowcpu>' select encoder profile \n"
+      " 'L <sip:USERNAME@IP:PORT> <N>' measure setup time of N back-to-back calls \n"
+      " 'M <sip:USERNAME@IP:PORT> <N>' place N concurrent calls, report setup rate and CPU per call \n"
       " 'Q' to quit \n", msg
    );
 }
 
+static Call *find_call(gint id){
+	GList *l;
+
+	for(l = calls; l; l = l->next){
+		if(((Call *)l->data)->id == id)
+			return l->data;
+	}
+	return NULL;
+}
+
+/* The call ringing the longest */
+static Call *ringing_call(void){
+	GList *l;
+
+	for(l = g_list_last(calls); l; l = l->prev){
+		if(((Call *)l->data)->ringing)
+			return l->data;
+	}
+	return NULL;
+}
+
+/* Ringtone plays while any call rings */
+static void update_ringtone(void){
+	Call *call = ringing_call();
+
+	if(call){
+		if(!rt.playing)
+			start_ringtone(call);
+	}
+	else{
+		stop_ringtone();
+	}
+}
+
+/* The one encoder serves every call, so it runs with the strictest of what
+	the calls sent to negotiated: shortest frames, lowest bitrate, FEC and DTX
+	only when all of them take it. Back to the selected profile when the calls
+	end. The encoder restarts only when the result changed */
+static void apply_call_limits(void){
+	EncoderProfile profile = *data.profile;
+	gboolean dtx = data.vad;
+	GList *l;
+	Call *call;
+
+	/* Calls still ended by pjsip on the way out outlive the sender */
+	if(!data.sender)
+		return;
+	for(l = calls; l; l = l->next){
+		call = l->data;
+		if(!call->negotiated || call->held)
+			continue;
+		profile.frame_size = MIN(profile.frame_size, call->opus.profile.frame_size);
+		profile.bitrate = MIN(profile.bitrate, call->opus.profile.bitrate);
+		profile.inband_fec = profile.inband_fec && call->opus.profile.inband_fec;
+		dtx = dtx && call->opus.dtx;
+	}
+	if(!profile.inband_fec)
+		profile.packet_loss = 0;
+
+	if(dtx != data.sent_dtx){
+		data.sent_dtx = dtx;
+		media_sender_set_vad(data.sender, dtx);
+	}
+	if(profile.frame_size != data.sent_profile.frame_size || profile.bitrate != data.sent_profile.bitrate ||
+		profile.inband_fec != data.sent_profile.inband_fec || profile.packet_loss != data.sent_profile.packet_loss ||
+		profile.name != data.sent_profile.name){
+		data.sent_profile = profile;
+		media_sender_set_profile(data.sender, &data.sent_profile);
+		g_print("Sending %d ms frames, %d bit/s, FEC %s, DTX %s\n", profile.frame_size, profile.bitrate,
+			profile.inband_fec ? "on" : "off", dtx ? "on" : "off");
+	}
+}
+
+/* A held call is not sent to and its audio is not mixed in */
+static void hold_call(Call *call, gboolean held){
+	if(call->held == held)
+		return;
+	call->held = held;
+	if(call->running && call->connected && call->target){
+		if(held)
+			media_sender_remove_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
+		else
+			media_sender_add_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
+	}
+	apply_call_limits();
+}
+
+static void list_calls(void){
+	GList *l;
+	Call *call;
+
+	if(!calls){
+		g_print("No calls\n");
+		return;
+	}
+	for(l = g_list_last(calls); l; l = l->prev){
+		call = l->data;
+		g_print("Call %d: %s, RTP port %d -> %s:%d%s\n", call->id,
+			pjsip_inv_state_name(call->inv->state), call->port,
+			call->target ? call->target : "?", call->t_port, call->held ? ", on hold" : "");
+	}
+}
+
 static gboolean handle_keyboard(GIOChannel *source, GIOCondition cond, CustomData *data){
    gchar *str = NULL;
+   const EncoderProfile *profile;
+   Call *call;
+   gint id;
 
-   if(g_io_channel_read_line(source, &str, NULL, NULL, NULL) != G_IO_STATUS_NORMAL){
-      return TRUE;
+   switch(g_io_channel_read_line(source, &str, NULL, NULL, NULL)){
+      case G_IO_STATUS_NORMAL:
+         break;
+      case G_IO_STATUS_EOF:
+         /* Run on without a keyboard, e.g. auto answering under a load generator */
+         return FALSE;
+      default:
+         return TRUE;
    }
 
    switch (g_ascii_tolower (str[0])){
@@ -165,24 +435,113 @@ static gboolean handle_keyboard(GIOChannel *source, GIOCondition cond, CustomDat
          break;
 
       case 'c':
-			if(make_call(str+2)){
-				target = g_strsplit(g_strsplit((str+2), ":", 3)[1], "@", 2)[1];
-				t_port = atoi(g_strsplit((str+2), ":", 3)[2])-50;
+			make_call(str+2);
+         break;
+
+      case 'v':
+			data->vad = !data->vad;
+			apply_call_limits();
+			print_menu(data->vad ? "Voice activity detection on" : "Voice activity detection off");
+         break;
+
+      case 'i':
+			print_stats(data);
+         break;
+
+      case 'o':
+			profile = media_find_profile(g_strstrip(str+2));
+			if(!profile){
+				print_menu("Unknown encoder profile");
+			}
+			else{
+				data->profile = profile;
+				g_print("Encoder profile %s\n", profile->name);
+				apply_call_limits();
+			}
+         break;
+
+      case 'j':
+			mix.jitter_dump = !mix.jitter_dump;
+         break;
+
+      case 's':
+			list_calls();
+         break;
+
+      case 'k':
+			call = find_call(atoi(str+1));
+			if(!call){
+				print_menu("No such call");
+			}
+			else{
+				hold_call(call, !call->held);
+				g_print("Call %d %s\n", call->id, call->held ? "on hold" : "resumed");
+			}
+         break;
+
+      case 'm':
+			if(!load.active && !lrun.active){
+				gchar **args = g_strsplit(g_strstrip(str+2), " ", 2);
+				if(args[0] && args[1] && atoi(args[1]) > 0){
+					memset(&load, 0, sizeof(load));
+					load.active = TRUE;
+					load.total = MIN(atoi(args[1]), MAX_CALLS);
+					load.start = g_get_monotonic_time();
+					for(id = 0; id < load.total; id++){
+						call = make_call(args[0]);
+						if(!call){
+							load.failed++;
+							continue;
+						}
+						call->load = TRUE;
+					}
+					if(load.failed == load.total)
+						load_confirmed(NULL);
+				}
+				g_strfreev(args);
+			}
+         break;
+
+      case 'u':
+			auto_answer = !auto_answer;
+			print_menu(auto_answer ? "Auto answer on" : "Auto answer off");
+         break;
+
+      case 'l':
+			if(!calls && !lrun.active && !load.active){
+				gchar **args = g_strsplit(g_strstrip(str+2), " ", 2);
+				if(args[0] && args[1] && atoi(args[1]) > 0){
+					g_free(lrun.uri);
+					memset(&lrun, 0, sizeof(lrun));
+					lrun.uri = g_strdup(args[0]);
+					lrun.active = TRUE;
+					lrun.remaining = atoi(args[1]);
+					latency_next(NULL);
+				}
+				g_strfreev(args);
 			}
          break;
 
       case 'a':
-			if(is_ringing){
-				if(answer_call()){
-					is_ringing = FALSE;
-					stop_ringtone();
+			id = atoi(str+1);
+			call = id ? find_call(id) : ringing_call();
+			if(call && call->ringing){
+				if(answer_call(call)){
+					/* Call waiting, the calls already up are put on hold */
+					GList *l;
+					for(l = calls; l; l = l->next){
+						if(l->data != call && ((Call *)l->data)->connected)
+							hold_call(l->data, TRUE);
+					}
 					print_menu("Call Answered!");
 				}
 			}
          break;
 
       case 'h':
-			if(hangup_call()){
+			id = atoi(str+1);
+			call = id ? find_call(id) : (calls ? calls->data : NULL);
+			if(call && hangup_call(call)){
 				print_menu("Call Hangup!");
 			}
          break;
@@ -198,36 +557,49 @@ static gboolean handle_keyboard(GIOChannel *source, GIOCondition cond, CustomDat
 int main(int argc, char *argv[]){
 	/* Gstreamer and GLib init */
 	GIOChannel *io_stdin;
-	gst_init(&argc, &argv);
+	GSource *sip_source;
+	GOptionContext *context;
+	GError *err = NULL;
+	GstPad *pad;
+	GOptionEntry entries[] = {
+		{ "auto-answer", 'u', 0, G_OPTION_ARG_NONE, &auto_answer, "Answer incoming calls without waiting for 'A'", NULL },
+		{ NULL }
+	};
+
+	context = g_option_context_new("[SIP port] - SIP phone");
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gst_init_get_option_group());
+	if(!g_option_context_parse(context, &argc, &argv, &err)){
+		g_printerr("%s\n", err->message);
+		return 1;
+	}
+	g_option_context_free(context);
 	memset(&data, 0, sizeof(data));
 
-	data.bin = gst_bin_new("BigDaddyBin");
+	if(argc > 1)
+		sip_port = atoi(argv[1]);
 
-   data.source = gst_element_factory_make("autoaudiosrc","source");
-   data.convert = gst_element_factory_make("audioconvert","convert");
-   data.resample = gst_element_factory_make("audioresample","resample");
-   data.encoder = gst_element_factory_make("opusenc","encoder");
-   data.pay = gst_element_factory_make("rtpopuspay","pay");
-   data.sink = gst_element_factory_make("multiudpsink","sink");
- 
-   /* Init pipeline and check that everything was made correctly */
-   data.spipeline = gst_pipeline_new("SenderPipeline");
-
-   if(!data.spipeline || !data.source || !data.convert || !data.resample || !data.encoder || !data.pay || !data.sink){
-      g_printerr("Could not create all elements.\n");
-      return -1;
-   }
-
-   /* Put elements into sender pipeline */
-   gst_bin_add_many(GST_BIN(data.spipeline), data.source, data.convert, data.resample, data.encoder, data.pay, data.sink, NULL);
+	data.bin = gst_bin_new("BigDaddyBin");
 
-   /* Link sender side elements */
+	data.profile = &media_profiles[0];
+	data.sent_profile = *data.profile;
+	data.sender = media_sender_new("SenderPipeline", NULL, &data.sent_profile);
+	if(!data.sender){
+		return -1;
+	}
+	pad = gst_element_get_static_pad(data.sender->tee, "sink");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(packet_probe), &data);
+	gst_object_unref(pad);
+	gst_element_set_state(data.sender->pipeline, GST_STATE_PLAYING);
+   gst_bin_add(GST_BIN(data.bin), data.sender->pipeline);
+
+	if(!make_mixer()){
+		return -1;
+	}
+	g_timeout_add(JB_INTERVAL_MS, (GSourceFunc)jitter_timer, &mix);
 
-   if(!gst_element_link_many(data.source, data.convert, data.resample, data.encoder, data.pay, data.sink, NULL)){
-      g_printerr("Could not link elements on sender side.\n");
-   }
-	gst_element_set_state(data.spipeline, GST_STATE_PLAYING);
-   gst_bin_add(GST_BIN(data.bin), data.spipeline);
+	/* Calls ring silently without it */
+	make_ringtone();
 
    gst_element_set_state(data.bin, GST_STATE_PLAYING);
 	io_stdin = g_io_channel_unix_new(fileno(stdin));
@@ -265,9 +637,9 @@ int main(int argc, char *argv[]){
 	/* Add UDP transport */
 	{
 		pj_sockaddr addr;
-		pj_sockaddr_init(AF, &addr, NULL, (pj_uint16_t)SIP_PORT);
+		pj_sockaddr_init(AF, &addr, NULL, (pj_uint16_t)sip_port);
 		if(AF == pj_AF_INET()){
-			status = pjsip_udp_transport_start(g_endpt, &addr.ipv4, NULL, 1, NULL);
+			status = pjsip_udp_transport_start(g_endpt, &addr.ipv4, NULL, 1, &g_tp);
 		}
 		else{
 			status = PJ_EAFNOTSUP;
@@ -293,6 +665,7 @@ int main(int argc, char *argv[]){
 		pj_bzero(&inv_cb, sizeof(inv_cb));
 		inv_cb.on_state_changed = &call_on_state_changed;
 		inv_cb.on_new_session = &call_on_forked;
+		inv_cb.on_media_update = &call_on_media_update;
 
 		status = pjsip_inv_usage_init(g_endpt, &inv_cb);
 		PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -313,15 +686,29 @@ int main(int argc, char *argv[]){
 #endif
 	
 	print_menu("");
-	g_timeout_add_seconds(1, (GSourceFunc)handle_events, NULL);
+
+	/* Let the GLib main loop poll the SIP socket and the pjsip timer heap */
+	sip_source = g_source_new(&sip_source_funcs, sizeof(SipSource));
+	((SipSource *)sip_source)->pfd.fd = (gint)pjsip_udp_transport_get_socket(g_tp);
+	((SipSource *)sip_source)->pfd.events = G_IO_IN | G_IO_ERR | G_IO_HUP;
+	g_source_add_poll(sip_source, &((SipSource *)sip_source)->pfd);
+	g_source_attach(sip_source, NULL);
+
 	data.loop = g_main_loop_new(NULL, FALSE);
 	g_main_loop_run(data.loop);
 
 	/* Unref everything */
+	g_source_destroy(sip_source);
+	g_source_unref(sip_source);
 	g_main_loop_unref(data.loop);
 
    gst_element_set_state(data.bin, GST_STATE_NULL);
    gst_object_unref(data.bin);
+	free_ringtone();
+	gst_element_set_state(mix.rpipeline, GST_STATE_NULL);
+	gst_object_unref(mix.rpipeline);
+	media_sender_free(data.sender);
+	data.sender = NULL;
 	if(g_endpt)
 		pjsip_endpt_destroy(g_endpt);
 	if(pool)
@@ -329,19 +716,192 @@ int main(int argc, char *argv[]){
 	return 0;
 }
 
-/* Periodic callback to handle SIP events and check if ringtone shall play */
+/* Handle all SIP events that are ready, a burst of messages is drained in one wakeup */
 static gboolean handle_events(void){
-	pj_time_val timeout = {0, 10};
-	pjsip_endpt_handle_events(g_endpt, &timeout);
+	pj_time_val timeout = {0, 0};
+	unsigned count;
+	gint i;
+
+	for(i = 0; i < MAX_EVENTS_PER_DISPATCH; i++){
+		count = 0;
+		pjsip_endpt_handle_events2(g_endpt, &timeout, &count);
+		if(count == 0)
+			break;
+	}
 	return TRUE;
 }
 
+/* Sleep in poll() until the next pjsip timer is due */
+static gboolean sip_source_prepare(GSource *source, gint *timeout){
+	pj_time_val now, next;
+	PJ_UNUSED_ARG(source);
+
+	*timeout = -1;
+	if(pj_timer_heap_earliest_time(pjsip_endpt_get_timer_heap(g_endpt), &next) == PJ_SUCCESS){
+		pj_gettickcount(&now);
+		PJ_TIME_VAL_SUB(next, now);
+		if(next.sec < 0 || (next.sec == 0 && next.msec <= 0)){
+			*timeout = 0;
+			return TRUE;
+		}
+		*timeout = PJ_TIME_VAL_MSEC(next);
+	}
+	return FALSE;
+}
+
+static gboolean sip_source_check(GSource *source){
+	gint timeout;
+	if(((SipSource *)source)->pfd.revents & (G_IO_IN | G_IO_ERR | G_IO_HUP))
+		return TRUE;
+	return sip_source_prepare(source, &timeout);
+}
+
+static gboolean sip_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data){
+	PJ_UNUSED_ARG(source);
+	PJ_UNUSED_ARG(callback);
+	PJ_UNUSED_ARG(user_data);
+	return handle_events();
+}
+
+/* Place the next call of a latency run, or print the summary when done */
+static gboolean latency_next(gpointer unused){
+	Call *call;
+
+	if(lrun.remaining > 0){
+		lrun.remaining--;
+		call = make_call(lrun.uri);
+		if(call){
+			lrun.call_id = call->id;
+			return FALSE;
+		}
+		g_printerr("Latency run aborted, could not place call.\n");
+	}
+
+	if(lrun.done > 0){
+		g_print("Latency run: %d calls, INVITE->CONFIRMED min %.2f ms, avg %.2f ms, max %.2f ms\n",
+			lrun.done, lrun.min, lrun.total / lrun.done, lrun.max);
+	}
+	lrun.active = FALSE;
+	return FALSE;
+}
+
+/* Hang up from the main loop, never from within a pjsip callback */
+static gboolean hangup_later(gpointer call_id){
+	Call *call = find_call(GPOINTER_TO_INT(call_id));
+
+	if(call)
+		hangup_call(call);
+	return FALSE;
+}
+
+/* All calls of a load run are set up or failed, measure CPU while they run */
+static gboolean load_confirmed(gpointer unused){
+	gdouble secs = (g_get_monotonic_time() - load.start) / (gdouble)G_USEC_PER_SEC;
+
+	g_print("Load run: %d of %d calls confirmed in %.2f s, %.1f calls/s, %d failed\n",
+		load.confirmed, load.total, secs, secs > 0 ? load.confirmed / secs : 0.0, load.failed);
+	load.wall = g_get_monotonic_time();
+	load.cpu = cpu_time();
+	g_timeout_add(load.confirmed ? LOAD_MEASURE_MS : 0, load_finish, NULL);
+	return FALSE;
+}
+
+static gboolean load_finish(gpointer unused){
+	gint64 wall = g_get_monotonic_time() - load.wall;
+	gint64 cpu = cpu_time() - load.cpu;
+	GList *l;
+
+	if(load.confirmed > 0 && wall > 0){
+		g_print("Load run: %d concurrent calls, CPU %.1f%% total, %.2f%% per call\n", load.confirmed,
+			100.0 * cpu / wall, 100.0 * cpu / wall / load.confirmed);
+	}
+	for(l = calls; l; l = l->next){
+		if(((Call *)l->data)->load)
+			hangup_call(l->data);
+	}
+	load.active = FALSE;
+	return FALSE;
+}
+
 /*
 	=========== PJSIP functions ===========
 */
 
+/* First even port of the pool that no call uses and nothing else has bound */
+static gint alloc_port(void){
+	GSocket *socket;
+	GSocketAddress *address;
+	GInetAddress *any;
+	GList *l;
+	gboolean available = FALSE;
+	gint i, port = 0;
+
+	any = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+	for(i = 0; i < MAX_CALLS * 2; i++){
+		port = RTP_PORT + 2 * i;
+		available = TRUE;
+		for(l = calls; l && available; l = l->next){
+			if(((Call *)l->data)->port == port)
+				available = FALSE;
+		}
+		if(!available)
+			continue;
+
+		socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+		address = g_inet_socket_address_new(any, port);
+		available = socket && g_socket_bind(socket, address, FALSE, NULL);
+		g_object_unref(address);
+		if(socket)
+			g_object_unref(socket);
+		if(available)
+			break;
+	}
+	g_object_unref(any);
+	return available ? port : 0;
+}
+
+/* Session for a new dialog, NULL when the table is full */
+static Call *call_new(void){
+	Call *call;
+	gint port;
+
+	if(g_list_length(calls) >= MAX_CALLS)
+		return NULL;
+	port = alloc_port();
+	if(!port)
+		return NULL;
+
+	call = g_new0(Call, 1);
+	call->id = next_call_id++;
+	call->port = port;
+	calls = g_list_prepend(calls, call);
+	return call;
+}
+
+static void call_free(Call *call){
+	stop_rtp(call);
+	if(call->inv)
+		call->inv->mod_data[user_agent.id] = NULL;
+	calls = g_list_remove(calls, call);
+	g_free(call->target);
+	g_free(call);
+	apply_call_limits();
+}
+
+/* Undo a call whose setup failed: the entry and its port go, and so does the
+	INVITE session, or the dialog when the session was never created */
+static void call_abort(Call *call, pjsip_dialog *dlg){
+	pjsip_inv_session *inv = call->inv;
+
+	call_free(call);
+	if(inv)
+		pjsip_inv_terminate(inv, 500, PJ_FALSE);
+	else
+		pjsip_dlg_terminate(dlg);
+}
+
 /* Make a call */
-static pj_bool_t make_call(char *ipaddr){
+static Call *make_call(char *ipaddr){
 	pj_sockaddr hostaddr;
 	char temp[80], hostip[PJ_INET6_ADDRSTRLEN+2];
 	pj_str_t local_uri;
@@ -350,14 +910,15 @@ static pj_bool_t make_call(char *ipaddr){
 	pjmedia_sdp_session *sdp;
 	pjsip_tx_data *tdata;
 	pj_status_t status;
+	Call *call;
 
 	if(pj_gethostip(AF, &hostaddr) != PJ_SUCCESS){
 		g_printerr("Unable to get local host IP\n");
-		return PJ_FALSE;
+		return NULL;
 	}
 
 	pj_sockaddr_print(&hostaddr, hostip, sizeof(hostip), 2);
-	pj_ansi_sprintf(temp, "sip:lab3@%s:%d", hostip, SIP_PORT);
+	pj_ansi_sprintf(temp, "sip:lab3@%s:%d", hostip, sip_port);
 	local_uri = pj_str(temp);
 
 	/* Make UAC dialog */
@@ -365,52 +926,76 @@ static pj_bool_t make_call(char *ipaddr){
 
 	if(status != PJ_SUCCESS){
 	 	g_printerr("Unable to create UAC dialog: %d\n", status);
-		return PJ_FALSE;
+		return NULL;
+	}
+
+	call = call_new();
+	if(!call){
+		g_printerr("No free call slot or RTP port\n");
+		pjsip_dlg_terminate(dlg);
+		return NULL;
 	}
 
 	/* Make INVITE session */
-	create_sdp(dlg->pool, &sdp);
-	status = pjsip_inv_create_uac(dlg, sdp, 0, &g_inv);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	create_sdp(dlg->pool, call->port, &sdp);
+	status = pjsip_inv_create_uac(dlg, sdp, 0, &call->inv);
+	if(status != PJ_SUCCESS){
+		g_printerr("Unable to create INVITE session: %d\n", status);
+		call_abort(call, dlg);
+		return NULL;
+	}
+	call->inv->mod_data[user_agent.id] = call;
 	
 	/* Create and send INVITE request */
-	status = pjsip_inv_invite(g_inv, &tdata);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	status = pjsip_inv_invite(call->inv, &tdata);
+	if(status != PJ_SUCCESS){
+		g_printerr("Unable to create INVITE: %d\n", status);
+		call_abort(call, dlg);
+		return NULL;
+	}
 
-	status = pjsip_inv_send_msg(g_inv, tdata);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	call->invite_time = g_get_monotonic_time();
 
-	return PJ_TRUE;
+	status = pjsip_inv_send_msg(call->inv, tdata);
+	if(status != PJ_SUCCESS){
+		g_printerr("Unable to send INVITE: %d\n", status);
+		call_abort(call, dlg);
+		return NULL;
+	}
+
+	g_print("Call %d: calling %s\n", call->id, ipaddr);
+	return call;
 }
 
-static pj_bool_t answer_call(void){
+static pj_bool_t answer_call(Call *call){
 	pjsip_tx_data *tdata;
 	pj_status_t status;
-	if(g_inv){
-		/* Make and send 200 response */
-		status = pjsip_inv_answer(g_inv, 200, NULL, NULL, &tdata);
-		PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
 
-		status = pjsip_inv_send_msg(g_inv, tdata);
-		PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
-		return PJ_TRUE;
-	}
-	return PJ_FALSE;
+	/* Make and send 200 response */
+	status = pjsip_inv_answer(call->inv, 200, NULL, NULL, &tdata);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+
+	status = pjsip_inv_send_msg(call->inv, tdata);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+
+	call->ringing = FALSE;
+	update_ringtone();
+	return PJ_TRUE;
 }
 
-static pj_bool_t hangup_call(void){
+static pj_bool_t hangup_call(Call *call){
 	pjsip_tx_data *tdata;
 	pj_status_t status;
 
-	if(g_inv){
-		status = pjsip_inv_end_session(g_inv, 603, NULL, &tdata);
-		PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+	status = pjsip_inv_end_session(call->inv, 603, NULL, &tdata);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
 
-		status = pjsip_inv_send_msg(g_inv, tdata);
+	/* Nothing to send for a session that never got a response */
+	if(tdata){
+		status = pjsip_inv_send_msg(call->inv, tdata);
 		PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
-		return PJ_TRUE;
 	}
-	return PJ_FALSE;
+	return PJ_TRUE;
 }
 
 /* SIP User Agent Server callback, recieves requests and handles them */
@@ -423,6 +1008,8 @@ static pj_bool_t on_rx_request(pjsip_rx_data *rdata){
 	pjsip_tx_data *tdata;
 	pjmedia_sdp_session *sdp;
 	pj_status_t status;
+	gint64 now = g_get_monotonic_time();
+	Call *call;
 
 	/* Requests that are not supported will get a 500 response here */
 	if(rdata->msg_info.msg->line.req.method.id != PJSIP_INVITE_METHOD){
@@ -432,13 +1019,6 @@ static pj_bool_t on_rx_request(pjsip_rx_data *rdata){
 		}
 	return PJ_TRUE;
 	}
-	
-	/* Reject INVITE while a INVITE session is active with BUSY 486 */
-	if (g_inv){
-		pj_str_t reason = pj_str("Another call in progress");
-		pjsip_endpt_respond_stateless(g_endpt, rdata, 486, &reason, NULL, NULL);
-		return PJ_TRUE;
-	}
 
 	if(pj_gethostip(AF, &hostaddr) != PJ_SUCCESS){
 		g_printerr("Unable to get local host IP");
@@ -446,45 +1026,98 @@ static pj_bool_t on_rx_request(pjsip_rx_data *rdata){
 	}
 	pj_sockaddr_print(&hostaddr, hostip, sizeof(hostip), 2);
 	
-	pj_ansi_sprintf(temp, "<sip:lab3@%s:%d>", hostip, SIP_PORT);
+	/* Reject INVITE with BUSY 486 only when every call slot or RTP port is taken */
+	call = call_new();
+	if(!call){
+		pj_str_t reason = pj_str("Too many calls in progress");
+		pjsip_endpt_respond_stateless(g_endpt, rdata, 486, &reason, NULL, NULL);
+		return PJ_TRUE;
+	}
+
+	pj_ansi_sprintf(temp, "<sip:lab3@%s:%d>", hostip, sip_port);
 	local_uri = pj_str(temp);
 
 	/* Making UAS dialog */	
 	status = pjsip_dlg_create_uas(pjsip_ua_instance(), rdata, &local_uri, &dlg);
 	if (status != PJ_SUCCESS){
+		call_free(call);
 		pjsip_endpt_respond_stateless(g_endpt, rdata, 500, NULL, NULL, NULL);
 		return PJ_TRUE;
 	}
 	
 	/* Creating INVITE session */
-	create_sdp(dlg->pool, &sdp);
-	status = pjsip_inv_create_uas(dlg, rdata, sdp, 0, &g_inv);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+	create_sdp(dlg->pool, call->port, &sdp);
+	status = pjsip_inv_create_uas(dlg, rdata, sdp, 0, &call->inv);
+	if(status != PJ_SUCCESS){
+		pjsip_endpt_respond_stateless(g_endpt, rdata, 500, NULL, NULL, NULL);
+		call_abort(call, dlg);
+		return PJ_TRUE;
+	}
+	call->inv->mod_data[user_agent.id] = call;
 	
+	/* 183 with the SDP answer, pjsip negotiates only for 2xx and 18x other
+		than 180/181. Both phones have their media ready before the 200 */
+	status = pjsip_inv_initial_answer(call->inv, rdata, 183, NULL, NULL, &tdata);
+	if(status == PJ_SUCCESS)
+		status = pjsip_inv_send_msg(call->inv, tdata);
+
 	/* 180 Response */
-	status = pjsip_inv_initial_answer(g_inv, rdata, 180, NULL, NULL, &tdata);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+	if(status == PJ_SUCCESS)
+		status = pjsip_inv_answer(call->inv, 180, NULL, NULL, &tdata);
+	if(status == PJ_SUCCESS)
+		status = pjsip_inv_send_msg(call->inv, tdata);
 
-	status = pjsip_inv_send_msg(g_inv, tdata);
-	PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+	if(status != PJ_SUCCESS){
+		g_printerr("Unable to answer INVITE: %d\n", status);
+		call_abort(call, dlg);
+		return PJ_TRUE;
+	}
 	
-	is_ringing = TRUE;
-
-	target = pj_inet_ntoa(rdata->pkt_info.src_addr.ipv4.sin_addr);
-	t_port = (rdata->pkt_info.src_port)-50;
+	call->ringing = TRUE;
+	call->ring_time = now;
+	g_print("Call %d: incoming from %s\n", call->id, rdata->pkt_info.src_name);
+
+	if(auto_answer)
+		answer_call(call);
+	else
+		update_ringtone();
 	return PJ_TRUE;
 }
 
+static void add_attr(pj_pool_t *pool, pjmedia_sdp_media *m, const gchar *name, const gchar *value){
+	pj_str_t v;
+
+	pj_strdup2(pool, &v, value);
+	m->attr[m->attr_count++] = pjmedia_sdp_attr_create(pool, name, &v);
+}
+
+/* Opus settings of a call from the active SDP pair, the shared encoder is
+	clamped to them */
+static gboolean negotiate_opus(Call *call, const pjmedia_sdp_media *local, const pjmedia_sdp_media *remote){
+	if(!opus_negotiate(local, remote, data.profile, &call->opus))
+		return FALSE;
+	call->negotiated = TRUE;
+
+	g_print("Call %d: opus pt %d in, %d out, %d ms frames, %d bit/s, FEC %s, DTX %s\n", call->id,
+		call->opus.recv_pt, call->opus.send_pt, call->opus.profile.frame_size, call->opus.profile.bitrate,
+		call->opus.profile.inband_fec ? "on" : "off", call->opus.dtx ? "on" : "off");
+	apply_call_limits();
+	return TRUE;
+}
+
 /* Create SDP session without using PJSIP media endpoint
 	Inspired from (row 1001):
 	http://www.pjsip.org/pjmedia/docs/html/page_pjmedia_samples_siprtp_c.htm
 */
-static pj_status_t create_sdp(pj_pool_t *pool, pjmedia_sdp_session **p_sdp){
+static pj_status_t create_sdp(pj_pool_t *pool, gint port, pjmedia_sdp_session **p_sdp){
 	pj_time_val tv;
 	pjmedia_sdp_session *sdp;
+	pjmedia_sdp_media *m;
+	pjmedia_sdp_rtpmap rtpmap;
+	pjmedia_sdp_attr *attr;
+	gchar value[80];
 	PJ_ASSERT_RETURN(pool && p_sdp, PJ_EINVAL);
 	pj_sockaddr local_uri;
-	char connection_url[80];
 	pj_gethostip(AF, &local_uri);
 	sdp = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_session));
 
@@ -493,18 +1126,52 @@ static pj_status_t create_sdp(pj_pool_t *pool, pjmedia_sdp_session **p_sdp){
 	sdp->origin.version  = sdp->origin.id = tv.sec + 2208988800UL; 
 	sdp->origin.net_type = pj_str("IN");
 	sdp->origin.addr_type = pj_str("IP4");
-	sdp->origin.addr = pj_str(pj_inet_ntoa(local_uri.ipv4.sin_addr));
+	pj_strdup2(pool, &sdp->origin.addr, pj_inet_ntoa(local_uri.ipv4.sin_addr));
 	sdp->name = pj_str(USER);
 
 	sdp->conn = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_conn));
 	sdp->conn->net_type = pj_str("IN");
 	sdp->conn->addr_type = pj_str("IP4");
-
-	sdp->conn->addr = pj_str(pj_inet_ntoa(local_uri.ipv4.sin_addr));
+	sdp->conn->addr = sdp->origin.addr;
 
 	sdp->time.start = sdp->time.stop = 0;
 	sdp->attr_count = 0;
-	sdp->media_count = 0;
+
+	/* The RTP port of this call and what it wants to receive: Opus with the
+		selected profile's packetization and bitrate */
+	m = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_media));
+	m->desc.media = pj_str(MEDIA);
+	m->desc.port = (pj_uint16_t)port;
+	m->desc.port_count = 1;
+	m->desc.transport = pj_str("RTP/AVP");
+	m->desc.fmt_count = 2;
+	pj_strdup2(pool, &m->desc.fmt[0], G_STRINGIFY(OPUS_PT));
+	pj_strdup2(pool, &m->desc.fmt[1], G_STRINGIFY(OPUS_LEGACY_PT));
+
+	rtpmap.pt = m->desc.fmt[0];
+	rtpmap.enc_name = pj_str(SDP_ENCODING);
+	rtpmap.clock_rate = CLOCK_RATE;
+	rtpmap.param = pj_str(SDP_CHANNELS);
+	pjmedia_sdp_rtpmap_to_attr(pool, &rtpmap, &attr);
+	m->attr[m->attr_count++] = attr;
+
+	/* The decoder always reads in-band FEC */
+	g_snprintf(value, sizeof(value), "%d useinbandfec=1; usedtx=%d; maxaveragebitrate=%d",
+		OPUS_PT, data.vad ? 1 : 0, data.profile->bitrate);
+	add_attr(pool, m, "fmtp", value);
+
+	rtpmap.pt = m->desc.fmt[1];
+	rtpmap.enc_name = pj_str(ENCODING);
+	rtpmap.param.slen = 0;
+	pjmedia_sdp_rtpmap_to_attr(pool, &rtpmap, &attr);
+	m->attr[m->attr_count++] = attr;
+
+	g_snprintf(value, sizeof(value), "%d", data.profile->frame_size);
+	add_attr(pool, m, "ptime", value);
+	add_attr(pool, m, "maxptime", G_STRINGIFY(MAX_PTIME));
+
+	sdp->media[0] = m;
+	sdp->media_count = 1;
 
 	*p_sdp = sdp;
 	
@@ -512,24 +1179,62 @@ static pj_status_t create_sdp(pj_pool_t *pool, pjmedia_sdp_session **p_sdp){
 }
 
 static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e){
+	Call *call = inv->mod_data[user_agent.id];
 	PJ_UNUSED_ARG(e);
 
+	if(!call)
+		return;
+
 	if(inv->state == PJSIP_INV_STATE_DISCONNECTED){
-		g_inv = NULL;
-		is_ringing = FALSE;
-		stop_ringtone();
-		stop_rtp();
+		g_print("Call %d: disconnected\n", call->id);
+		if(call->load && !call->connected){
+			load.failed++;
+			if(load.active && load.confirmed + load.failed == load.total)
+				g_idle_add(load_confirmed, NULL);
+		}
+		call_free(call);
+		update_ringtone();
+
+		/* Continue a latency run from the main loop, not from within pjsip */
+		if(lrun.active){
+			g_idle_add(latency_next, NULL);
+		}
 	}
 	else if(inv->state == PJSIP_INV_STATE_NULL){
-		is_ringing = FALSE;
-		stop_ringtone();
+		call->ringing = FALSE;
+		update_ringtone();
 	}
 	else if(inv->state == PJSIP_INV_STATE_INCOMING){
-		is_ringing = TRUE;
-		start_ringtone();
+		call->ringing = TRUE;
+		update_ringtone();
+	}
+	else if(inv->state == PJSIP_INV_STATE_CONNECTING){
+		/* 200 OK sent, or received and ACKed */
+		connect_call(call);
 	}
 	else if(inv->state == PJSIP_INV_STATE_CONFIRMED){
-		start_rtp();
+		connect_call(call);
+
+		if(call->invite_time){
+			gdouble ms = (g_get_monotonic_time() - call->invite_time) / 1000.0;
+			call->invite_time = 0;
+			g_print("Call %d: setup INVITE->CONFIRMED %.2f ms\n", call->id, ms);
+
+			if(lrun.active && call->id == lrun.call_id){
+				if(lrun.done == 0 || ms < lrun.min)
+					lrun.min = ms;
+				if(ms > lrun.max)
+					lrun.max = ms;
+				lrun.total += ms;
+				lrun.done++;
+				g_idle_add(hangup_later, GINT_TO_POINTER(call->id));
+			}
+			if(call->load){
+				load.confirmed++;
+				if(load.active && load.confirmed + load.failed == load.total)
+					g_idle_add(load_confirmed, NULL);
+			}
+		}
 	}
 }
 
@@ -538,128 +1243,516 @@ static void call_on_forked(pjsip_inv_session *inv, pjsip_event *e){
 	PJ_UNUSED_ARG(e);
 }
 
-static void call_on_media_changed(pjsip_inv_session *inv, pj_status_t status){
-	PJ_UNUSED_ARG(inv);
-	PJ_UNUSED_ARG(status);
+/* Media of the call from the negotiated SDP: the peer's connection address and
+	m-line port, payload types and Opus settings. A re-INVITE updates a running call */
+static void call_on_media_update(pjsip_inv_session *inv, pj_status_t status){
+	Call *call = inv->mod_data[user_agent.id];
+	const pjmedia_sdp_session *local, *remote;
+	const pjmedia_sdp_conn *conn;
+	const pjmedia_sdp_media *m;
+	gint send_pt;
+
+	if(!call)
+		return;
+	if(status != PJ_SUCCESS){
+		g_printerr("Call %d: SDP negotiation failed: %d\n", call->id, status);
+		return;
+	}
+	if(pjmedia_sdp_neg_get_active_local(inv->neg, &local) != PJ_SUCCESS ||
+		pjmedia_sdp_neg_get_active_remote(inv->neg, &remote) != PJ_SUCCESS ||
+		local->media_count == 0 || remote->media_count == 0)
+		return;
+
+	m = remote->media[0];
+	conn = m->conn ? m->conn : remote->conn;
+	send_pt = call->opus.send_pt;
+	if(!conn || m->desc.port == 0 || !negotiate_opus(call, local->media[0], m)){
+		g_printerr("Call %d: no usable audio in the peer's SDP\n", call->id);
+		return;
+	}
+
+	if(call->running && call->connected && !call->held)
+		media_sender_remove_pt(data.sender, call->target, call->t_port, send_pt);
+	g_free(call->target);
+	call->target = g_strndup(conn->addr.ptr, conn->addr.slen);
+	call->t_port = m->desc.port;
+	if(call->running){
+		if(call->connected && !call->held)
+			media_sender_add_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
+	}
+	else if(!start_rtp(call)){
+		/* The answer is known from the 18x on, have the media ready before the 200.
+			Hung up from the main loop, pjsip may still be sending the answer */
+		g_idle_add(hangup_later, GINT_TO_POINTER(call->id));
+	}
 }
 
 /*
 	=========== Gstreamer functions ===========
 */
 
-static gboolean start_rtp(void){
-	/* Start listening on port */
-   Receiver rec;
-   rec.rsource = gst_element_factory_make("udpsrc","rsource");
-   rec.rjitterbuffer = gst_element_factory_make("gstrtpjitterbuffer","rjitterbuffer");
-   rec.rdepay = gst_element_factory_make("rtpopusdepay","rdepay");
-   rec.rdecoder = gst_element_factory_make("opusdec","rdecoder");
-   rec.rsink = gst_element_factory_make("alsasink","rsink");
-  
-   rec.rpipeline = gst_pipeline_new("ReceiverPipeline");
-
-   if(!rec.rsource || !rec.rjitterbuffer || !rec.rdepay || !rec.rdecoder || !rec.rsink){
+/* Periodic jitterbuffer tuning of every call in progress */
+static gboolean jitter_timer(Mixer *m){
+	GList *l;
+	Call *call;
+
+	for(l = calls; l; l = l->next){
+		call = l->data;
+		if(call->running)
+			media_receiver_adapt(call->media, m->jitter_dump);
+	}
+	return TRUE;
+}
+
+/* Audio of a held call does not reach the mixer, nor a caller's before it is
+	answered. Early media from a callee does. Reports 200 OK to the first sample */
+static gboolean mix_probe(GstPad *pad, GstBuffer *buffer, Call *call){
+	if(call->held || call->ringing)
+		return FALSE;
+	if(call->answer_time){
+		g_print("Call %d: 200 OK->first sample %.2f ms\n", call->id, (g_get_monotonic_time() - call->answer_time) / 1000.0);
+		call->answer_time = 0;
+	}
+	return TRUE;
+}
+
+/* 200 OK to the first packet sent for calls whose gate just opened */
+static gboolean packet_probe(GstPad *pad, GstBuffer *buffer, CustomData *data){
+	gint64 now;
+	GSList *l;
+	PacketWait *wait;
+
+	g_mutex_lock(&data->packet_lock);
+	if(data->packet_waits){
+		now = g_get_monotonic_time();
+		for(l = data->packet_waits; l; l = l->next){
+			wait = l->data;
+			g_print("Call %d: 200 OK->first packet %.2f ms\n", wait->id, (now - wait->answer_time) / 1000.0);
+			g_free(wait);
+		}
+		g_slist_free(data->packet_waits);
+		data->packet_waits = NULL;
+	}
+	g_mutex_unlock(&data->packet_lock);
+	return TRUE;
+}
+
+/* An error in a call's branch hangs that call up, the mixer keeps running
+	for the others */
+static gboolean mixer_bus_cb(GstBus *bus, GstMessage *msg, GstElement *pipeline){
+	GError *err;
+	gchar *debug;
+	GList *l;
+	Call *call;
+
+	if(GST_MESSAGE_TYPE(msg) != GST_MESSAGE_ERROR)
+		return media_latency_cb(bus, msg, pipeline);
+
+	gst_message_parse_error(msg, &err, &debug);
+	for(l = calls; l; l = l->next){
+		call = l->data;
+		if(call->media && gst_object_has_ancestor(GST_MESSAGE_SRC(msg), GST_OBJECT(call->media->bin))){
+			g_printerr("Call %d: %s, hanging up\n", call->id, err->message);
+			g_idle_add(hangup_later, GINT_TO_POINTER(call->id));
+			break;
+		}
+	}
+	if(!l)
+		g_printerr("Mixer error from %s: %s\n", GST_OBJECT_NAME(GST_MESSAGE_SRC(msg)), err->message);
+	g_error_free(err);
+	g_free(debug);
+	return TRUE;
+}
+
+/* Build the mixer once at startup, READY opens the sound card so a call only has to start it */
+static gboolean make_mixer(void){
+   GstBus *bus;
+
+   mix.rpipeline = gst_pipeline_new("ReceiverPipeline");
+   mix.adder = gst_element_factory_make("liveadder","mixer");
+   mix.convert = gst_element_factory_make("audioconvert","mconvert");
+   mix.rsink = gst_element_factory_make("alsasink","rsink");
+
+   if(!mix.rpipeline || !mix.adder || !mix.convert || !mix.rsink){
       g_printerr("Could not create all receiver elements.\n");
       return FALSE;
    }
 
-   gst_bin_add_many(GST_BIN(rec.rpipeline), rec.rsource, rec.rjitterbuffer, rec.rdepay, rec.rdecoder, rec.rsink, NULL);
+   gst_bin_add_many(GST_BIN(mix.rpipeline), mix.adder, mix.convert, mix.rsink, NULL);
+
+   if(!gst_element_link_many(mix.adder, mix.convert, mix.rsink, NULL)){
+      g_printerr("Could not link receiver elements.\n");
+      return FALSE;
+   }
 
-   gst_element_link_many(rec.rsource, rec.rjitterbuffer, rec.rdepay, rec.rdecoder, rec.rsink,NULL);
+	bus = gst_pipeline_get_bus(GST_PIPELINE(mix.rpipeline));
+	gst_bus_add_watch(bus, (GstBusFunc)mixer_bus_cb, mix.rpipeline);
+	gst_object_unref(bus);
 
-   rec.caps = gst_caps_new_simple(MIME,
-      "media", G_TYPE_STRING, MEDIA,
-      "clock-rate", G_TYPE_INT, CLOCK_RATE,
-      "encoding-name", G_TYPE_STRING, ENCODING,
-   NULL);  
-   g_object_set(rec.rsource, "caps", rec.caps, "port", (gint)RTP_PORT, NULL);
-	gst_element_set_state(rec.rpipeline, GST_STATE_PLAYING);
-   gst_bin_add(GST_BIN(data.bin), rec.rpipeline);
+	gst_element_set_state(mix.rpipeline, GST_STATE_READY);
+	return TRUE;
+}
 
-	/* Setup sender side */
-	g_signal_emit_by_name(data.sink, "add", target, t_port, NULL);
-   return TRUE;
+/* Take a call's branch that never joined the mixer out again */
+static void drop_receiver(Call *call){
+	gst_element_set_state(call->media->bin, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(mix.rpipeline), call->media->bin);
+	media_receiver_free(call->media);
+	call->media = NULL;
 }
 
-static gboolean stop_rtp(void){
-	/* Teardown the receiver pipeline for the RTP stream */
-   GstElement *deletebin;
-   deletebin = gst_bin_get_by_name(GST_BIN(data.bin), "ReceiverPipeline");
-   gst_element_set_state(deletebin, GST_STATE_NULL);
-   gst_bin_remove(GST_BIN(data.bin), deletebin);
-   gst_object_unref(deletebin);
+/* Listen on the call's port in a new branch of the mixer and send to its peer */
+static gboolean start_rtp(Call *call){
+	GstPad *pad;
+
+	if(call->running)
+		return FALSE;
+
+	call->media = media_receiver_new(call->port);
+	if(!call->media)
+		return FALSE;
+	if(call->negotiated)
+		media_receiver_set_payload(call->media, call->opus.recv_pt);
+
+	/* udpsrc binds on the way to PAUSED and fails when someone else got the
+		port. The branch is locked so the mixer's state changes leave it alone
+		until it is known to work */
+	gst_bin_add(GST_BIN(mix.rpipeline), call->media->bin);
+	gst_element_set_locked_state(call->media->bin, TRUE);
+	if(gst_element_set_state(call->media->bin, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE){
+		g_printerr("Call %d: could not bind RTP port %d\n", call->id, call->port);
+		drop_receiver(call);
+		return FALSE;
+	}
+
+	call->mixpad = gst_element_get_request_pad(mix.adder, "sink%d");
+	pad = gst_element_get_static_pad(call->media->bin, "src");
+	if(gst_pad_link(pad, call->mixpad) != GST_PAD_LINK_OK){
+		g_printerr("Could not link call %d to the mixer.\n", call->id);
+		gst_object_unref(pad);
+		gst_element_release_request_pad(mix.adder, call->mixpad);
+		gst_object_unref(call->mixpad);
+		call->mixpad = NULL;
+		drop_receiver(call);
+		return FALSE;
+	}
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(mix_probe), call);
+	gst_object_unref(pad);
+	gst_element_set_locked_state(call->media->bin, FALSE);
+
+	/* The first call starts the sound card, later ones join the running mixer */
+	if(mix.running++ == 0)
+		gst_element_set_state(mix.rpipeline, GST_STATE_PLAYING);
+	else
+		gst_element_sync_state_with_parent(call->media->bin);
+	call->running = TRUE;
+
+	/* Setup sender side, the destination is only added by connect_call */
+	if(call->connected && call->target && !call->held)
+		media_sender_add_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
+	return TRUE;
+}
+
+/* The 200 OK opens the gate: the call is mixed in and sent to. Media prepared
+	on the 18x only needs the destination added, a call without SDP before the
+	200 gets its media built here */
+static void connect_call(Call *call){
+	PacketWait *wait;
+
+	if(call->connected)
+		return;
+	call->connected = TRUE;
+	call->answer_time = g_get_monotonic_time();
+
+	if(!call->running){
+		if(!start_rtp(call)){
+			g_idle_add(hangup_later, GINT_TO_POINTER(call->id));
+			return;
+		}
+	}
+	else if(call->target && !call->held){
+		media_sender_add_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
+	}
+
+	if(call->running && call->target && !call->held){
+		wait = g_new(PacketWait, 1);
+		wait->id = call->id;
+		wait->answer_time = call->answer_time;
+		g_mutex_lock(&data.packet_lock);
+		data.packet_waits = g_slist_prepend(data.packet_waits, wait);
+		g_mutex_unlock(&data.packet_lock);
+	}
+}
+
+static gboolean stop_rtp(Call *call){
+	GstPad *pad;
+
+	if(!call->running)
+		return FALSE;
+
+	gst_element_set_state(call->media->bin, GST_STATE_NULL);
+	pad = gst_element_get_static_pad(call->media->bin, "src");
+	gst_pad_unlink(pad, call->mixpad);
+	gst_object_unref(pad);
+	gst_element_release_request_pad(mix.adder, call->mixpad);
+	gst_object_unref(call->mixpad);
+	call->mixpad = NULL;
+	gst_bin_remove(GST_BIN(mix.rpipeline), call->media->bin);
+	media_receiver_free(call->media);
+	call->media = NULL;
+	call->running = FALSE;
+
+	/* Back to READY with the last call, the sound card stays open */
+	if(--mix.running == 0)
+		gst_element_set_state(mix.rpipeline, GST_STATE_READY);
 	
 	/* Disable sending RTP */
-	g_signal_emit_by_name(data.sink, "remove", target, t_port, NULL);
+	if(call->connected && call->target && !call->held)
+		media_sender_remove_pt(data.sender, call->target, call->t_port, call->opus.send_pt);
    return TRUE;
 }
 
-static gboolean start_ringtone(void){
-	GstBus *bus;
-	rt.filesrc = gst_element_factory_make("filesrc","fs");
-	rt.demux = gst_element_factory_make("oggdemux","dmux");
-	rt.decode = gst_element_factory_make("vorbisdec","dec");
-	rt.convert = gst_element_factory_make("audioconvert","ac");
-	rt.resample = gst_element_factory_make("audioresample","ar");
-	rt.sink = gst_element_factory_make("autoaudiosink","aas");
-
-	rt.pipeline = gst_pipeline_new("RingTone");
-
-	if(!rt.pipeline || !rt.filesrc || !rt.demux || !rt.decode || !rt.convert || !rt.resample || !rt.sink){
-      g_printerr("Could not create all ringtone elements.\n");
-      return -1;
-   }
+/* Process CPU time in microseconds */
+static gint64 cpu_time(void){
+	struct rusage ru;
 
-   gst_bin_add_many(GST_BIN(rt.pipeline), rt.filesrc, rt.demux, rt.decode, rt.convert, rt.resample, rt.sink, NULL);
+	getrusage(RUSAGE_SELF, &ru);
+	return (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
 
-   if(!gst_element_link(rt.filesrc, rt.demux) || !gst_element_link_many(rt.decode, rt.convert, rt.resample, rt.sink, NULL)){
-      g_printerr("Could not link ringtone elements.\n");
-   }
+/* Packets sent and suppressed per second and CPU usage since the last 'I' */
+static void print_stats(CustomData *data){
+	gint64 wall, cpu;
+	gint packets, dropped;
+	gdouble secs;
+
+	cpu = cpu_time();
+	wall = g_get_monotonic_time();
+	packets = g_atomic_int_get(&data->sender->packets);
+	dropped = g_atomic_int_get(&data->sender->dropped);
+
+	if(data->last_wall && wall > data->last_wall){
+		secs = (gdouble)(wall - data->last_wall) / G_USEC_PER_SEC;
+		g_print("Sending %.0f packets/s, %.0f packets/s suppressed, CPU %.1f%%, VAD %s\n",
+			(guint)(packets - data->last_packets) / secs,
+			(guint)(dropped - data->last_dropped) / secs,
+			100.0 * (cpu - data->last_cpu) / (wall - data->last_wall),
+			data->sender->vad ? "on" : "off");
+	}
+	else{
+		g_print("Statistics started, press 'I' again for rates\n");
+	}
+	data->last_wall = wall;
+	data->last_cpu = cpu;
+	data->last_packets = packets;
+	data->last_dropped = dropped;
+}
 
-	g_signal_connect(rt.demux, "pad-added", G_CALLBACK(on_pad_added), rt.decode);
+static void ring_decode_buffer(GstElement *sink, GByteArray *bytes){
+	GstBuffer *buffer = gst_app_sink_pull_buffer(GST_APP_SINK(sink));
 
-	g_object_set(rt.filesrc, "location", "ringtone.ogg", NULL);
+	if(buffer){
+		g_byte_array_append(bytes, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer));
+		gst_buffer_unref(buffer);
+	}
+}
 
-	bus = gst_pipeline_get_bus(GST_PIPELINE(rt.pipeline));
-	rt.bus_watch_id = gst_bus_add_watch(bus, repeat_sound, rt.pipeline);
+/* Decode a file to PCM in the format of the mixer, which the sound card already
+	plays. Buffers are collected as they arrive and the bus is waited on with a
+	timeout, an error without EOS would leave a blocking pull waiting forever */
+static GstBuffer *decode_ringtone(const gchar *location){
+	GstElement *pipeline, *sink;
+	GstBuffer *pcm = NULL;
+	GstMessage *msg;
+	GstBus *bus;
+	GstCaps *caps;
+	GByteArray *bytes;
+	gint64 start = g_get_monotonic_time();
+	gchar *desc;
+
+	desc = g_strdup_printf("filesrc location=\"%s\" ! oggdemux ! vorbisdec ! audioconvert ! audioresample ! "
+		"appsink name=sink sync=false", location);
+	pipeline = gst_parse_launch(desc, NULL);
+	g_free(desc);
+	if(!pipeline)
+		return NULL;
+	sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+	caps = media_raw_caps();
+	gst_app_sink_set_caps(GST_APP_SINK(sink), caps);
+	gst_caps_unref(caps);
+	bytes = g_byte_array_new();
+	g_object_set(sink, "emit-signals", TRUE, NULL);
+	g_signal_connect(sink, "new-buffer", G_CALLBACK(ring_decode_buffer), bytes);
+
+	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	bus = gst_element_get_bus(pipeline);
+	msg = gst_bus_timed_pop_filtered(bus, RING_DECODE_TIMEOUT, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+
+	if(!msg){
+		g_printerr("Ringtone: decoding timed out\n");
+		g_byte_array_free(bytes, TRUE);
+	}
+	else if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS && bytes->len > 0){
+		pcm = gst_buffer_new();
+		GST_BUFFER_SIZE(pcm) = bytes->len;
+		GST_BUFFER_DATA(pcm) = GST_BUFFER_MALLOCDATA(pcm) = g_byte_array_free(bytes, FALSE);
+		g_print("Ringtone: %.1f s decoded in %.0f ms\n",
+			(gdouble)GST_BUFFER_SIZE(pcm) / (MIX_RATE * MIX_CHANNELS * 2),
+			(g_get_monotonic_time() - start) / 1000.0);
+	}
+	else{
+		g_byte_array_free(bytes, TRUE);
+	}
 
-	gst_element_set_state (rt.pipeline, GST_STATE_PLAYING);
+	if(msg)
+		gst_message_unref(msg);
 	gst_object_unref(bus);
+	gst_object_unref(sink);
+	gst_object_unref(pipeline);
+	return pcm;
+}
+
+/* Next chunk of the ringtone, wrapping around to the start. Chunks are
+	sub-buffers of the PCM and timestamped from the samples pushed so far,
+	so the loop has no gap */
+static void ring_need_data(GstElement *appsrc, guint length, gpointer unused){
+	guint chunk = MIX_RATE * MIX_CHANNELS * 2 * RING_CHUNK_MS / 1000;
+	guint size = MIN(chunk, GST_BUFFER_SIZE(rt.pcm) - rt.offset);
+	GstBuffer *buffer = gst_buffer_create_sub(rt.pcm, rt.offset, size);
+	GstClockTime ts = gst_util_uint64_scale(rt.samples, GST_SECOND, MIX_RATE);
+
+	rt.samples += size / (MIX_CHANNELS * 2);
+	GST_BUFFER_TIMESTAMP(buffer) = rt.base + ts;
+	GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(rt.samples, GST_SECOND, MIX_RATE) - ts;
+	rt.offset = (rt.offset + size) % GST_BUFFER_SIZE(rt.pcm);
+	gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+}
+
+/* INVITE to ring: until the first chunk is mixed, plus one segment of the
+	sound card's ring buffer */
+static gboolean ring_probe(GstPad *pad, GstBuffer *buffer, gpointer unused){
+	gint64 latency_time;
+
+	if(rt.invite_time){
+		g_object_get(mix.rsink, "latency-time", &latency_time, NULL);
+		g_print("Call %d: INVITE->ring %.2f ms\n", rt.call_id,
+			(g_get_monotonic_time() - rt.invite_time + latency_time) / 1000.0);
+		rt.invite_time = 0;
+	}
+	return TRUE;
+}
+
+/* Decode the ringtone and add the branch that plays it to the mixer, the mixer
+	has to exist */
+static gboolean make_ringtone(void){
+	GstElement *convert;
+	GstCaps *caps;
+	GstPad *pad;
+
+	rt.pcm = decode_ringtone(RINGTONE_FILE);
+	if(!rt.pcm){
+		g_printerr("Could not decode %s, no ringtone.\n", RINGTONE_FILE);
+		return FALSE;
+	}
+
+	rt.bin = gst_bin_new("RingBin");
+	rt.appsrc = gst_element_factory_make("appsrc", "ringsrc");
+	convert = gst_element_factory_make("audioconvert", "ringconvert");
 
+	if(!rt.bin || !rt.appsrc || !convert){
+		g_printerr("Could not create all ringtone elements.\n");
+		return FALSE;
+	}
+
+	gst_bin_add_many(GST_BIN(rt.bin), rt.appsrc, convert, NULL);
+	if(!gst_element_link(rt.appsrc, convert)){
+		g_printerr("Could not link ringtone elements.\n");
+		return FALSE;
+	}
+
+	caps = media_raw_caps();
+	g_object_set(rt.appsrc, "caps", caps, "format", GST_FORMAT_TIME, "is-live", TRUE, NULL);
+	gst_caps_unref(caps);
+	g_signal_connect(rt.appsrc, "need-data", G_CALLBACK(ring_need_data), NULL);
+
+	pad = gst_element_get_static_pad(convert, "src");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(ring_probe), NULL);
+	gst_element_add_pad(rt.bin, gst_ghost_pad_new("src", pad));
+	gst_object_unref(pad);
+
+	/* Started and stopped on its own, whatever state the calls keep the mixer in */
+	gst_element_set_locked_state(rt.bin, TRUE);
+	gst_bin_add(GST_BIN(mix.rpipeline), rt.bin);
+	gst_element_set_state(rt.bin, GST_STATE_READY);
 	return TRUE;
 }
 
-static void on_pad_added(GstElement *element, GstPad *pad, gpointer data){
-	GstPad *sinkpad;
-	GstElement *decoder = (GstElement *) data;
-	sinkpad = gst_element_get_static_pad(decoder, "sink");
-	gst_pad_link(pad, sinkpad);
-	gst_object_unref(sinkpad);
+static void free_ringtone(void){
+	if(rt.bin){
+		stop_ringtone();
+		gst_element_set_state(rt.bin, GST_STATE_NULL);
+		gst_bin_remove(GST_BIN(mix.rpipeline), rt.bin);
+		rt.bin = NULL;
+	}
+	if(rt.pcm){
+		gst_buffer_unref(rt.pcm);
+		rt.pcm = NULL;
+	}
 }
 
-/* Looping playback in Gstreamer inspired from:
-	http://stackoverflow.com/questions/6833147/looping-a-video-with-gstreamer-and-gst-launch
-*/
+/* Link the ring into the mixer, timestamped from the mixer's running time. The
+	first call or ring starts the sound card, which is open since startup */
+static gboolean start_ringtone(Call *call){
+	GstClock *clock;
+	GstPad *pad;
+
+	if(!rt.bin)
+		return FALSE;
+	rt.call_id = call->id;
+	rt.invite_time = call->ring_time;
+
+	rt.mixpad = gst_element_get_request_pad(mix.adder, "sink%d");
+	pad = gst_element_get_static_pad(rt.bin, "src");
+	if(gst_pad_link(pad, rt.mixpad) != GST_PAD_LINK_OK){
+		g_printerr("Could not link the ringtone to the mixer.\n");
+	}
+	gst_object_unref(pad);
 
-static gboolean repeat_sound(GstBus *bus, GstMessage *msg, gpointer data){
-	GstElement *pipe = GST_ELEMENT(data);
-	switch(GST_MESSAGE_TYPE(msg)){
-		case GST_MESSAGE_EOS:
-			gst_element_seek(pipe, 1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
-			break;
-		default:
-			break;
+	rt.base = 0;
+	if(mix.running++ == 0){
+		gst_element_set_state(mix.rpipeline, GST_STATE_PLAYING);
 	}
+	else if((clock = gst_element_get_clock(mix.rpipeline))){
+		rt.base = gst_clock_get_time(clock) - gst_element_get_base_time(mix.rpipeline);
+		gst_object_unref(clock);
+	}
+	gst_element_set_state(rt.bin, GST_STATE_PLAYING);
+	rt.playing = TRUE;
 	return TRUE;
 }
 
+/* Unlink the ring and go back to the start of it for the next call */
 static gboolean stop_ringtone(void){
-	if(rt.bus_watch_id){
-		gst_element_set_state(rt.pipeline, GST_STATE_NULL);
-		g_source_remove(rt.bus_watch_id);
-		rt.bus_watch_id = 0;
-		gst_object_unref(rt.pipeline);
-	}
+	GstPad *pad;
+
+	if(!rt.playing)
+		return TRUE;
+	gst_element_set_state(rt.bin, GST_STATE_READY);
+	pad = gst_element_get_static_pad(rt.bin, "src");
+	gst_pad_unlink(pad, rt.mixpad);
+	gst_object_unref(pad);
+	gst_element_release_request_pad(mix.adder, rt.mixpad);
+	gst_object_unref(rt.mixpad);
+	rt.mixpad = NULL;
+
+	rt.offset = 0;
+	rt.samples = 0;
+	rt.invite_time = 0;
+	rt.playing = FALSE;
+
+	if(--mix.running == 0)
+		gst_element_set_state(mix.rpipeline, GST_STATE_READY);
 	return TRUE;
 }
 
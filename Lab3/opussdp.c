@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include "opussdp.h"
+
+/* Integer media attribute such as ptime, -1 when absent */
+gint sdp_attr_int(const pjmedia_sdp_media *m, const gchar *name){
+	const pjmedia_sdp_attr *attr = pjmedia_sdp_media_find_attr2(m, name, NULL);
+
+	return attr ? (gint)pj_strtoul(&attr->value) : -1;
+}
+
+/* Integer parameter of the fmtp line of a format, "useinbandfec=1; maxaveragebitrate=20000",
+	-1 when absent */
+gint sdp_fmtp_param(const pjmedia_sdp_media *m, const pj_str_t *fmt, const gchar *name){
+	const pjmedia_sdp_attr *attr = pjmedia_sdp_media_find_attr2(m, "fmtp", fmt);
+	pjmedia_sdp_fmtp fmtp;
+	gchar *params, **pairs, **pair;
+	gsize len = strlen(name);
+	gint value = -1;
+
+	if(!attr || pjmedia_sdp_attr_get_fmtp(attr, &fmtp) != PJ_SUCCESS)
+		return -1;
+	params = g_strndup(fmtp.fmt_param.ptr, fmtp.fmt_param.slen);
+	pairs = g_strsplit(params, ";", -1);
+	for(pair = pairs; *pair; pair++){
+		g_strstrip(*pair);
+		if(g_ascii_strncasecmp(*pair, name, len) == 0 && (*pair)[len] == '=')
+			value = atoi(*pair + len + 1);
+	}
+	g_strfreev(pairs);
+	g_free(params);
+	return value;
+}
+
+/* Payload type of the first Opus format of an m-line, -1 when there is none */
+gint sdp_find_opus(const pjmedia_sdp_media *m, const pj_str_t **fmt){
+	const pjmedia_sdp_attr *attr;
+	pjmedia_sdp_rtpmap rtpmap;
+	unsigned i;
+
+	for(i = 0; i < m->desc.fmt_count; i++){
+		attr = pjmedia_sdp_media_find_attr2(m, "rtpmap", &m->desc.fmt[i]);
+		if(!attr || pjmedia_sdp_attr_get_rtpmap(attr, &rtpmap) != PJ_SUCCESS || rtpmap.clock_rate != CLOCK_RATE)
+			continue;
+		if(pj_stricmp2(&rtpmap.enc_name, SDP_ENCODING) == 0 || pj_stricmp2(&rtpmap.enc_name, ENCODING) == 0){
+			*fmt = &m->desc.fmt[i];
+			return (gint)pj_strtoul(&m->desc.fmt[i]);
+		}
+	}
+	return -1;
+}
+
+/* Longest Opus frame that fits in ptime ms */
+gint opus_frame_size(gint ptime){
+	static const gint sizes[] = { 60, 40, 20, 10 };
+	guint i;
+
+	for(i = 0; i < G_N_ELEMENTS(sizes); i++){
+		if(sizes[i] <= ptime)
+			return sizes[i];
+	}
+	return 10;
+}
+
+/* The remote description says how the peer wants to receive: ptime, maxptime,
+	maxaveragebitrate, whether it reads FEC and prefers DTX */
+gboolean opus_negotiate(const pjmedia_sdp_media *local, const pjmedia_sdp_media *remote,
+	const EncoderProfile *profile, OpusParams *params){
+	const pj_str_t *lfmt, *rfmt;
+	gint ptime, maxptime, bitrate;
+
+	params->recv_pt = sdp_find_opus(local, &lfmt);
+	params->send_pt = sdp_find_opus(remote, &rfmt);
+	if(params->recv_pt < 0 || params->send_pt < 0)
+		return FALSE;
+
+	params->profile = *profile;
+	ptime = sdp_attr_int(remote, "ptime");
+	maxptime = sdp_attr_int(remote, "maxptime");
+	if(ptime <= 0)
+		ptime = profile->frame_size;
+	if(maxptime > 0)
+		ptime = MIN(ptime, maxptime);
+	params->profile.frame_size = opus_frame_size(ptime);
+
+	bitrate = sdp_fmtp_param(remote, rfmt, "maxaveragebitrate");
+	if(bitrate > 0)
+		params->profile.bitrate = MIN(params->profile.bitrate, bitrate);
+
+	/* FEC only pays off when the peer's decoder reads it */
+	if(sdp_fmtp_param(remote, rfmt, "useinbandfec") != 1){
+		params->profile.inband_fec = FALSE;
+		params->profile.packet_loss = 0;
+	}
+	params->dtx = sdp_fmtp_param(remote, rfmt, "usedtx") == 1;
+	return TRUE;
+}
@@ -0,0 +1,28 @@
+/* Opus offer/answer for the IP phone: reads the payload types and the Opus
+	parameters (RFC 7587) of the active local and remote SDP m-lines. */
+#ifndef OPUSSDP_H
+#define OPUSSDP_H
+
+#include <pjmedia.h>
+#include <glib.h>
+#include "../common/mediaformat.h"
+
+/* What was agreed for one call: the payload type each side receives with and
+	the encoder settings the peer asked for, bounded by the local profile */
+typedef struct _OpusParams {
+	gint send_pt;
+	gint recv_pt;
+	EncoderProfile profile;
+	gboolean dtx;
+} OpusParams;
+
+gint sdp_attr_int(const pjmedia_sdp_media *m, const gchar *name);
+gint sdp_fmtp_param(const pjmedia_sdp_media *m, const pj_str_t *fmt, const gchar *name);
+gint sdp_find_opus(const pjmedia_sdp_media *m, const pj_str_t **fmt);
+gint opus_frame_size(gint ptime);
+
+/* FALSE when either side has no Opus format */
+gboolean opus_negotiate(const pjmedia_sdp_media *local, const pjmedia_sdp_media *remote,
+	const EncoderProfile *profile, OpusParams *params);
+
+#endif
@@ -0,0 +1,168 @@
+/* Offer/answer tests of opussdp.c against canned SDP, no network or audio needed */
+#include <pjlib.h>
+#include <pjlib-util.h>
+#include <pjmedia.h>
+#include <string.h>
+#include <glib.h>
+#include "opussdp.h"
+
+static pj_caching_pool cp;
+static pj_pool_t *pool;
+
+/* What the phone offers with the lowlatency-voice profile */
+#define LOCAL_SDP \
+	"v=0\r\n" \
+	"o=lab3 1 1 IN IP4 127.0.0.1\r\n" \
+	"s=lab3\r\n" \
+	"c=IN IP4 127.0.0.1\r\n" \
+	"t=0 0\r\n" \
+	"m=audio 5010 RTP/AVP 96 97\r\n" \
+	"a=rtpmap:96 opus/48000/2\r\n" \
+	"a=fmtp:96 useinbandfec=1; usedtx=0; maxaveragebitrate=32000\r\n" \
+	"a=rtpmap:97 X-GST-OPUS-DRAFT-SPITTKA-00/48000\r\n" \
+	"a=ptime:10\r\n" \
+	"a=maxptime:60\r\n"
+
+#define REMOTE_HEAD \
+	"v=0\r\n" \
+	"o=peer 1 1 IN IP4 127.0.0.2\r\n" \
+	"s=peer\r\n" \
+	"c=IN IP4 127.0.0.2\r\n" \
+	"t=0 0\r\n"
+
+static const pjmedia_sdp_media *parse_media(const gchar *text){
+	pjmedia_sdp_session *sdp = NULL;
+	gchar *buf = pj_pool_alloc(pool, strlen(text) + 1);
+
+	strcpy(buf, text);
+	g_assert_cmpint(pjmedia_sdp_parse(pool, buf, strlen(buf), &sdp), ==, PJ_SUCCESS);
+	g_assert_cmpuint(sdp->media_count, ==, 1);
+	return sdp->media[0];
+}
+
+static gboolean negotiate(const gchar *remote, OpusParams *params){
+	return opus_negotiate(parse_media(LOCAL_SDP), parse_media(remote), &media_profiles[0], params);
+}
+
+static void test_no_opus(void){
+	OpusParams params;
+
+	g_assert(!negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 0 8\r\n"
+		"a=rtpmap:0 PCMU/8000\r\n"
+		"a=rtpmap:8 PCMA/8000\r\n", &params));
+
+	/* Right name, wrong clock rate */
+	g_assert(!negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/16000/2\r\n", &params));
+}
+
+static void test_legacy_name(void){
+	OpusParams params;
+
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 97\r\n"
+		"a=rtpmap:97 X-GST-OPUS-DRAFT-SPITTKA-00/48000\r\n", &params));
+	g_assert_cmpint(params.send_pt, ==, 97);
+	g_assert_cmpint(params.recv_pt, ==, 96);
+
+	/* No fmtp, nothing asked for: the profile minus FEC */
+	g_assert_cmpint(params.profile.frame_size, ==, media_profiles[0].frame_size);
+	g_assert_cmpint(params.profile.bitrate, ==, media_profiles[0].bitrate);
+	g_assert(!params.profile.inband_fec);
+	g_assert(!params.dtx);
+}
+
+static void test_ptime(void){
+	OpusParams params;
+
+	/* Snapped down to an Opus frame size */
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=ptime:50\r\n", &params));
+	g_assert_cmpint(params.send_pt, ==, 111);
+	g_assert_cmpint(params.profile.frame_size, ==, 40);
+
+	/* maxptime caps ptime */
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=ptime:60\r\n"
+		"a=maxptime:20\r\n", &params));
+	g_assert_cmpint(params.profile.frame_size, ==, 20);
+
+	/* Without ptime the profile's frame size, still under maxptime */
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=maxptime:40\r\n", &params));
+	g_assert_cmpint(params.profile.frame_size, ==, media_profiles[0].frame_size);
+
+	/* Below the shortest frame */
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=ptime:5\r\n", &params));
+	g_assert_cmpint(params.profile.frame_size, ==, 10);
+}
+
+static void test_bitrate(void){
+	OpusParams params;
+
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=fmtp:111 maxaveragebitrate=12000\r\n", &params));
+	g_assert_cmpint(params.profile.bitrate, ==, 12000);
+
+	/* A higher limit leaves the profile alone */
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=fmtp:111 maxaveragebitrate=510000\r\n", &params));
+	g_assert_cmpint(params.profile.bitrate, ==, media_profiles[0].bitrate);
+}
+
+static void test_fec_dtx(void){
+	OpusParams params;
+
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=fmtp:111 useinbandfec=0; usedtx=0\r\n", &params));
+	g_assert(!params.profile.inband_fec);
+	g_assert_cmpint(params.profile.packet_loss, ==, 0);
+	g_assert(!params.dtx);
+
+	g_assert(negotiate(REMOTE_HEAD
+		"m=audio 6000 RTP/AVP 111\r\n"
+		"a=rtpmap:111 opus/48000/2\r\n"
+		"a=fmtp:111 useinbandfec=1;usedtx=1\r\n", &params));
+	g_assert(params.profile.inband_fec == media_profiles[0].inband_fec);
+	g_assert_cmpint(params.profile.packet_loss, ==, media_profiles[0].packet_loss);
+	g_assert(params.dtx);
+}
+
+int main(int argc, char *argv[]){
+	gint result;
+
+	g_test_init(&argc, &argv, NULL);
+	pj_log_set_level(0);
+	g_assert_cmpint(pj_init(), ==, PJ_SUCCESS);
+	g_assert_cmpint(pjlib_util_init(), ==, PJ_SUCCESS);
+	pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, 0);
+	pool = pj_pool_create(&cp.factory, "opussdp_test", 4000, 4000, NULL);
+
+	g_test_add_func("/opussdp/no-opus", test_no_opus);
+	g_test_add_func("/opussdp/legacy-name", test_legacy_name);
+	g_test_add_func("/opussdp/ptime", test_ptime);
+	g_test_add_func("/opussdp/bitrate", test_bitrate);
+	g_test_add_func("/opussdp/fec-dtx", test_fec_dtx);
+	result = g_test_run();
+
+	pj_pool_release(pool);
+	pj_caching_pool_destroy(&cp);
+	return result;
+}
@@ -0,0 +1,383 @@
+/* SIP call setup load generator for the IP phone. Places INVITE, ACK, BYE
+	cycles at a fixed rate against a phone that answers by itself, for example
+	"./ipphone --auto-answer", and reports the setup rate, 180 and 200 response
+	latency percentiles and failures. Signaling only, the RTP port offered in
+	SDP is never read. */
+#include <pjsip.h>
+#include <pjsip_ua.h>
+#include <pjlib-util.h>
+#include <pjmedia.h>
+#include <string.h>
+#include <glib.h>
+#include "../common/mediaformat.h"
+
+#define LOCAL_PORT 5070
+#define RTP_PORT 4000
+#define USER "sipload"
+
+#define AF pj_AF_INET()
+
+/* Poll interval of the SIP socket while waiting for the next call to place */
+#define POLL_MS 10
+
+/* One call cycle and its response times, in us since the INVITE was sent */
+typedef struct _LoadCall {
+	pjsip_inv_session *inv;
+	gint64 invite_time;
+	gint64 ringing;
+	gint64 answered;
+	gboolean timed_out;
+	pj_timer_entry timer;
+} LoadCall;
+
+/* Settings of the run and what was measured */
+typedef struct _Run {
+	gchar *uri;
+	gdouble rate;
+	gint total;
+	gint max_active;
+	gint hold;
+	gint timeout;
+	gint rtp_port;
+
+	gint placed;
+	gint active;
+	gint done;
+	gint answered;
+	gint failed;
+	gint timeouts;
+	gint64 start;
+	gint64 last_answer;
+	GArray *ring_times;
+	GArray *answer_times;
+	GHashTable *causes;
+} Run;
+
+static Run run;
+
+static pjsip_endpoint *g_endpt;
+static pj_caching_pool cp;
+static pjsip_transport *g_tp;
+static gint local_port = LOCAL_PORT;
+
+static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e);
+static void call_on_forked(pjsip_inv_session *inv, pjsip_event *e);
+static void call_on_tsx_state_changed(pjsip_inv_session *inv, pjsip_transaction *tsx, pjsip_event *e);
+
+/* Only there for its slot in inv->mod_data, requests outside a dialog are left to pjsip */
+static pjsip_module load_agent = {
+	NULL, NULL,
+	{"sipload", 7},
+	-1,
+	PJSIP_MOD_PRIORITY_APPLICATION,
+	NULL, NULL, NULL, NULL,
+	NULL,
+	NULL, NULL, NULL, NULL,
+};
+
+/* The offer the phone answers, Opus on a port nobody listens to */
+static pj_status_t create_sdp(pj_pool_t *pool, pjmedia_sdp_session **p_sdp){
+	pj_time_val tv;
+	pjmedia_sdp_session *sdp;
+	pjmedia_sdp_media *m;
+	pjmedia_sdp_rtpmap rtpmap;
+	pjmedia_sdp_attr *attr;
+
+	sdp = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_session));
+	pj_gettimeofday(&tv);
+	sdp->origin.user = pj_str(USER);
+	sdp->origin.version = sdp->origin.id = tv.sec + 2208988800UL;
+	sdp->origin.net_type = pj_str("IN");
+	sdp->origin.addr_type = pj_str("IP4");
+	sdp->origin.addr = pj_str("127.0.0.1");
+	sdp->name = pj_str(USER);
+
+	sdp->conn = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_conn));
+	sdp->conn->net_type = pj_str("IN");
+	sdp->conn->addr_type = pj_str("IP4");
+	sdp->conn->addr = sdp->origin.addr;
+
+	m = pj_pool_zalloc(pool, sizeof(pjmedia_sdp_media));
+	m->desc.media = pj_str(MEDIA);
+	m->desc.port = (pj_uint16_t)run.rtp_port;
+	m->desc.port_count = 1;
+	m->desc.transport = pj_str("RTP/AVP");
+	m->desc.fmt_count = 1;
+	m->desc.fmt[0] = pj_str("96");
+
+	rtpmap.pt = m->desc.fmt[0];
+	rtpmap.enc_name = pj_str(SDP_ENCODING);
+	rtpmap.clock_rate = CLOCK_RATE;
+	rtpmap.param = pj_str(SDP_CHANNELS);
+	pjmedia_sdp_rtpmap_to_attr(pool, &rtpmap, &attr);
+	m->attr[m->attr_count++] = attr;
+
+	sdp->media[0] = m;
+	sdp->media_count = 1;
+	*p_sdp = sdp;
+	return PJ_SUCCESS;
+}
+
+/* Hang up an answered call after the hold time, or give up on one that was
+	not answered in time */
+static void call_timer(pj_timer_heap_t *heap, pj_timer_entry *entry){
+	LoadCall *call = entry->user_data;
+	pjsip_tx_data *tdata = NULL;
+	PJ_UNUSED_ARG(heap);
+
+	entry->id = 0;
+	if(!call->answered)
+		call->timed_out = TRUE;
+	if(pjsip_inv_end_session(call->inv, call->answered ? 200 : 487, NULL, &tdata) == PJ_SUCCESS && tdata)
+		pjsip_inv_send_msg(call->inv, tdata);
+}
+
+static void schedule(LoadCall *call, gint ms){
+	pj_time_val delay;
+
+	if(call->timer.id)
+		pjsip_endpt_cancel_timer(g_endpt, &call->timer);
+	delay.sec = ms / 1000;
+	delay.msec = ms % 1000;
+	call->timer.id = 1;
+	pjsip_endpt_schedule_timer(g_endpt, &call->timer, &delay);
+}
+
+static gboolean place_call(void){
+	pj_str_t local_uri, dst_uri = pj_str(run.uri);
+	char temp[80];
+	pjsip_dialog *dlg;
+	pjmedia_sdp_session *sdp;
+	pjsip_tx_data *tdata;
+	LoadCall *call;
+
+	pj_ansi_sprintf(temp, "sip:" USER "@127.0.0.1:%d", local_port);
+	local_uri = pj_str(temp);
+	if(pjsip_dlg_create_uac(pjsip_ua_instance(), &local_uri, &local_uri, &dst_uri, &dst_uri, &dlg) != PJ_SUCCESS){
+		g_printerr("Unable to create UAC dialog for %s\n", run.uri);
+		return FALSE;
+	}
+
+	call = g_new0(LoadCall, 1);
+	create_sdp(dlg->pool, &sdp);
+	if(pjsip_inv_create_uac(dlg, sdp, 0, &call->inv) != PJ_SUCCESS || pjsip_inv_invite(call->inv, &tdata) != PJ_SUCCESS){
+		g_printerr("Unable to create INVITE\n");
+		pjsip_dlg_terminate(dlg);
+		g_free(call);
+		return FALSE;
+	}
+	call->inv->mod_data[load_agent.id] = call;
+	pj_timer_entry_init(&call->timer, 0, call, &call_timer);
+
+	run.placed++;
+	run.active++;
+	call->invite_time = g_get_monotonic_time();
+	pjsip_inv_send_msg(call->inv, tdata);
+	schedule(call, run.timeout * 1000);
+	return TRUE;
+}
+
+static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e){
+	LoadCall *call = inv->mod_data[load_agent.id];
+	gint64 now = g_get_monotonic_time();
+	gdouble ms;
+	gint count;
+	PJ_UNUSED_ARG(e);
+
+	if(!call)
+		return;
+
+	if((inv->state == PJSIP_INV_STATE_CONNECTING || inv->state == PJSIP_INV_STATE_CONFIRMED) && !call->answered){
+		/* pjsip sends the ACK on the 200 by itself */
+		call->answered = now - call->invite_time;
+		ms = call->answered / 1000.0;
+		g_array_append_val(run.answer_times, ms);
+		run.answered++;
+		run.last_answer = now;
+		schedule(call, run.hold);
+	}
+	else if(inv->state == PJSIP_INV_STATE_DISCONNECTED){
+		if(call->timer.id)
+			pjsip_endpt_cancel_timer(g_endpt, &call->timer);
+		if(!call->answered){
+			run.failed++;
+			if(call->timed_out){
+				run.timeouts++;
+			}
+			else{
+				count = GPOINTER_TO_INT(g_hash_table_lookup(run.causes, GINT_TO_POINTER(inv->cause)));
+				g_hash_table_insert(run.causes, GINT_TO_POINTER(inv->cause), GINT_TO_POINTER(count + 1));
+			}
+		}
+		inv->mod_data[load_agent.id] = NULL;
+		g_free(call);
+		run.active--;
+		run.done++;
+	}
+}
+
+/* The phone sends 183 with SDP before its 180, the session is EARLY from the
+	183 on so the 180 is picked from the INVITE transaction */
+static void call_on_tsx_state_changed(pjsip_inv_session *inv, pjsip_transaction *tsx, pjsip_event *e){
+	LoadCall *call = inv->mod_data[load_agent.id];
+	gdouble ms;
+
+	if(!call || call->ringing || tsx->role != PJSIP_ROLE_UAC || tsx->method.id != PJSIP_INVITE_METHOD)
+		return;
+	if(e->body.tsx_state.type != PJSIP_EVENT_RX_MSG ||
+		e->body.tsx_state.src.rdata->msg_info.msg->line.status.code != 180)
+		return;
+	call->ringing = g_get_monotonic_time() - call->invite_time;
+	ms = call->ringing / 1000.0;
+	g_array_append_val(run.ring_times, ms);
+}
+
+static void call_on_forked(pjsip_inv_session *inv, pjsip_event *e){
+	PJ_UNUSED_ARG(inv);
+	PJ_UNUSED_ARG(e);
+}
+
+static gint compare_double(gconstpointer a, gconstpointer b){
+	gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static gdouble percentile(GArray *times, guint p){
+	return g_array_index(times, gdouble, MIN(times->len * p / 100, times->len - 1));
+}
+
+static void print_times(const gchar *name, GArray *times){
+	if(times->len == 0){
+		g_print("%s: none\n", name);
+		return;
+	}
+	g_array_sort(times, compare_double);
+	g_print("%s: %u, min %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, times->len,
+		g_array_index(times, gdouble, 0), percentile(times, 50), percentile(times, 90),
+		percentile(times, 99), g_array_index(times, gdouble, times->len - 1));
+}
+
+static void print_results(void){
+	gdouble secs = (run.last_answer - run.start) / (gdouble)G_USEC_PER_SEC;
+	GHashTableIter iter;
+	gpointer cause, count;
+
+	g_print("Calls: %d placed, %d answered, %d failed, %.1f calls/s answered (%.1f offered)\n",
+		run.placed, run.answered, run.failed, run.answered && secs > 0 ? run.answered / secs : 0.0, run.rate);
+	print_times("180 Ringing", run.ring_times);
+	print_times("200 OK", run.answer_times);
+	if(run.timeouts)
+		g_print("Failed: %d not answered within %d ms\n", run.timeouts, run.timeout * 1000);
+	g_hash_table_iter_init(&iter, run.causes);
+	while(g_hash_table_iter_next(&iter, &cause, &count))
+		g_print("Failed: %d with status %d\n", GPOINTER_TO_INT(count), GPOINTER_TO_INT(cause));
+}
+
+/* Place calls on schedule and handle SIP in between until every cycle has ended */
+static void run_load(void){
+	pj_time_val timeout;
+	gint64 now, next;
+
+	run.start = g_get_monotonic_time();
+	while(run.done < run.total){
+		now = g_get_monotonic_time();
+		next = G_MAXINT64;
+		while(run.placed < run.total && (!run.max_active || run.active < run.max_active)){
+			next = run.start + (gint64)(run.placed * G_USEC_PER_SEC / run.rate);
+			if(next > now)
+				break;
+			if(!place_call()){
+				/* Count what could not be sent as failed right away */
+				run.placed++;
+				run.failed++;
+				run.done++;
+			}
+		}
+
+		timeout.sec = 0;
+		timeout.msec = POLL_MS;
+		if(next != G_MAXINT64 && next > now)
+			timeout.msec = MIN(POLL_MS, (next - now) / 1000);
+		pjsip_endpt_handle_events(g_endpt, &timeout);
+	}
+}
+
+int main(int argc, char *argv[]){
+	GOptionContext *context;
+	GError *err = NULL;
+	pj_status_t status;
+	pjsip_inv_callback inv_cb;
+	pj_sockaddr addr;
+
+	run.rate = 10;
+	run.total = 100;
+	run.hold = 1000;
+	run.timeout = 32;
+	run.rtp_port = RTP_PORT;
+
+	GOptionEntry entries[] = {
+		{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &run.rate, "New calls per second", "N" },
+		{ "calls", 'n', 0, G_OPTION_ARG_INT, &run.total, "Calls to place", "N" },
+		{ "max", 'm', 0, G_OPTION_ARG_INT, &run.max_active, "Concurrent calls at most, 0 for no limit", "N" },
+		{ "hold", 'd', 0, G_OPTION_ARG_INT, &run.hold, "Time from answer to BYE", "MS" },
+		{ "timeout", 't', 0, G_OPTION_ARG_INT, &run.timeout, "Give up on calls not answered in this time", "S" },
+		{ "port", 'p', 0, G_OPTION_ARG_INT, &local_port, "Local SIP port", "PORT" },
+		{ "rtp-port", 0, 0, G_OPTION_ARG_INT, &run.rtp_port, "RTP port offered in SDP", "PORT" },
+		{ NULL }
+	};
+
+	context = g_option_context_new("sip:USER@IP:PORT - SIP call setup load generator");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &err) || argc != 2 || run.rate <= 0 || run.total <= 0){
+		g_printerr("%s\n", err ? err->message : "Usage: sipload [OPTION...] sip:USER@IP:PORT");
+		return 1;
+	}
+	g_option_context_free(context);
+	run.uri = argv[1];
+	run.ring_times = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	run.answer_times = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	run.causes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	pj_log_set_level(0);
+	status = pj_init();
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	status = pjlib_util_init();
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, 0);
+
+	status = pjsip_endpt_create(&cp.factory, USER, &g_endpt);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+	pj_sockaddr_init(AF, &addr, NULL, (pj_uint16_t)local_port);
+	if(pjsip_udp_transport_start(g_endpt, &addr.ipv4, NULL, 1, &g_tp) != PJ_SUCCESS){
+		g_printerr("Unable to start UDP transport on port %d\n", local_port);
+		return 1;
+	}
+
+	status = pjsip_tsx_layer_init_module(g_endpt);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+	status = pjsip_ua_init_module(g_endpt, NULL);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+	pj_bzero(&inv_cb, sizeof(inv_cb));
+	inv_cb.on_state_changed = &call_on_state_changed;
+	inv_cb.on_new_session = &call_on_forked;
+	inv_cb.on_tsx_state_changed = &call_on_tsx_state_changed;
+	status = pjsip_inv_usage_init(g_endpt, &inv_cb);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+	status = pjsip_endpt_register_module(g_endpt, &load_agent);
+	PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+	g_print("Placing %d calls to %s at %.1f calls/s\n", run.total, run.uri, run.rate);
+	run_load();
+	print_results();
+
+	g_array_free(run.ring_times, TRUE);
+	g_array_free(run.answer_times, TRUE);
+	g_hash_table_destroy(run.causes);
+	pjsip_endpt_destroy(g_endpt);
+	pj_caching_pool_destroy(&cp);
+	return run.failed ? 2 : 0;
+}
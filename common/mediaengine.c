@@ -0,0 +1,478 @@
+#include <math.h>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include "mediaengine.h"
+
+/* Caps of the RTP stream on the wire */
+GstCaps *media_rtp_caps(void){
+   return gst_caps_new_simple(MIME,
+      "media", G_TYPE_STRING, MEDIA,
+      "clock-rate", G_TYPE_INT, CLOCK_RATE,
+      "encoding-name", G_TYPE_STRING, ENCODING,
+   NULL);
+}
+
+/* Same, with the payload type agreed for the stream */
+GstCaps *media_rtp_caps_pt(gint pt){
+   GstCaps *caps = media_rtp_caps();
+
+   gst_caps_set_simple(caps, "payload", G_TYPE_INT, pt, NULL);
+   return caps;
+}
+
+/* Caps of decoded audio as it leaves a receiver */
+GstCaps *media_raw_caps(void){
+   return gst_caps_new_simple("audio/x-raw-int",
+      "rate", G_TYPE_INT, MIX_RATE,
+      "channels", G_TYPE_INT, MIX_CHANNELS,
+      "width", G_TYPE_INT, 16,
+      "depth", G_TYPE_INT, 16,
+      "signed", G_TYPE_BOOLEAN, TRUE,
+      "endianness", G_TYPE_INT, G_BYTE_ORDER,
+   NULL);
+}
+
+/* VBR, so packet sizes follow the signal and receivers can estimate its level from them */
+void media_apply_profile(GstElement *encoder, const EncoderProfile *profile){
+   g_object_set(encoder,
+      "cbr", FALSE,
+      "frame-size", profile->frame_size,
+      "audio", profile->audio,
+      "bitrate", profile->bitrate,
+      "complexity", profile->complexity,
+      "inband-fec", profile->inband_fec,
+      "packet-loss-percentage", profile->packet_loss,
+   NULL);
+}
+
+/* Drops what a constructor created before it failed, the elements are not in a bin yet */
+static void unref_if(GstElement *element){
+   if(element)
+      gst_object_unref(element);
+}
+
+/* Energy of the raw audio going into the encoder, remembers when voice was last heard */
+static gboolean vad_probe(GstPad *pad, GstBuffer *buffer, MediaSender *sender){
+   const gint16 *samples = (const gint16 *)GST_BUFFER_DATA(buffer);
+   guint n = GST_BUFFER_SIZE(buffer) / sizeof(gint16);
+   gdouble sum = 0;
+   guint i;
+
+   if(!sender->vad || n == 0)
+      return TRUE;
+
+   for(i = 0; i < n; i++){
+      sum += (gdouble)samples[i] * samples[i];
+   }
+   if(10.0 * log10(sum / n / (32768.0 * 32768.0) + 1e-12) > VAD_THRESHOLD_DB){
+      sender->last_voice = GST_BUFFER_TIMESTAMP(buffer);
+   }
+   return TRUE;
+}
+
+/* Drop encoded frames while silent, before the payloader so the RTP sequence
+   stays contiguous and only the timestamp jumps over the gap */
+static gboolean dtx_probe(GstPad *pad, GstBuffer *buffer, MediaSender *sender){
+   GstClockTime ts = GST_BUFFER_TIMESTAMP(buffer);
+
+   if(sender->vad && GST_CLOCK_TIME_IS_VALID(ts)){
+      gboolean silent = !GST_CLOCK_TIME_IS_VALID(sender->last_voice) || ts > sender->last_voice + VAD_HANGOVER;
+      if(silent && GST_CLOCK_TIME_IS_VALID(sender->last_sent) && ts < sender->last_sent + DTX_REFRESH){
+         g_atomic_int_inc(&sender->dropped);
+         return FALSE;
+      }
+   }
+   sender->last_sent = ts;
+   g_atomic_int_inc(&sender->packets);
+   return TRUE;
+}
+
+MediaSender *media_sender_new(const gchar *name, GstElement *source, const EncoderProfile *profile){
+   MediaSender *sender;
+   GstPad *pad;
+
+   sender = g_new0(MediaSender, 1);
+   sender->source = source ? source : gst_element_factory_make("autoaudiosrc", NULL);
+   sender->convert = gst_element_factory_make("audioconvert", NULL);
+   sender->resample = gst_element_factory_make("audioresample", NULL);
+   sender->encoder = gst_element_factory_make("opusenc", NULL);
+   sender->tee = gst_element_factory_make("tee", NULL);
+   sender->pay = gst_element_factory_make("rtpopuspay", NULL);
+   sender->sink = gst_element_factory_make("multiudpsink", NULL);
+   sender->pipeline = gst_pipeline_new(name);
+
+   if(!sender->pipeline || !sender->source || !sender->convert || !sender->resample || !sender->encoder || !sender->tee || !sender->pay || !sender->sink){
+      g_printerr("Could not create all sender elements.\n");
+      /* A source passed in stays with the caller */
+      unref_if(sender->pipeline);
+      if(!source)
+         unref_if(sender->source);
+      unref_if(sender->convert);
+      unref_if(sender->resample);
+      unref_if(sender->encoder);
+      unref_if(sender->tee);
+      unref_if(sender->pay);
+      unref_if(sender->sink);
+      g_free(sender);
+      return NULL;
+   }
+   gst_object_ref_sink(sender->pipeline);
+
+   gst_bin_add_many(GST_BIN(sender->pipeline), sender->source, sender->convert, sender->resample, sender->encoder, sender->tee, sender->pay, sender->sink, NULL);
+   if(!gst_element_link_many(sender->source, sender->convert, sender->resample, sender->encoder, sender->tee, sender->pay, sender->sink, NULL)){
+      g_printerr("Could not link elements on sender side.\n");
+   }
+
+   sender->profile = profile ? profile : &media_profiles[0];
+   media_apply_profile(sender->encoder, sender->profile);
+
+   /* Voice activity detection around the encoder, only active while vad is set */
+   sender->last_voice = GST_CLOCK_TIME_NONE;
+   sender->last_sent = GST_CLOCK_TIME_NONE;
+   pad = gst_element_get_static_pad(sender->encoder, "sink");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(vad_probe), sender);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(sender->encoder, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(dtx_probe), sender);
+   gst_object_unref(pad);
+
+   return sender;
+}
+
+void media_sender_add(MediaSender *sender, const gchar *host, gint port){
+   g_signal_emit_by_name(sender->sink, "add", host, port, NULL);
+}
+
+void media_sender_remove(MediaSender *sender, const gchar *host, gint port){
+   g_signal_emit_by_name(sender->sink, "remove", host, port, NULL);
+}
+
+/* opusenc reads its settings when it starts, a running sender is restarted */
+void media_sender_set_profile(MediaSender *sender, const EncoderProfile *profile){
+   GstState state;
+
+   gst_element_get_state(sender->pipeline, &state, NULL, 0);
+   sender->profile = profile;
+   if(state > GST_STATE_READY)
+      gst_element_set_state(sender->pipeline, GST_STATE_READY);
+   media_apply_profile(sender->encoder, profile);
+   if(state > GST_STATE_READY)
+      gst_element_set_state(sender->pipeline, state);
+}
+
+void media_sender_set_vad(MediaSender *sender, gboolean vad){
+   sender->vad = vad;
+   g_object_set(sender->encoder, "dtx", vad, NULL);
+}
+
+/* multiudpsink sending with payload type pt, a new branch off the tee for a type
+   not seen before. Branches stay until the sender is freed, without clients they
+   only payload */
+static GstElement *sender_sink_for(MediaSender *sender, gint pt, gboolean create){
+   SendBranch *branch;
+   GList *l;
+   gint default_pt;
+
+   g_object_get(sender->pay, "pt", &default_pt, NULL);
+   if(pt == default_pt)
+      return sender->sink;
+   for(l = sender->branches; l; l = l->next){
+      branch = l->data;
+      if(branch->pt == pt)
+         return branch->sink;
+   }
+   if(!create)
+      return NULL;
+
+   branch = g_new0(SendBranch, 1);
+   branch->pt = pt;
+   branch->pay = gst_element_factory_make("rtpopuspay", NULL);
+   branch->sink = gst_element_factory_make("multiudpsink", NULL);
+   if(!branch->pay || !branch->sink){
+      g_printerr("Could not create sender branch for payload type %d.\n", pt);
+      if(branch->pay)
+         gst_object_unref(branch->pay);
+      if(branch->sink)
+         gst_object_unref(branch->sink);
+      g_free(branch);
+      return NULL;
+   }
+   g_object_set(branch->pay, "pt", pt, NULL);
+   gst_bin_add_many(GST_BIN(sender->pipeline), branch->pay, branch->sink, NULL);
+   if(!gst_element_link_many(sender->tee, branch->pay, branch->sink, NULL))
+      g_printerr("Could not link sender branch for payload type %d.\n", pt);
+   gst_element_sync_state_with_parent(branch->sink);
+   gst_element_sync_state_with_parent(branch->pay);
+   sender->branches = g_list_prepend(sender->branches, branch);
+   return branch->sink;
+}
+
+void media_sender_add_pt(MediaSender *sender, const gchar *host, gint port, gint pt){
+   GstElement *sink = sender_sink_for(sender, pt, TRUE);
+
+   if(sink)
+      g_signal_emit_by_name(sink, "add", host, port, NULL);
+}
+
+void media_sender_remove_pt(MediaSender *sender, const gchar *host, gint port, gint pt){
+   GstElement *sink = sender_sink_for(sender, pt, FALSE);
+
+   if(sink)
+      g_signal_emit_by_name(sink, "remove", host, port, NULL);
+}
+
+void media_sender_free(MediaSender *sender){
+   gst_element_set_state(sender->pipeline, GST_STATE_NULL);
+   gst_object_unref(sender->pipeline);
+   g_list_free_full(sender->branches, g_free);
+   g_free(sender);
+}
+
+/* Loss, duplicates, late packets and RFC 3550 interarrival jitter for every packet arriving */
+static gboolean jitter_probe(GstPad *pad, GstBuffer *buffer, MediaReceiver *rec){
+   JitterStats *js = &rec->jstats;
+   guint16 seq;
+   guint32 ts;
+   gint delta;
+   gdouble transit;
+
+   if(!gst_rtp_buffer_validate(buffer))
+      return TRUE;
+
+   seq = gst_rtp_buffer_get_seq(buffer);
+   ts = gst_rtp_buffer_get_timestamp(buffer);
+
+   g_mutex_lock(&js->lock);
+   /* The jitterbuffer drops what is older than what it already pushed out */
+   if(!js->out_started || (gint16)(seq - js->out_seq) > 0)
+      js->level++;
+   if(!js->started){
+      js->started = TRUE;
+      js->max_seq = seq;
+      js->ext_max = js->ext_base = seq;
+      js->window = 1;
+      js->received = 1;
+      js->base_ts = ts;
+      js->last_transit = js->min_transit = g_get_monotonic_time() / 1000.0;
+      g_mutex_unlock(&js->lock);
+      return TRUE;
+   }
+
+   /* Arrival time minus media time, in ms */
+   transit = g_get_monotonic_time() / 1000.0 - (gint32)(ts - js->base_ts) * 1000.0 / CLOCK_RATE;
+   js->jitter += (ABS(transit - js->last_transit) - js->jitter) / 16.0;
+   js->last_transit = transit;
+   js->min_transit = MIN(js->min_transit, transit);
+   if(transit - js->min_transit > js->latency)
+      js->late++;
+
+   delta = (gint16)(seq - js->max_seq);
+   if(delta > 0){
+      js->window = delta >= 64 ? 1 : (js->window << delta) | 1;
+      js->max_seq = seq;
+      js->ext_max += delta;
+      js->received++;
+   }
+   else if(-delta < 64){
+      if(js->window & (G_GUINT64_CONSTANT(1) << -delta)){
+         /* Dropped by the jitterbuffer as well */
+         js->duplicates++;
+         if(!js->out_started || (gint16)(seq - js->out_seq) > 0)
+            js->level--;
+      }
+      else{
+         js->window |= G_GUINT64_CONSTANT(1) << -delta;
+         js->received++;
+      }
+   }
+   g_mutex_unlock(&js->lock);
+   return TRUE;
+}
+
+/* Packets leaving the jitterbuffer, the difference to the arrivals it kept is its fill level */
+static gboolean jitter_out_probe(GstPad *pad, GstBuffer *buffer, MediaReceiver *rec){
+   JitterStats *js = &rec->jstats;
+
+   g_mutex_lock(&js->lock);
+   js->level = MAX(js->level - 1, 0);
+   if(gst_rtp_buffer_validate(buffer)){
+      js->out_seq = gst_rtp_buffer_get_seq(buffer);
+      js->out_started = TRUE;
+   }
+   g_mutex_unlock(&js->lock);
+   return TRUE;
+}
+
+MediaReceiver *media_receiver_new(gint port){
+   MediaReceiver *rec;
+   gchar *bin_name;
+   GstCaps *caps;
+   GstPad *pad;
+
+   /* Name the branch: RecBin<PORT> */
+   rec = g_new0(MediaReceiver, 1);
+   rec->port = port;
+   bin_name = g_strdup_printf("RecBin%d", port);
+   rec->bin = gst_bin_new(bin_name);
+   g_free(bin_name);
+
+   rec->source = gst_element_factory_make("udpsrc", NULL);
+   rec->jitterbuffer = gst_element_factory_make("gstrtpjitterbuffer", NULL);
+   rec->depay = gst_element_factory_make("rtpopusdepay", NULL);
+   rec->decoder = gst_element_factory_make("opusdec", NULL);
+   rec->convert = gst_element_factory_make("audioconvert", NULL);
+   rec->filter = gst_element_factory_make("capsfilter", NULL);
+
+   if(!rec->bin || !rec->source || !rec->jitterbuffer || !rec->depay || !rec->decoder || !rec->convert || !rec->filter){
+      g_printerr("Could not create all receiver elements.\n");
+      unref_if(rec->bin);
+      unref_if(rec->source);
+      unref_if(rec->jitterbuffer);
+      unref_if(rec->depay);
+      unref_if(rec->decoder);
+      unref_if(rec->convert);
+      unref_if(rec->filter);
+      g_free(rec);
+      return NULL;
+   }
+   gst_object_ref_sink(rec->bin);
+   g_mutex_init(&rec->jstats.lock);
+   rec->jstats.latency = JB_START_MS;
+
+   gst_bin_add_many(GST_BIN(rec->bin), rec->source, rec->jitterbuffer, rec->depay, rec->decoder, rec->convert, rec->filter, NULL);
+   gst_element_link_many(rec->source, rec->jitterbuffer, rec->depay, rec->decoder, rec->convert, rec->filter, NULL);
+
+   caps = media_rtp_caps();
+   /* Without reuse a port another receiver holds fails the PAUSED state change,
+      udpsrc binds when it starts */
+   g_object_set(rec->source, "caps", caps, "port", port, "reuse", FALSE, NULL);
+   gst_caps_unref(caps);
+   g_object_set(rec->jitterbuffer, "latency", JB_START_MS, NULL);
+   /* Recover lost packets from the in-band FEC sent by the peer */
+   g_object_set(rec->decoder, "use-inband-fec", TRUE, NULL);
+
+   caps = media_raw_caps();
+   g_object_set(rec->filter, "caps", caps, NULL);
+   gst_caps_unref(caps);
+
+   pad = gst_element_get_static_pad(rec->filter, "src");
+   gst_element_add_pad(rec->bin, gst_ghost_pad_new("src", pad));
+   gst_object_unref(pad);
+
+   pad = gst_element_get_static_pad(rec->source, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(jitter_probe), rec);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(rec->jitterbuffer, "src");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(jitter_out_probe), rec);
+   gst_object_unref(pad);
+
+   return rec;
+}
+
+/* Point a stopped receiver at another port, statistics start over */
+void media_receiver_set_port(MediaReceiver *rec, gint port){
+   gchar *bin_name;
+
+   bin_name = g_strdup_printf("RecBin%d", port);
+   gst_object_set_name(GST_OBJECT(rec->bin), bin_name);
+   g_free(bin_name);
+   g_object_set(rec->source, "port", port, NULL);
+   rec->port = port;
+   media_receiver_reset(rec);
+}
+
+/* Start counting from scratch, used when a receiver is (re)attached to a stream */
+void media_receiver_reset(MediaReceiver *rec){
+   JitterStats *js = &rec->jstats;
+
+   g_mutex_lock(&js->lock);
+   js->started = FALSE;
+   js->window = 0;
+   js->received = js->duplicates = js->late = js->last_late = 0;
+   js->jitter = 0;
+   js->level = 0;
+   js->out_started = FALSE;
+   js->latency = JB_START_MS;
+   g_mutex_unlock(&js->lock);
+   g_object_set(rec->jitterbuffer, "latency", JB_START_MS, NULL);
+}
+
+/* Redistribute the latency in the pipeline the receiver runs in. Done here as
+   well as on the LATENCY message, a pipeline nested in a plain bin never gets
+   its bus messages to the application */
+static void recalculate_latency(MediaReceiver *rec){
+   GstObject *parent = gst_object_get_parent(GST_OBJECT(rec->bin));
+   GstObject *next;
+
+   while(parent && !GST_IS_PIPELINE(parent)){
+      next = gst_object_get_parent(parent);
+      gst_object_unref(parent);
+      parent = next;
+   }
+   if(parent){
+      gst_bin_recalculate_latency(GST_BIN(parent));
+      gst_object_unref(parent);
+   }
+}
+
+/* Size the jitterbuffer from the measured jitter: grow quickly when packets
+   arrive late, shrink slowly towards JB_JITTER_FACTOR times the jitter.
+   Called every JB_INTERVAL_MS, prints the statistics when dump is set */
+void media_receiver_adapt(MediaReceiver *rec, gboolean dump){
+   JitterStats *js = &rec->jstats;
+   guint target, latency;
+   gint64 lost;
+
+   g_mutex_lock(&js->lock);
+   target = CLAMP(JB_MARGIN_MS + JB_JITTER_FACTOR * js->jitter, JB_MIN_MS, JB_MAX_MS);
+   latency = js->latency;
+   if(js->late > js->last_late){
+      latency = MAX(latency + JB_LATE_STEP_MS, target);
+   }
+   else if(target < latency){
+      latency -= (latency - target + 3) / 4;
+   }
+   else{
+      latency = target;
+   }
+   latency = CLAMP(latency, JB_MIN_MS, JB_MAX_MS);
+   js->last_late = js->late;
+
+   lost = (gint64)(js->ext_max - js->ext_base + 1) - (gint64)js->received;
+   if(dump && js->started){
+      g_print("Port %d: jitter %.2f ms, lost %" G_GINT64_FORMAT ", late %" G_GUINT64_FORMAT
+         ", duplicates %" G_GUINT64_FORMAT ", level %d packets, latency %u ms\n",
+         rec->port, js->jitter, MAX(lost, 0), js->late, js->duplicates, js->level, js->latency);
+   }
+   if(latency != js->latency){
+      js->latency = latency;
+      g_mutex_unlock(&js->lock);
+      g_object_set(rec->jitterbuffer, "latency", latency, NULL);
+      recalculate_latency(rec);
+      return;
+   }
+   g_mutex_unlock(&js->lock);
+}
+
+/* Bus watch for the pipelines receivers run in: a jitterbuffer that changed its
+   latency posts LATENCY, the sinks then have to wait longer for its buffers */
+gboolean media_latency_cb(GstBus *bus, GstMessage *msg, GstElement *pipeline){
+   if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_LATENCY)
+      gst_bin_recalculate_latency(GST_BIN(pipeline));
+   return TRUE;
+}
+
+/* The stream is labelled with the payload type agreed in SDP, takes effect on the next start */
+void media_receiver_set_payload(MediaReceiver *rec, gint pt){
+   GstCaps *caps = media_rtp_caps_pt(pt);
+
+   g_object_set(rec->source, "caps", caps, NULL);
+   gst_caps_unref(caps);
+}
+
+void media_receiver_free(MediaReceiver *rec){
+   gst_element_set_state(rec->bin, GST_STATE_NULL);
+   gst_object_unref(rec->bin);
+   g_mutex_clear(&rec->jstats.lock);
+   g_free(rec);
+}
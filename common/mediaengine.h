@@ -0,0 +1,121 @@
+/* Media engine shared by the audio conference (Lab2) and the IP phone (Lab3).
+   Builds the Opus over RTP sender and receiver chains, and keeps their caps
+   and jitterbuffer tuning in one place, the encoder profiles are in mediaformat.h. */
+#ifndef MEDIAENGINE_H
+#define MEDIAENGINE_H
+
+#include <gst/gst.h>
+#include "mediaformat.h"
+
+/* Voice activity detection on the sender, frames quieter than VAD_THRESHOLD_DB
+   dBFS for longer than VAD_HANGOVER are not sent, except one every DTX_REFRESH
+   so the receivers keep comfort noise */
+#define VAD_THRESHOLD_DB -50.0
+#define VAD_HANGOVER (300 * GST_MSECOND)
+#define DTX_REFRESH (400 * GST_MSECOND)
+
+/* Jitterbuffer latency follows the measured interarrival jitter, it starts low
+   and is re-evaluated every JB_INTERVAL_MS within JB_MIN_MS..JB_MAX_MS */
+#define JB_START_MS 50
+#define JB_MIN_MS 20
+#define JB_MAX_MS 400
+#define JB_MARGIN_MS 10
+#define JB_JITTER_FACTOR 4
+#define JB_LATE_STEP_MS 20
+#define JB_INTERVAL_MS 1000
+
+/* RTP reception statistics of one stream, measured in front of the jitterbuffer */
+typedef struct _JitterStats {
+   GMutex lock;
+   gboolean started;
+   guint16 max_seq;
+   guint64 ext_max;
+   guint64 ext_base;
+   guint64 window;
+   guint64 received;
+   guint64 duplicates;
+   guint64 late;
+   guint64 last_late;
+   guint32 base_ts;
+   gdouble last_transit;
+   gdouble min_transit;
+   gdouble jitter;
+   gint level;
+   guint latency;
+
+   /* Last sequence number out of the jitterbuffer, it drops anything older
+      so such arrivals are not counted in level */
+   gboolean out_started;
+   guint16 out_seq;
+} JitterStats;
+
+/* Payloader and destinations for one more payload type, off the sender's tee */
+typedef struct _SendBranch {
+   gint pt;
+   GstElement *pay;
+   GstElement *sink;
+} SendBranch;
+
+/* source ! audioconvert ! audioresample ! opusenc ! tee ! rtpopuspay ! multiudpsink,
+   pay and sink use the default payload type, other types get a SendBranch */
+typedef struct _MediaSender {
+   GstElement *pipeline;
+   GstElement *source;
+   GstElement *convert;
+   GstElement *resample;
+   GstElement *encoder;
+   GstElement *tee;
+   GstElement *pay;
+   GstElement *sink;
+   GList *branches;
+   const EncoderProfile *profile;
+
+   /* Voice activity detection and discontinuous transmission */
+   gboolean vad;
+   GstClockTime last_voice;
+   GstClockTime last_sent;
+   volatile gint packets;
+   volatile gint dropped;
+} MediaSender;
+
+/* udpsrc ! jitterbuffer ! rtpopusdepay ! opusdec ! audioconvert ! capsfilter,
+   a bin with the decoded audio on ghost pad "src" */
+typedef struct _MediaReceiver {
+   gint port;
+   GstElement *bin;
+   GstElement *source;
+   GstElement *jitterbuffer;
+   GstElement *depay;
+   GstElement *decoder;
+   GstElement *convert;
+   GstElement *filter;
+
+   JitterStats jstats;
+} MediaReceiver;
+
+GstCaps *media_rtp_caps(void);
+GstCaps *media_rtp_caps_pt(gint pt);
+GstCaps *media_raw_caps(void);
+
+void media_apply_profile(GstElement *encoder, const EncoderProfile *profile);
+
+/* source may be NULL for the default microphone, the pipeline is left in NULL */
+MediaSender *media_sender_new(const gchar *name, GstElement *source, const EncoderProfile *profile);
+void media_sender_add(MediaSender *sender, const gchar *host, gint port);
+void media_sender_remove(MediaSender *sender, const gchar *host, gint port);
+void media_sender_set_profile(MediaSender *sender, const EncoderProfile *profile);
+void media_sender_set_vad(MediaSender *sender, gboolean vad);
+void media_sender_add_pt(MediaSender *sender, const gchar *host, gint port, gint pt);
+void media_sender_remove_pt(MediaSender *sender, const gchar *host, gint port, gint pt);
+void media_sender_free(MediaSender *sender);
+
+/* The bin is owned by the receiver, adding it to a pipeline takes another reference */
+MediaReceiver *media_receiver_new(gint port);
+void media_receiver_set_port(MediaReceiver *rec, gint port);
+void media_receiver_reset(MediaReceiver *rec);
+void media_receiver_set_payload(MediaReceiver *rec, gint pt);
+void media_receiver_adapt(MediaReceiver *rec, gboolean dump);
+gboolean media_latency_cb(GstBus *bus, GstMessage *msg, GstElement *pipeline);
+void media_receiver_free(MediaReceiver *rec);
+
+#endif
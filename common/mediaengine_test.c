@@ -0,0 +1,199 @@
+/* Headless tests of the media engine: audiotestsrc senders looped back over UDP
+   to receivers ending in fakesinks. Reports CPU per stream at the end. */
+#include <sys/resource.h>
+#include <gst/gst.h>
+#include "mediaengine.h"
+
+#define TEST_PORT 5400
+#define RUN_MS 1000
+#define DRAIN_MS 300
+#define BENCH_STREAMS 8
+
+/* receiver ! fakesink, counting the decoded buffers */
+typedef struct _Loopback {
+   GstElement *pipeline;
+   MediaReceiver *rec;
+   volatile gint buffers;
+} Loopback;
+
+static gboolean count_probe(GstPad *pad, GstBuffer *buffer, Loopback *lb){
+   g_atomic_int_inc(&lb->buffers);
+   return TRUE;
+}
+
+/* pt 0 leaves the payload type open */
+static Loopback *loopback_new(gint port, gint pt){
+   Loopback *lb = g_new0(Loopback, 1);
+   GstElement *sink;
+   GstPad *pad;
+
+   lb->rec = media_receiver_new(port);
+   g_assert(lb->rec);
+   if(pt)
+      media_receiver_set_payload(lb->rec, pt);
+   lb->pipeline = gst_pipeline_new(NULL);
+   sink = gst_element_factory_make("fakesink", NULL);
+   g_assert(lb->pipeline && sink);
+   g_object_set(sink, "sync", FALSE, NULL);
+   gst_bin_add_many(GST_BIN(lb->pipeline), lb->rec->bin, sink, NULL);
+   g_assert(gst_element_link(lb->rec->bin, sink));
+
+   pad = gst_element_get_static_pad(sink, "sink");
+   gst_pad_add_buffer_probe(pad, G_CALLBACK(count_probe), lb);
+   gst_object_unref(pad);
+   gst_element_set_state(lb->pipeline, GST_STATE_PLAYING);
+   return lb;
+}
+
+static void loopback_free(Loopback *lb){
+   gst_element_set_state(lb->pipeline, GST_STATE_NULL);
+   gst_object_unref(lb->pipeline);
+   media_receiver_free(lb->rec);
+   g_free(lb);
+}
+
+static MediaSender *test_sender(const EncoderProfile *profile){
+   GstElement *source = gst_element_factory_make("audiotestsrc", NULL);
+   MediaSender *sender;
+
+   g_assert(source);
+   g_object_set(source, "is-live", TRUE, NULL);
+   sender = media_sender_new(NULL, source, profile);
+   g_assert(sender);
+   gst_element_set_state(sender->pipeline, GST_STATE_PLAYING);
+   return sender;
+}
+
+/* Let the pipelines run from the main loop for ms */
+static void run_for(guint ms){
+   GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+
+   g_timeout_add(ms, (GSourceFunc)g_main_loop_quit, loop);
+   g_main_loop_run(loop);
+   g_main_loop_unref(loop);
+}
+
+static gint64 cpu_time(void){
+   struct rusage ru;
+
+   getrusage(RUSAGE_SELF, &ru);
+   return (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void test_loopback(void){
+   MediaSender *sender = test_sender(NULL);
+   Loopback *lb = loopback_new(TEST_PORT, 0);
+
+   media_sender_add(sender, "127.0.0.1", TEST_PORT);
+   run_for(RUN_MS);
+   g_assert_cmpint(g_atomic_int_get(&lb->buffers), >, 0);
+   g_assert_cmpint(g_atomic_int_get(&sender->packets), >, 0);
+
+   media_sender_free(sender);
+   loopback_free(lb);
+}
+
+static void test_remove(void){
+   MediaSender *sender = test_sender(NULL);
+   Loopback *lb = loopback_new(TEST_PORT + 2, 0);
+   gint buffers;
+
+   media_sender_add(sender, "127.0.0.1", TEST_PORT + 2);
+   run_for(RUN_MS);
+   g_assert_cmpint(g_atomic_int_get(&lb->buffers), >, 0);
+
+   /* Nothing arrives once the jitterbuffer has drained */
+   media_sender_remove(sender, "127.0.0.1", TEST_PORT + 2);
+   run_for(JB_MAX_MS + DRAIN_MS);
+   buffers = g_atomic_int_get(&lb->buffers);
+   run_for(RUN_MS);
+   g_assert_cmpint(g_atomic_int_get(&lb->buffers), ==, buffers);
+
+   media_sender_free(sender);
+   loopback_free(lb);
+}
+
+/* The encoder restarts with the new profile and the stream continues */
+static void test_profile(void){
+   MediaSender *sender = test_sender(NULL);
+   Loopback *lb = loopback_new(TEST_PORT + 4, 0);
+   const EncoderProfile *hifi = media_find_profile("hifi");
+   gint buffers;
+
+   g_assert(hifi);
+   media_sender_add(sender, "127.0.0.1", TEST_PORT + 4);
+   run_for(RUN_MS);
+   buffers = g_atomic_int_get(&lb->buffers);
+   g_assert_cmpint(buffers, >, 0);
+
+   media_sender_set_profile(sender, hifi);
+   g_assert(sender->profile == hifi);
+   run_for(RUN_MS);
+   g_assert_cmpint(g_atomic_int_get(&lb->buffers), >, buffers);
+
+   media_sender_free(sender);
+   loopback_free(lb);
+}
+
+/* A second payload type goes out on its own branch to a receiver expecting it */
+static void test_payload_type(void){
+   MediaSender *sender = test_sender(NULL);
+   Loopback *lb96 = loopback_new(TEST_PORT + 6, 96);
+   Loopback *lb97 = loopback_new(TEST_PORT + 8, 97);
+
+   media_sender_add_pt(sender, "127.0.0.1", TEST_PORT + 6, 96);
+   media_sender_add_pt(sender, "127.0.0.1", TEST_PORT + 8, 97);
+
+   run_for(RUN_MS);
+   g_assert_cmpint(g_atomic_int_get(&lb96->buffers), >, 0);
+   g_assert_cmpint(g_atomic_int_get(&lb97->buffers), >, 0);
+   g_assert_cmpuint(g_list_length(sender->branches), ==, 1);
+
+   media_sender_free(sender);
+   loopback_free(lb96);
+   loopback_free(lb97);
+}
+
+/* CPU of BENCH_STREAMS encode and decode pairs for every profile */
+static void bench_streams(void){
+   MediaSender *senders[BENCH_STREAMS];
+   Loopback *lbs[BENCH_STREAMS];
+   gint64 cpu, wall;
+   guint p;
+   gint i;
+
+   for(p = 0; p < media_n_profiles; p++){
+      for(i = 0; i < BENCH_STREAMS; i++){
+         senders[i] = test_sender(&media_profiles[p]);
+         lbs[i] = loopback_new(TEST_PORT + 100 + 2 * i, 0);
+         media_sender_add(senders[i], "127.0.0.1", TEST_PORT + 100 + 2 * i);
+      }
+      /* Past startup before measuring */
+      run_for(DRAIN_MS);
+      cpu = cpu_time();
+      wall = g_get_monotonic_time();
+      run_for(RUN_MS);
+      cpu = cpu_time() - cpu;
+      wall = g_get_monotonic_time() - wall;
+
+      g_print("%s: %d streams, CPU %.1f%% total, %.2f%% per stream\n", media_profiles[p].name, BENCH_STREAMS,
+         100.0 * cpu / wall, 100.0 * cpu / wall / BENCH_STREAMS);
+      for(i = 0; i < BENCH_STREAMS; i++){
+         g_assert_cmpint(g_atomic_int_get(&lbs[i]->buffers), >, 0);
+         media_sender_free(senders[i]);
+         loopback_free(lbs[i]);
+      }
+   }
+}
+
+int main(int argc, char *argv[]){
+   gst_init(&argc, &argv);
+   g_test_init(&argc, &argv, NULL);
+
+   g_test_add_func("/mediaengine/loopback", test_loopback);
+   g_test_add_func("/mediaengine/remove", test_remove);
+   g_test_add_func("/mediaengine/set-profile", test_profile);
+   g_test_add_func("/mediaengine/payload-type", test_payload_type);
+   g_test_add_func("/mediaengine/cpu-per-stream", bench_streams);
+   return g_test_run();
+}
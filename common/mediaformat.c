@@ -0,0 +1,19 @@
+#include "mediaformat.h"
+
+const EncoderProfile media_profiles[] = {
+   { "lowlatency-voice", 10, FALSE, 32000, 3, TRUE, 10 },
+   { "hifi", 20, TRUE, 128000, 10, FALSE, 0 },
+   { "lowcpu", 40, FALSE, 16000, 0, FALSE, 0 },
+};
+
+const guint media_n_profiles = G_N_ELEMENTS(media_profiles);
+
+const EncoderProfile *media_find_profile(const gchar *name){
+   guint i;
+
+   for(i = 0; i < media_n_profiles; i++){
+      if(g_ascii_strcasecmp(media_profiles[i].name, name) == 0)
+         return &media_profiles[i];
+   }
+   return NULL;
+}
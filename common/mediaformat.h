@@ -0,0 +1,40 @@
+/* Stream format and Opus encoder profiles shared by the media engine and the
+   SDP code. Plain GLib, so tools that only speak SIP/SDP need no GStreamer. */
+#ifndef MEDIAFORMAT_H
+#define MEDIAFORMAT_H
+
+#include <glib.h>
+
+#define MIME "application/x-rtp"
+#define MEDIA "audio"
+#define CLOCK_RATE 48000
+#define ENCODING "X-GST-OPUS-DRAFT-SPITTKA-00"
+
+/* Name of the same payload format in SDP, RFC 7587 */
+#define SDP_ENCODING "opus"
+#define SDP_CHANNELS "2"
+
+/* Format decoded audio leaves a receiver in */
+#define MIX_RATE 48000
+#define MIX_CHANNELS 1
+
+/* Encoder lookahead on top of the frame size */
+#define OPUS_LOOKAHEAD_MS 6.5
+
+/* Opus encoder settings, the first entry of media_profiles is the default */
+typedef struct _EncoderProfile {
+   const gchar *name;
+   gint frame_size;      /* ms */
+   gboolean audio;       /* FALSE selects the VOIP application */
+   gint bitrate;
+   gint complexity;
+   gboolean inband_fec;
+   gint packet_loss;     /* expected loss in %, sizes the FEC */
+} EncoderProfile;
+
+extern const EncoderProfile media_profiles[];
+extern const guint media_n_profiles;
+
+const EncoderProfile *media_find_profile(const gchar *name);
+
+#endif